@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+#include <openssl/x509v3.h>
+
+#include "ca_index.h"
+
+#define ISSUER_DEPTH 8		/* intermediates followed inside the index */
+
+struct cert {
+	struct ca_index_entry e;
+	unsigned char *der;
+};
+
+static int
+cmp_cert(const void *a, const void *b)
+{
+	uint32_t x = ((const struct cert *)a)->e.hash;
+	uint32_t y = ((const struct cert *)b)->e.hash;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Compile the PEM file bundle into the index file. */
+int
+ca_index_compile(const char *bundle, const char *file)
+{
+	STACK_OF(X509_INFO) *info;
+	struct ca_index_head head;
+	struct cert *cert;
+	char tmp[PATH_MAX];
+	uint32_t off;
+	FILE *fp;
+	BIO *bio;
+	int n = 0;
+
+	if ((bio = BIO_new_file(bundle, "r")) == NULL) {
+		warnx("%s: unable to open", bundle);
+		return -1;
+	}
+	info = PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (info == NULL) {
+		warnx("%s: unable to read certificates", bundle);
+		return -1;
+	}
+
+	if ((cert = calloc(sk_X509_INFO_num(info), sizeof *cert)) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (int i = 0; i < sk_X509_INFO_num(info); i++) {
+		X509 *x = sk_X509_INFO_value(info, i)->x509;
+		int len;
+
+		if (x == NULL)	/* CRL or key */
+			continue;
+		cert[n].der = NULL;
+		if ((len = i2d_X509(x, &cert[n].der)) <= 0)
+			errx(EXIT_FAILURE, "%s: unable to encode certificate",
+			    bundle);
+		cert[n].e.hash = X509_NAME_hash(X509_get_subject_name(x));
+		cert[n].e.len = len;
+		n++;
+	}
+	sk_X509_INFO_pop_free(info, X509_INFO_free);
+
+	qsort(cert, n, sizeof *cert, cmp_cert);
+
+	head.magic = CA_INDEX_MAGIC;
+	head.count = n;
+	off = sizeof head + n * sizeof(struct ca_index_entry);
+	for (int i = 0; i < n; i++) {
+		cert[i].e.off = off;
+		off += cert[i].e.len;
+	}
+
+	/* replace the index atomically, tlsc may read it at any time */
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", file) >= (int)sizeof tmp)
+		errx(EXIT_FAILURE, "path too long: %s", file);
+	if ((fp = fdopen(mkstemp(tmp), "w")) == NULL)
+		err(EXIT_FAILURE, "%s", tmp);
+	fwrite(&head, sizeof head, 1, fp);
+	for (int i = 0; i < n; i++)
+		fwrite(&cert[i].e, sizeof cert[i].e, 1, fp);
+	for (int i = 0; i < n; i++) {
+		fwrite(cert[i].der, cert[i].e.len, 1, fp);
+		OPENSSL_free(cert[i].der);
+	}
+	if (fflush(fp) == EOF || ferror(fp) || fchmod(fileno(fp), 0644) == -1)
+		err(EXIT_FAILURE, "%s", tmp);
+	if (fclose(fp) == EOF)
+		err(EXIT_FAILURE, "fclose");
+	if (rename(tmp, file) == -1)
+		err(EXIT_FAILURE, "rename: %s", file);
+	free(cert);
+
+	return n;
+}
+
+/*
+ * Add every certificate of the index to the store, which has the issuer of
+ * cert as its subject.  Intermediates found this way are followed up to
+ * depth levels, so the server may leave out those held in the index.
+ */
+static void
+add_issuers(X509_STORE *store, X509 *cert, const unsigned char *map,
+    size_t size, int depth)
+{
+	const struct ca_index_head *head = (const void *)map;
+	const struct ca_index_entry *e = (const void *)(head + 1);
+	X509_NAME *issuer = X509_get_issuer_name(cert);
+	uint32_t hash = X509_NAME_hash(issuer);
+	size_t lo = 0, hi = head->count;
+
+	/* find the first entry of hash */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (e[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < head->count && e[lo].hash == hash; lo++) {
+		const unsigned char *der = map + e[lo].off;
+		X509_NAME *subject;
+		X509 *ca;
+
+		if ((size_t)e[lo].off + e[lo].len > size)
+			break;
+		if ((ca = d2i_X509(NULL, &der, e[lo].len)) == NULL)
+			continue;
+		subject = X509_get_subject_name(ca);
+		if (X509_NAME_cmp(subject, issuer) == 0) {
+			X509_STORE_add_cert(store, ca);
+			/* not a root, look for its issuer, too */
+			if (depth > 0 && X509_NAME_cmp(subject,
+			    X509_get_issuer_name(ca)) != 0)
+				add_issuers(store, ca, map, size, depth - 1);
+		}
+		X509_free(ca);
+	}
+}
+
+/*
+ * Verify the PEM encoded certificate chain of the peer against the roots of
+ * the index file.  Just the certificates which issued one of the chain
+ * certificates, or one of their issuers, are decoded.
+ */
+int
+ca_index_verify(const char *file, const char *chain, size_t len,
+    bool check_time, const char **errstr)
+{
+	const struct ca_index_head *head;
+	STACK_OF(X509) *untrusted = NULL;
+	X509_STORE_CTX *ctx = NULL;
+	X509_STORE *store = NULL;
+	unsigned char *map;
+	struct stat st;
+	X509 *cert;
+	BIO *bio;
+	int ret = -1;
+	int fd;
+
+	*errstr = NULL;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(EXIT_FAILURE, "open: %s", file);
+	if (fstat(fd, &st) == -1)
+		err(EXIT_FAILURE, "fstat: %s", file);
+	if ((size_t)st.st_size < sizeof *head)
+		errx(EXIT_FAILURE, "%s: invalid CA index", file);
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap: %s", file);
+	close(fd);
+
+	head = (const void *)map;
+	if (head->magic != CA_INDEX_MAGIC || sizeof *head + head->count *
+	    sizeof(struct ca_index_entry) > (size_t)st.st_size)
+		errx(EXIT_FAILURE, "%s: invalid CA index", file);
+
+	/* peer certificate and its intermediates */
+	if ((bio = BIO_new_mem_buf(chain, len)) == NULL ||
+	    (untrusted = sk_X509_new_null()) == NULL ||
+	    (store = X509_STORE_new()) == NULL ||
+	    (ctx = X509_STORE_CTX_new()) == NULL)
+		errx(EXIT_FAILURE, "out of memory");
+	while ((cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+		add_issuers(store, cert, map, st.st_size, ISSUER_DEPTH);
+		if (sk_X509_push(untrusted, cert) == 0)
+			errx(EXIT_FAILURE, "out of memory");
+	}
+	BIO_free(bio);
+
+	if (sk_X509_num(untrusted) == 0) {
+		*errstr = "no peer certificate";
+		goto out;
+	}
+
+	if (X509_STORE_CTX_init(ctx, store, sk_X509_value(untrusted, 0),
+	    untrusted) != 1)
+		errx(EXIT_FAILURE, "X509_STORE_CTX_init");
+	X509_STORE_CTX_set_purpose(ctx, X509_PURPOSE_SSL_SERVER);
+	if (!check_time)
+		X509_STORE_CTX_set_flags(ctx, X509_V_FLAG_NO_CHECK_TIME);
+
+	if (X509_verify_cert(ctx) == 1)
+		ret = 0;
+	else
+		*errstr = X509_verify_cert_error_string(
+		    X509_STORE_CTX_get_error(ctx));
+ out:
+	X509_STORE_CTX_free(ctx);
+	X509_STORE_free(store);
+	sk_X509_pop_free(untrusted, X509_free);
+	munmap(map, st.st_size);
+
+	return ret;
+}
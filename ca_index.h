@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CA_INDEX_H
+#define CA_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compiled CA bundle: A sorted table of subject name hashes followed by the
+ * DER encoded certificates.  It is written by tlsca and mapped into memory
+ * by tlsc, which just decodes the roots it needs for the current peer.  The
+ * byte order is the one of the host that compiled the file.
+ */
+
+#define CA_INDEX_MAGIC 0x63616931	/* "cai1" */
+
+struct ca_index_head {
+	uint32_t magic;
+	uint32_t count;
+};
+
+struct ca_index_entry {
+	uint32_t hash;		/* X509_NAME_hash() of the subject */
+	uint32_t off;		/* offset of the DER data in the file */
+	uint32_t len;
+};
+
+int ca_index_compile(const char *bundle, const char *file);
+int ca_index_verify(const char *file, const char *chain, size_t len,
+    bool check_time, const char **errstr);
+
+#endif
@@ -14,18 +14,215 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
+#if defined(__GNUC__) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#define HTTP_SIMD
+#endif
+
 #include "http_parser.h"
 
 /* string max compare */
 #define strmcmp(a, b)	\
 	strncmp((a), (b), strlen(b))
 
+#define IS_OWS(c)	((c) == ' ' || (c) == '\t')
+
+/*
+ * Find the next line feed.  Vector units compare 32 or 16 bytes at once,
+ * the tail and other machines use memchr(3).
+ */
+const char *
+http_find_eol(const char *buf, size_t len)
+{
+	size_t i = 0;
+
+#ifdef HTTP_SIMD
+#ifdef __AVX2__
+	const __m256i lf32 = _mm256_set1_epi8('\n');
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		unsigned int m;
+
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf32));
+		if (m != 0)
+			return buf + i + __builtin_ctz(m);
+	}
+#endif
+	const __m128i lf16 = _mm_set1_epi8('\n');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned int m;
+
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf16));
+		if (m != 0)
+			return buf + i + __builtin_ctz(m);
+	}
+#endif
+	if (i == len)
+		return NULL;
+
+	return memchr(buf + i, '\n', len - i);
+}
+
+/* case insensitive comparison of a slice and a string */
+bool
+http_slice_eq(const struct http_slice *s, const char *str)
+{
+	return strlen(str) == s->len && strncasecmp(s->ptr, str, s->len) == 0;
+}
+
+/*
+ * Perfect hash of the known header field names: the length plus the first
+ * and the last letter in lower case is unique in the lower five bits for
+ * all of them.
+ */
+#define HDR_HASH(len, c, l)	\
+	(((len) + ((c) | 0x20) + ((l) | 0x20)) & 31)
+
+static const struct {
+	const char *name;
+	enum http_header id;
+} header_table[32] = {
+	[HDR_HASH(15, 'a', 'g')] =
+	    { "Accept-Encoding", HTTP_HDR_ACCEPT_ENCODING },
+	[HDR_HASH(13, 'a', 's')] = { "Accept-Ranges", HTTP_HDR_ACCEPT_RANGES },
+	[HDR_HASH(10, 'c', 'n')] = { "Connection", HTTP_HDR_CONNECTION },
+	[HDR_HASH(16, 'c', 'g')] =
+	    { "Content-Encoding", HTTP_HDR_CONTENT_ENCODING },
+	[HDR_HASH(14, 'c', 'h')] =
+	    { "Content-Length", HTTP_HDR_CONTENT_LENGTH },
+	[HDR_HASH(13, 'c', 'e')] = { "Content-Range", HTTP_HDR_CONTENT_RANGE },
+	[HDR_HASH(4, 'e', 'g')] = { "ETag", HTTP_HDR_ETAG },
+	[HDR_HASH(4, 'h', 't')] = { "Host", HTTP_HDR_HOST },
+	[HDR_HASH(17, 'i', 'e')] =
+	    { "If-Modified-Since", HTTP_HDR_IF_MODIFIED_SINCE },
+	[HDR_HASH(13, 'i', 'h')] = { "If-None-Match", HTTP_HDR_IF_NONE_MATCH },
+	[HDR_HASH(13, 'l', 'd')] = { "Last-Modified", HTTP_HDR_LAST_MODIFIED },
+	[HDR_HASH(5, 'r', 'e')] = { "Range", HTTP_HDR_RANGE },
+	[HDR_HASH(17, 't', 'g')] =
+	    { "Transfer-Encoding", HTTP_HDR_TRANSFER_ENCODING },
+};
+
+/* identify a header field name with one hash and one comparison */
+enum http_header
+http_header_id(const struct http_slice *name)
+{
+	size_t h;
+
+	if (name->len == 0)
+		return HTTP_HDR_OTHER;
+
+	h = HDR_HASH(name->len, (unsigned char)name->ptr[0],
+	    (unsigned char)name->ptr[name->len - 1]);
+	if (header_table[h].name == NULL ||
+	    !http_slice_eq(name, header_table[h].name))
+		return HTTP_HDR_OTHER;
+
+	return header_table[h].id;
+}
+
+/* search the case insensitive token tok in a comma separated list */
+static bool
+slice_token(const struct http_slice *list, const char *tok)
+{
+	const char *p = list->ptr, *end = list->ptr + list->len, *comma;
+	struct http_slice s;
+
+	while (p < end) {
+		if ((comma = memchr(p, ',', end - p)) == NULL)
+			comma = end;
+		for (s.ptr = p; s.ptr < comma && IS_OWS(*s.ptr); s.ptr++)
+			;
+		s.len = comma - s.ptr;
+		while (s.len > 0 && IS_OWS(s.ptr[s.len - 1]))
+			s.len--;
+		if (http_slice_eq(&s, tok))
+			return true;
+		p = comma + 1;
+	}
+
+	return false;
+}
+
+void
+http_parser_init(struct http_parser *p, bool start_line)
+{
+	memset(p, 0, sizeof *p);
+	p->state = start_line ? HTTP_STATE_START : HTTP_STATE_FIELDS;
+}
+
+/*
+ * Return the next token of the header in buf.  Every byte is scanned once,
+ * even if a line arrives in many pieces.  Lines may end with CRLF or LF.
+ */
+enum http_token
+http_next(struct http_parser *p, const char *buf, size_t len,
+    struct http_slice *name, struct http_slice *value)
+{
+	const char *line, *end, *eol, *colon;
+
+	if (p->state == HTTP_STATE_DONE)
+		return HTTP_END;
+
+	if ((eol = http_find_eol(buf + p->scan, len - p->scan)) == NULL) {
+		p->scan = len;
+		return HTTP_MORE;
+	}
+
+	line = buf + p->off;
+	end = eol;
+	if (end > line && end[-1] == '\r')
+		end--;
+	p->off = p->scan = eol + 1 - buf;
+
+	if (end == line) {
+		p->state = HTTP_STATE_DONE;
+		return HTTP_END;
+	}
+
+	if (p->state == HTTP_STATE_START) {
+		p->state = HTTP_STATE_FIELDS;
+		name->ptr = line;
+		name->len = end - line;
+		value->ptr = end;
+		value->len = 0;
+		return HTTP_START_LINE;
+	}
+
+	/* obsolete line folding and space before the colon are rejected */
+	if (IS_OWS(*line))
+		return HTTP_ERROR;
+	if ((colon = memchr(line, ':', end - line)) == NULL || colon == line ||
+	    IS_OWS(colon[-1]))
+		return HTTP_ERROR;
+
+	name->ptr = line;
+	name->len = colon - line;
+
+	for (colon++; colon < end && IS_OWS(*colon); colon++)
+		;
+	while (end > colon && IS_OWS(end[-1]))
+		end--;
+	value->ptr = colon;
+	value->len = end - colon;
+
+	return HTTP_FIELD;
+}
+
 int
 http_read_line_fd(int fd, char *buf, size_t size)
 {
@@ -50,6 +247,297 @@ http_read_line_fd(int fd, char *buf, size_t size)
 	return 0;
 }
 
+/* request methods are case sensitive */
+static const char *methods[] = {
+	[HTTP_METHOD_GET] = "GET",
+	[HTTP_METHOD_HEAD] = "HEAD",
+	[HTTP_METHOD_POST] = "POST",
+	[HTTP_METHOD_PUT] = "PUT",
+	[HTTP_METHOD_DELETE] = "DELETE",
+	[HTTP_METHOD_CONNECT] = "CONNECT",
+	[HTTP_METHOD_OPTIONS] = "OPTIONS",
+	[HTTP_METHOD_TRACE] = "TRACE",
+};
+
+/* GET /index.html HTTP/1.1 */
+static int
+parse_request_line(struct http_request *req, const struct http_slice *line)
+{
+	const char *p = line->ptr, *end = line->ptr + line->len, *sp;
+	size_t i;
+
+	if ((sp = memchr(p, ' ', end - p)) == NULL || sp == p)
+		return -1;
+	for (i = 1; i < sizeof methods / sizeof *methods; i++)
+		if (strlen(methods[i]) == (size_t)(sp - p) &&
+		    memcmp(methods[i], p, sp - p) == 0)
+			req->method = i;
+
+	p = sp + 1;
+	if ((sp = memchr(p, ' ', end - p)) == NULL || sp == p)
+		return -1;
+	req->target.ptr = p;
+	req->target.len = sp - p;
+
+	p = sp + 1;
+	if (end - p != 8 || strncmp(p, "HTTP/", 5) != 0 || p[6] != '.' ||
+	    p[5] < '0' || p[5] > '9' || p[7] < '0' || p[7] > '9')
+		return -1;
+	req->major = p[5] - '0';
+	req->minor = p[7] - '0';
+
+	/* HTTP/1.1 connections are persistent by default */
+	req->keep_alive = req->major > 1 || (req->major == 1 && req->minor > 0);
+
+	return 0;
+}
+
+/*
+ * Parse the header of a request in buf in a single pass.  Returns HTTP_MORE
+ * if the buffer ends inside of the header, HTTP_END if req is complete or
+ * HTTP_ERROR.  The slices in req point into buf.
+ */
+enum http_token
+http_parse_request(struct http_parser *p, struct http_request *req,
+    const char *buf, size_t len)
+{
+	struct http_slice name, value;
+	enum http_token t;
+
+	while ((t = http_next(p, buf, len, &name, &value)) == HTTP_START_LINE ||
+	    t == HTTP_FIELD) {
+		if (t == HTTP_START_LINE) {
+			memset(req, 0, sizeof *req);
+			if (parse_request_line(req, &name) == -1)
+				return HTTP_ERROR;
+			continue;
+		}
+
+		switch (http_header_id(&name)) {
+		case HTTP_HDR_CONNECTION:
+			if (slice_token(&value, "close"))
+				req->keep_alive = false;
+			else if (slice_token(&value, "keep-alive"))
+				req->keep_alive = true;
+			break;
+		case HTTP_HDR_HOST:
+			req->host = value;
+			break;
+		case HTTP_HDR_RANGE:
+			req->range = value;
+			break;
+		case HTTP_HDR_IF_NONE_MATCH:
+			req->if_none_match = value;
+			break;
+		case HTTP_HDR_IF_MODIFIED_SINCE:
+			req->if_modified_since = value;
+			break;
+		case HTTP_HDR_ACCEPT_ENCODING:
+			req->accept_encoding = value;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return t;
+}
+
+void
+http_chunked_init(struct http_chunked *c)
+{
+	memset(c, 0, sizeof *c);
+}
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Decode the chunked data in buf up to the next piece of the body, which is
+ * returned in body as part of buf.  Returns the number of consumed bytes
+ * including the body or -1 on malformed input.  Chunk extensions and the
+ * trailer fields are skipped.  The state is HTTP_CHUNK_DONE behind the
+ * trailer, where the next message begins.
+ */
+ssize_t
+http_chunked_next(struct http_chunked *c, const char *buf, size_t len,
+    struct http_slice *body)
+{
+	const char *p = buf, *end = buf + len, *lf;
+	int d;
+
+	body->ptr = buf;
+	body->len = 0;
+
+	while (p < end) {
+		switch (c->state) {
+		case HTTP_CHUNK_SIZE:
+			if ((d = hexval(*p)) != -1) {
+				if (c->size > UINT64_MAX >> 4)
+					goto fail;
+				c->size = c->size << 4 | d;
+				c->digits++;
+				p++;
+				break;
+			}
+			if (c->digits == 0)
+				goto fail;
+			if (*p == ';' || IS_OWS(*p))
+				c->state = HTTP_CHUNK_EXT;
+			else if (*p == '\r')
+				c->state = HTTP_CHUNK_SIZE_LF;
+			else if (*p == '\n')
+				goto size_line;
+			else
+				goto fail;
+			p++;
+			break;
+		case HTTP_CHUNK_EXT:
+			if ((lf = memchr(p, '\n', end - p)) == NULL) {
+				p = end;
+				break;
+			}
+			p = lf;
+			/* FALLTHROUGH */
+		case HTTP_CHUNK_SIZE_LF:
+			if (*p != '\n')
+				goto fail;
+ size_line:
+			p++;
+			c->digits = 0;
+			c->state = c->size > 0 ? HTTP_CHUNK_DATA :
+			    HTTP_CHUNK_TRAILER;
+			break;
+		case HTTP_CHUNK_DATA:
+			body->ptr = p;
+			body->len = (uint64_t)(end - p) < c->size ?
+			    (size_t)(end - p) : (size_t)c->size;
+			c->size -= body->len;
+			if (c->size == 0)
+				c->state = HTTP_CHUNK_DATA_CR;
+			return p + body->len - buf;
+		case HTTP_CHUNK_DATA_CR:
+			if (*p == '\r') {
+				c->state = HTTP_CHUNK_DATA_LF;
+				p++;
+				break;
+			}
+			/* FALLTHROUGH */
+		case HTTP_CHUNK_DATA_LF:
+			if (*p++ != '\n')
+				goto fail;
+			c->state = HTTP_CHUNK_SIZE;
+			break;
+		case HTTP_CHUNK_TRAILER:
+			if (*p == '\r')
+				c->state = HTTP_CHUNK_TRAILER_LF;
+			else if (*p == '\n')
+				c->state = HTTP_CHUNK_DONE;
+			else
+				c->state = HTTP_CHUNK_TRAILER_LINE;
+			p++;
+			break;
+		case HTTP_CHUNK_TRAILER_LINE:
+			if ((lf = memchr(p, '\n', end - p)) == NULL) {
+				p = end;
+				break;
+			}
+			p = lf + 1;
+			c->state = HTTP_CHUNK_TRAILER;
+			break;
+		case HTTP_CHUNK_TRAILER_LF:
+			if (*p++ != '\n')
+				goto fail;
+			c->state = HTTP_CHUNK_DONE;
+			break;
+		case HTTP_CHUNK_DONE:
+			return p - buf;
+		case HTTP_CHUNK_ERROR:
+			return -1;
+		}
+	}
+
+	return p - buf;
+ fail:
+	c->state = HTTP_CHUNK_ERROR;
+	return -1;
+}
+
+/*
+ * Read the header block up to and including the empty line into buf and
+ * terminate it with a NUL.  The socket is peeked in large chunks which are
+ * fed to the tokenizer to find the end of the header.  Then exactly the
+ * header is consumed, so the data behind it stays in the socket for the
+ * next program.  Descriptors which are not able to peek, like pipes, are
+ * read bytewise.  Returns the length of the header or -1 on error.
+ */
+ssize_t
+http_read_head_fd(int fd, char *buf, size_t size)
+{
+	struct http_parser p;
+	struct http_slice name, value;
+	enum http_token t;
+	size_t len = 0;
+	bool peek = true;
+	ssize_t n;
+
+	http_parser_init(&p, true);
+
+	while (len < size - 1) {
+		if (peek)
+			n = recv(fd, buf + len, size - 1 - len, MSG_PEEK);
+		else
+			n = read(fd, buf + len, 1);
+		if (n == -1 && errno == ENOTSOCK && peek) {
+			peek = false;
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		while ((t = http_next(&p, buf, len + n, &name, &value)) ==
+		    HTTP_START_LINE || t == HTTP_FIELD)
+			;
+		if (t == HTTP_ERROR) {
+			errno = EBADMSG;
+			return -1;
+		}
+
+		/* consume the header or all of the chunk, which is header */
+		if (peek) {
+			size_t want = n, got;
+
+			if (t == HTTP_END)
+				want = p.off - len;
+			for (got = 0; got < want; got += n)
+				if ((n = read(fd, buf + len + got, want - got))
+				    <= 0)
+					return -1;
+			n = want;
+		}
+		len += n;
+
+		if (t == HTTP_END) {
+			buf[len] = '\0';
+			return len;
+		}
+	}
+
+	errno = EMSGSIZE;
+	return -1;
+}
+
 int
 http_read_line_fh(FILE *fh, char *buf, size_t size)
 {
@@ -126,6 +614,123 @@ http_parse_line(struct http_response *head, char *buf)
 	return 0;
 }
 
+/* HTTP/1.1 200 OK */
+int
+http_parse_status(const struct http_slice *line)
+{
+	const char *p = line->ptr;
+
+	if (line->len < 12 || strncmp(p, "HTTP/", 5) != 0 || p[8] != ' ')
+		return -1;
+	if (p[9] < '1' || p[9] > '5' || p[10] < '0' || p[10] > '9' ||
+	    p[11] < '0' || p[11] > '9')
+		return -1;
+
+	return (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+}
+
+/* slice version of strstr(3) */
+static bool
+slice_has(const struct http_slice *s, const char *str)
+{
+	return memmem(s->ptr, s->len, str, strlen(str)) != NULL;
+}
+
+/* decimal number without sign, -1 if it is empty, invalid or too large */
+static int
+parse_size(const char *p, size_t len, size_t *num)
+{
+	size_t n = 0;
+
+	if (len == 0)
+		return -1;
+	for (size_t i = 0; i < len; i++) {
+		if (p[i] < '0' || p[i] > '9' || n > (SIZE_MAX - 9) / 10)
+			return -1;
+		n = n * 10 + p[i] - '0';
+	}
+
+	*num = n;
+	return 0;
+}
+
+/* bytes first-last/size, a star for unknown size or unsatisfied range */
+static int
+parse_content_range(struct http_response *head, const struct http_slice *value)
+{
+	const char *p = value->ptr, *end = value->ptr + value->len;
+	const char *dash, *slash;
+
+	if (value->len < 6 || strncasecmp(p, "bytes ", 6) != 0)
+		return -1;
+	p += 6;
+	if (end - p > 2 && p[0] == '*' && p[1] == '/')	/* unsatisfied */
+		return parse_size(p + 2, end - p - 2, &head->range_size);
+	if ((dash = memchr(p, '-', end - p)) == NULL ||
+	    (slash = memchr(dash, '/', end - dash)) == NULL)
+		return -1;
+
+	if (parse_size(p, dash - p, &head->range_first) == -1 ||
+	    parse_size(dash + 1, slash - dash - 1, &head->range_last) == -1 ||
+	    head->range_last < head->range_first)
+		return -1;
+
+	head->range_size = SIZE_MAX;
+	if (end - slash != 2 || slash[1] != '*') {
+		if (parse_size(slash + 1, end - slash - 1, &head->range_size)
+		    == -1 || head->range_last >= head->range_size)
+			return -1;
+	}
+	head->partial = true;
+
+	return 0;
+}
+
+int
+http_parse_field(struct http_response *head, const struct http_slice *name,
+    const struct http_slice *value)
+{
+	switch (http_header_id(name)) {
+	case HTTP_HDR_CONTENT_LENGTH:
+		if (parse_size(value->ptr, value->len, &head->content_length)
+		    == -1)
+			return -1;
+		break;
+	case HTTP_HDR_CONTENT_RANGE:
+		return parse_content_range(head, value);
+	case HTTP_HDR_ACCEPT_RANGES:
+		if (slice_token(value, "bytes"))
+			head->ranges = true;
+		break;
+	case HTTP_HDR_CONTENT_ENCODING:
+		if (slice_has(value, "compress"))
+			head->content_encoding = HTTP_CONT_ENC_COMPRESS;
+		if (slice_has(value, "deflate"))
+			head->content_encoding = HTTP_CONT_ENC_DEFLATE;
+		if (slice_has(value, "gzip"))
+			head->content_encoding = HTTP_CONT_ENC_GZIP;
+		break;
+	case HTTP_HDR_TRANSFER_ENCODING:
+		if (slice_has(value, "chunked"))
+			head->transfer_encoding = HTTP_TRANS_ENC_CHUNKED;
+		break;
+	case HTTP_HDR_CONNECTION:
+		if (slice_token(value, "close"))
+			head->close = true;
+		break;
+	case HTTP_HDR_ETAG:
+		head->etag = *value;
+		break;
+	case HTTP_HDR_LAST_MODIFIED:
+		head->last_modified = *value;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
 char *
 http_reason_phrase(int code)
 {
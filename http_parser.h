@@ -17,9 +17,120 @@
 #ifndef HTTP_PARSER_H
 #define HTTP_PARSER_H
 
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HTTP_HEAD_MAX	(64 * 1024)	/* largest header we buffer */
+
+/* part of the buffer given to the parser, not NUL terminated */
+struct http_slice {
+	const char *ptr;
+	size_t len;
+};
+
+/*
+ * Incremental tokenizer for the header of requests and responses.  The
+ * caller appends new data to its buffer and calls http_next() again with
+ * the same buffer and the new length.  Nothing is copied, all slices point
+ * into the buffer of the caller.
+ */
+struct http_parser {
+	enum {
+		HTTP_STATE_START = 0,	/* request or status line */
+		HTTP_STATE_FIELDS,
+		HTTP_STATE_DONE
+	} state;
+	size_t off;	/* start of the current line, header size when done */
+	size_t scan;	/* bytes of the current line without a line end */
+};
+
+enum http_token {
+	HTTP_MORE,		/* the buffer ends inside of a line */
+	HTTP_START_LINE,	/* request or status line in name */
+	HTTP_FIELD,		/* header field in name and value */
+	HTTP_END,		/* empty line at the end of the header */
+	HTTP_ERROR
+};
+
+/*
+ * Streaming decoder of the chunked transfer coding.  It takes the input in
+ * pieces of any size and returns the body as slices of the input.
+ */
+struct http_chunked {
+	enum {
+		HTTP_CHUNK_SIZE = 0,	/* hex digits of the chunk size */
+		HTTP_CHUNK_EXT,		/* chunk extensions up to the LF */
+		HTTP_CHUNK_SIZE_LF,	/* LF behind the size line */
+		HTTP_CHUNK_DATA,
+		HTTP_CHUNK_DATA_CR,	/* CRLF behind the data */
+		HTTP_CHUNK_DATA_LF,
+		HTTP_CHUNK_TRAILER,	/* beginning of a trailer line */
+		HTTP_CHUNK_TRAILER_LINE,
+		HTTP_CHUNK_TRAILER_LF,	/* LF of the empty line at the end */
+		HTTP_CHUNK_DONE,
+		HTTP_CHUNK_ERROR
+	} state;
+	uint64_t size;		/* rest of the current chunk */
+	unsigned int digits;	/* of the chunk size */
+};
+
+/* header fields known by the parsers */
+enum http_header {
+	HTTP_HDR_OTHER = 0,
+	HTTP_HDR_ACCEPT_ENCODING,
+	HTTP_HDR_ACCEPT_RANGES,
+	HTTP_HDR_CONNECTION,
+	HTTP_HDR_CONTENT_ENCODING,
+	HTTP_HDR_CONTENT_LENGTH,
+	HTTP_HDR_CONTENT_RANGE,
+	HTTP_HDR_ETAG,
+	HTTP_HDR_HOST,
+	HTTP_HDR_IF_MODIFIED_SINCE,
+	HTTP_HDR_IF_NONE_MATCH,
+	HTTP_HDR_LAST_MODIFIED,
+	HTTP_HDR_RANGE,
+	HTTP_HDR_TRANSFER_ENCODING
+};
+
+struct http_request {
+	enum {
+		HTTP_METHOD_OTHER = 0,
+		HTTP_METHOD_GET,
+		HTTP_METHOD_HEAD,
+		HTTP_METHOD_POST,
+		HTTP_METHOD_PUT,
+		HTTP_METHOD_DELETE,
+		HTTP_METHOD_CONNECT,
+		HTTP_METHOD_OPTIONS,
+		HTTP_METHOD_TRACE
+	} method;
+	struct http_slice target;
+	unsigned int major;
+	unsigned int minor;
+	bool keep_alive;	/* persistent connection */
+
+	/* empty if the field is missing */
+	struct http_slice host;
+	struct http_slice range;
+	struct http_slice if_none_match;
+	struct http_slice if_modified_since;
+	struct http_slice accept_encoding;
+};
+
 struct http_response {
 	int code;
 	size_t content_length;
+	bool close;	/* the server closes the connection */
+	bool ranges;	/* Accept-Ranges: bytes */
+
+	/* Content-Range of a 206, range_size is SIZE_MAX if unknown */
+	bool partial;	/* the Content-Range has a first and a last byte */
+	size_t range_first;
+	size_t range_last;
+	size_t range_size;
 
 	enum {
 		HTTP_CONT_ENC_PLAIN = 0,
@@ -32,12 +143,34 @@ struct http_response {
 		HTTP_TRANS_ENC_NONE = 0,
 		HTTP_TRANS_ENC_CHUNKED
 	} transfer_encoding;
+
+	/* validators, empty if the field is missing */
+	struct http_slice etag;
+	struct http_slice last_modified;
 };
 
+void http_parser_init(struct http_parser *p, bool start_line);
+enum http_token http_next(struct http_parser *p, const char *buf, size_t len,
+    struct http_slice *name, struct http_slice *value);
+const char *http_find_eol(const char *buf, size_t len);
+bool http_slice_eq(const struct http_slice *s, const char *str);
+enum http_header http_header_id(const struct http_slice *name);
+
+enum http_token http_parse_request(struct http_parser *p,
+    struct http_request *req, const char *buf, size_t len);
+
+void http_chunked_init(struct http_chunked *c);
+ssize_t http_chunked_next(struct http_chunked *c, const char *buf, size_t len,
+    struct http_slice *body);
+
 int http_read_line_fd(int fd, char *buf, size_t size);
+ssize_t http_read_head_fd(int fd, char *buf, size_t size);
 int http_read_line_fh(FILE *fh, char *buf, size_t size);
 int http_parse_code(char *buf, size_t size);
 int http_parse_line(struct http_response *head, char *buf);
+int http_parse_status(const struct http_slice *line);
+int http_parse_field(struct http_response *head, const struct http_slice *name,
+    const struct http_slice *value);
 char *http_reason_phrase(int code);
 
 #endif
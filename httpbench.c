@@ -0,0 +1,863 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark and regression check of the HTTP parsers.  A corpus of request
+ * and response headers and chunked bodies is generated in memory and run
+ * through the parser APIs.  All results are printed as key=value lines.
+ *
+ * With -t the corpus and random mutations of it are parsed in pieces of
+ * many sizes and every result is compared with the parse of the whole
+ * buffer.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <dlfcn.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
+#include "http_parser.h"
+
+#define MUTATIONS 500	/* per corpus entry in the check */
+
+enum kind { REQUEST, RESPONSE, CHUNKED };
+
+struct entry {
+	const char *name;
+	enum kind kind;
+	char *buf;
+	size_t len;
+	size_t head;	/* size of the header */
+	size_t fields;	/* header fields and the start line */
+	size_t body;	/* decoded body of chunked entries */
+};
+
+static struct entry corpus[16];
+static size_t ncorpus;
+static char *httpc = "./httpc";
+static double duration = 0.2;
+
+/*
+ * Count the allocations by interposing the malloc(3) family.  While the
+ * real functions are looked up, a small static arena is used.  Pointers
+ * into the arena never reach the real free(3) or realloc(3).
+ */
+static size_t nallocs;
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static char arena[4096];
+static size_t arena_used;
+static bool resolving;
+
+static void
+resolve(void)
+{
+	resolving = true;
+	*(void **)&real_malloc = dlsym(RTLD_NEXT, "malloc");
+	*(void **)&real_calloc = dlsym(RTLD_NEXT, "calloc");
+	*(void **)&real_realloc = dlsym(RTLD_NEXT, "realloc");
+	*(void **)&real_free = dlsym(RTLD_NEXT, "free");
+	resolving = false;
+
+	if (real_malloc == NULL || real_calloc == NULL ||
+	    real_realloc == NULL || real_free == NULL)
+		abort();
+}
+
+/* the arena is never reused, thus its memory is always zeroed */
+static void *
+arena_alloc(size_t size)
+{
+	void *p = arena + arena_used;
+
+	size = (size + 15) & ~(size_t)15;
+	if (size > sizeof arena - arena_used)
+		return NULL;
+	arena_used += size;
+
+	return p;
+}
+
+static bool
+in_arena(const void *ptr)
+{
+	return (const char *)ptr >= arena &&
+	    (const char *)ptr < arena + sizeof arena;
+}
+
+void *
+malloc(size_t size)
+{
+	nallocs++;
+	if (resolving)
+		return arena_alloc(size);
+	if (real_malloc == NULL)
+		resolve();
+
+	return real_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	if (resolving) {
+		if (size != 0 && nmemb > SIZE_MAX / size)
+			return NULL;
+		return arena_alloc(nmemb * size);
+	}
+	if (real_calloc == NULL)
+		resolve();
+
+	return real_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	void *p;
+
+	nallocs++;
+	if (resolving)
+		return arena_alloc(size);
+	if (real_realloc == NULL)
+		resolve();
+	if (!in_arena(ptr))
+		return real_realloc(ptr, size);
+
+	/* move out of the arena, the old size is unknown but bounded */
+	if ((p = real_malloc(size)) == NULL)
+		return NULL;
+	memcpy(p, ptr, MIN(size, (size_t)(arena + sizeof arena -
+	    (char *)ptr)));
+
+	return p;
+}
+
+void
+free(void *ptr)
+{
+	if (ptr == NULL || in_arena(ptr))
+		return;
+	if (real_free == NULL)
+		resolve();
+
+	real_free(ptr);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* reproducible pseudo random numbers for the corpus and the mutations */
+static uint32_t
+rnd(void)
+{
+	static uint32_t x = 2463534242U;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+/* corpus ****************************************************************/
+
+struct str {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static void
+append(struct str *s, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void
+append(struct str *s, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(s->buf + s->len, s->size - s->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			err(EXIT_FAILURE, "vsnprintf");
+		if ((size_t)n < s->size - s->len)
+			break;
+		s->size = (s->size + n) * 2;
+		if ((s->buf = realloc(s->buf, s->size)) == NULL)
+			err(EXIT_FAILURE, "realloc");
+	}
+	s->len += n;
+}
+
+static void
+add(const char *name, enum kind kind, struct str *s, size_t body)
+{
+	struct entry *e = &corpus[ncorpus++];
+	char *end;
+
+	e->name = name;
+	e->kind = kind;
+	e->buf = s->buf;
+	e->len = s->len;
+	e->body = body;
+
+	if ((end = strstr(s->buf, "\r\n\r\n")) == NULL)
+		errx(EXIT_FAILURE, "corpus %s: no end of header", name);
+	e->head = end + 4 - s->buf;
+	for (e->fields = 1; end > s->buf; end--)
+		if (*end == '\n')
+			e->fields++;
+
+	memset(s, 0, sizeof *s);
+}
+
+static void
+token(struct str *s, size_t len)
+{
+	static const char alpha[] =
+	    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+	while (len-- > 0)
+		append(s, "%c", alpha[rnd() % (sizeof alpha - 1)]);
+}
+
+/* chunked body of size bytes in pieces of chunk bytes */
+static void
+chunked(struct str *s, size_t size, size_t chunk)
+{
+	size_t n;
+
+	for (; size > 0; size -= n) {
+		n = size < chunk ? size : chunk;
+		if (rnd() % 4 == 0)
+			append(s, "%zx;name=value\r\n", n);
+		else
+			append(s, "%zx\r\n", n);
+		token(s, n);
+		append(s, "\r\n");
+	}
+	append(s, "0\r\nX-Checksum: 42\r\n\r\n");
+}
+
+static void
+build_corpus(void)
+{
+	struct str s = { NULL, 0, 0 };
+	int i;
+
+	/* request of a browser */
+	append(&s, "GET /static/js/app.3f2a1c.js?v=12 HTTP/1.1\r\n"
+	    "Host: www.example.com\r\n"
+	    "User-Agent: Mozilla/5.0 (X11; OpenBSD amd64; rv:91.0) "
+	    "Gecko/20100101 Firefox/91.0\r\n"
+	    "Accept: */*\r\n"
+	    "Accept-Language: en-US,en;q=0.5\r\n"
+	    "Accept-Encoding: gzip, deflate, br\r\n"
+	    "Referer: https://www.example.com/\r\n"
+	    "Connection: keep-alive\r\n"
+	    "If-None-Match: \"5f3a-1c2b3d\"\r\n"
+	    "If-Modified-Since: Tue, 19 Oct 2021 10:00:00 GMT\r\n\r\n");
+	add("req-small", REQUEST, &s, 0);
+
+	append(&s, "GET /api/v1/items HTTP/1.1\r\nHost: api.example.com\r\n");
+	for (i = 0; i < 100; i++)
+		append(&s, "X-Field-%d: %d\r\n", i, i * 7);
+	append(&s, "\r\n");
+	add("req-many", REQUEST, &s, 0);
+
+	append(&s, "GET / HTTP/1.1\r\nHost: www.example.com\r\nCookie: ");
+	for (i = 0; i < 64; i++) {
+		append(&s, "%ssession%d=", i ? "; " : "", i);
+		token(&s, 96);
+	}
+	append(&s, "\r\nRange: bytes=0-1023\r\n\r\n");
+	add("req-huge", REQUEST, &s, 0);
+
+	/* responses */
+	append(&s, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+	add("resp-tiny", RESPONSE, &s, 0);
+
+	append(&s, "HTTP/1.1 200 OK\r\n"
+	    "Date: Tue, 19 Oct 2021 10:00:00 GMT\r\n"
+	    "Server: https\r\n"
+	    "Content-Type: text/html; charset=utf-8\r\n"
+	    "Content-Length: 10240\r\n"
+	    "Content-Encoding: gzip\r\n"
+	    "Cache-Control: max-age=3600\r\n"
+	    "ETag: \"5f3a-1c2b3d\"\r\n"
+	    "Last-Modified: Mon, 18 Oct 2021 10:00:00 GMT\r\n"
+	    "Vary: Accept-Encoding\r\n\r\n");
+	add("resp-small", RESPONSE, &s, 0);
+
+	append(&s, "HTTP/1.1 200 OK\r\nContent-Length: 42\r\n");
+	for (i = 0; i < 100; i++)
+		append(&s, "X-Field-%d: %d\r\n", i, i * 7);
+	append(&s, "\r\n");
+	add("resp-many", RESPONSE, &s, 0);
+
+	append(&s, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n");
+	for (i = 0; i < 16; i++) {
+		append(&s, "Set-Cookie: id%d=", i);
+		token(&s, 1000);
+		append(&s, "; Path=/; Secure; HttpOnly\r\n");
+	}
+	append(&s, "\r\n");
+	add("resp-huge", RESPONSE, &s, 0);
+
+	/* chunked bodies */
+	append(&s, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+	chunked(&s, 1024 * 1024, 64);
+	add("chunked-64", CHUNKED, &s, 1024 * 1024);
+
+	append(&s, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+	chunked(&s, 8 * 1024 * 1024, 16 * 1024);
+	add("chunked-16k", CHUNKED, &s, 8 * 1024 * 1024);
+}
+
+/* benchmarks ************************************************************/
+
+/* tokenizer alone */
+static void
+run_next(const struct entry *e)
+{
+	struct http_parser p;
+	struct http_slice name, value;
+	enum http_token t;
+
+	http_parser_init(&p, true);
+	while ((t = http_next(&p, e->buf, e->head, &name, &value)) ==
+	    HTTP_START_LINE || t == HTTP_FIELD)
+		;
+	if (t != HTTP_END)
+		errx(EXIT_FAILURE, "%s: tokenizer failed", e->name);
+}
+
+static void
+run_request(const struct entry *e)
+{
+	struct http_parser p;
+	struct http_request req;
+
+	http_parser_init(&p, true);
+	if (http_parse_request(&p, &req, e->buf, e->head) != HTTP_END)
+		errx(EXIT_FAILURE, "%s: request parser failed", e->name);
+}
+
+static void
+run_response(const struct entry *e)
+{
+	struct http_parser p;
+	struct http_response head;
+	struct http_slice name, value;
+	enum http_token t;
+
+	memset(&head, 0, sizeof head);
+	http_parser_init(&p, true);
+	while ((t = http_next(&p, e->buf, e->head, &name, &value)) ==
+	    HTTP_START_LINE || t == HTTP_FIELD) {
+		if (t == HTTP_START_LINE)
+			head.code = http_parse_status(&name);
+		else if (http_parse_field(&head, &name, &value) == -1)
+			errx(EXIT_FAILURE, "%s: http_parse_field", e->name);
+	}
+}
+
+/* the line reader over stdio and the old field parser */
+static void
+run_line_fh(const struct entry *e)
+{
+	struct http_response head;
+	char buf[BUFSIZ * 2];
+	size_t lines = 0;
+	FILE *fh;
+
+	if ((fh = fmemopen(e->buf, e->head, "r")) == NULL)
+		err(EXIT_FAILURE, "fmemopen");
+
+	memset(&head, 0, sizeof head);
+	do {
+		if (http_read_line_fh(fh, buf, sizeof buf) == -1)
+			errx(EXIT_FAILURE, "%s: http_read_line_fh", e->name);
+		if (lines++ == 0)
+			head.code = http_parse_code(buf, sizeof buf);
+		else if (http_parse_line(&head, buf) == -1)
+			errx(EXIT_FAILURE, "%s: http_parse_line", e->name);
+	} while (strcmp(buf, "\r\n") != 0);
+
+	fclose(fh);
+}
+
+static void
+bench(const char *api, const struct entry *e, void (*fn)(const struct entry *))
+{
+	double start, wall;
+	size_t count = 0, allocs;
+
+	allocs = nallocs;
+	start = now();
+	do {
+		for (int i = 0; i < 64; i++, count++)
+			fn(e);
+	} while ((wall = now() - start) < duration);
+	allocs = nallocs - allocs;
+
+	printf("parser api=%s corpus=%s bytes=%zu msgs_s=%.0f mb_s=%.1f "
+	    "headers_s=%.0f allocs_per_msg=%.2f\n", api, e->name, e->head,
+	    count / wall, count * e->head / wall / 1e6,
+	    count * e->fields / wall,
+	    (double)allocs / count);
+}
+
+/*
+ * chunked decoder alone, the body is consumed by a checksum to be comparable
+ * with httpc which writes it out
+ */
+static void
+bench_decoder(const struct entry *e)
+{
+	struct http_chunked c;
+	struct http_slice body;
+	const char *buf = e->buf + e->head;
+	size_t len = e->len - e->head, off, count = 0, allocs, sum = 0;
+	uint32_t cksum = 0;
+	double start, wall;
+	ssize_t n;
+
+	allocs = nallocs;
+	start = now();
+	do {
+		http_chunked_init(&c);
+		for (off = 0; off < len && c.state != HTTP_CHUNK_DONE;
+		    off += n) {
+			n = http_chunked_next(&c, buf + off, len - off, &body);
+			if (n == -1)
+				errx(EXIT_FAILURE, "%s: decoder failed",
+				    e->name);
+			for (size_t i = 0; i < body.len; i++)
+				cksum += (unsigned char)body.ptr[i];
+			sum += body.len;
+		}
+		count++;
+	} while ((wall = now() - start) < duration);
+	allocs = nallocs - allocs;
+
+	if (sum != count * e->body)
+		errx(EXIT_FAILURE, "%s: decoded %zu bytes", e->name, sum);
+
+	printf("chunked api=decoder corpus=%s bytes=%zu body=%zu runs=%zu "
+	    "mb_s=%.1f allocs_per_msg=%.2f cksum=%08x\n", e->name, len,
+	    e->body, count, count * len / wall / 1e6, (double)allocs / count,
+	    cksum);
+}
+
+/* chunked decoding of httpc, the response is read from a file */
+static void
+bench_httpc(const struct entry *e)
+{
+	char path[] = "/tmp/httpbench_XXXXXX";
+	double start, wall;
+	size_t count = 0;
+	int fd, status;
+	pid_t pid;
+
+	if ((fd = mkstemp(path)) == -1)
+		err(EXIT_FAILURE, "mkstemp");
+	if (unlink(path) == -1)
+		err(EXIT_FAILURE, "unlink");
+	if (write(fd, e->buf, e->len) != (ssize_t)e->len)
+		err(EXIT_FAILURE, "write");
+
+	start = now();
+	do {
+		switch ((pid = fork())) {
+		case -1:
+			err(EXIT_FAILURE, "fork");
+		case 0:
+			if (dup2(fd, 6) == -1 ||
+			    dup2(open("/dev/null", O_RDWR), 7) == -1 ||
+			    dup2(7, STDOUT_FILENO) == -1)
+				err(EXIT_FAILURE, "dup2");
+			if (lseek(6, 0, SEEK_SET) == -1)
+				err(EXIT_FAILURE, "lseek");
+			execl(httpc, httpc, (char *)NULL);
+			err(EXIT_FAILURE, "execl: %s", httpc);
+		}
+		if (waitpid(pid, &status, 0) == -1)
+			err(EXIT_FAILURE, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(EXIT_FAILURE, "%s: httpc failed", e->name);
+		count++;
+	} while ((wall = now() - start) < duration);
+
+	close(fd);
+
+	printf("chunked api=httpc corpus=%s bytes=%zu body=%zu runs=%zu "
+	    "mb_s=%.1f\n", e->name, e->len, e->body, count,
+	    count * e->len / wall / 1e6);
+}
+
+/* regression check ******************************************************/
+
+static uint64_t
+mix(uint64_t h, uint64_t v)
+{
+	return (h ^ v) * 1099511628211ULL;
+}
+
+/*
+ * Parse buf in pieces of the given size, or in random pieces for 0, and
+ * return a hash of all tokens and slices.
+ */
+static uint64_t
+parse_pieces(const char *buf, size_t len, size_t piece, bool start_line)
+{
+	struct http_parser p;
+	struct http_slice name, value;
+	enum http_token t;
+	uint64_t h = 14695981039346656037ULL;
+	size_t have = 0;
+
+	http_parser_init(&p, start_line);
+	for (;;) {
+		t = http_next(&p, buf, have, &name, &value);
+		if (t == HTTP_MORE) {
+			if (have == len)
+				break;
+			have += piece ? piece : 1 + rnd() % 97;
+			if (have > len)
+				have = len;
+			continue;
+		}
+		h = mix(h, t);
+		if (t == HTTP_END || t == HTTP_ERROR) {
+			h = mix(h, p.off);
+			break;
+		}
+		h = mix(h, name.ptr - buf);
+		h = mix(h, name.len);
+		h = mix(h, value.ptr - buf);
+		h = mix(h, value.len);
+	}
+
+	return mix(h, t);
+}
+
+static uint64_t
+request_pieces(const char *buf, size_t len, size_t piece)
+{
+	struct http_parser p;
+	struct http_request req;
+	struct http_slice *s[] = { &req.target, &req.host, &req.range,
+	    &req.if_none_match, &req.if_modified_since, &req.accept_encoding };
+	enum http_token t;
+	uint64_t h = 14695981039346656037ULL;
+	size_t have = 0;
+
+	http_parser_init(&p, true);
+	while ((t = http_parse_request(&p, &req, buf, have)) == HTTP_MORE &&
+	    have < len) {
+		have += piece ? piece : 1 + rnd() % 97;
+		if (have > len)
+			have = len;
+	}
+	h = mix(h, t);
+	if (t != HTTP_END)
+		return h;
+
+	h = mix(h, req.method);
+	h = mix(h, req.major * 10 + req.minor);
+	h = mix(h, req.keep_alive);
+	for (size_t i = 0; i < sizeof s / sizeof *s; i++) {
+		h = mix(h, s[i]->len ? s[i]->ptr - buf : 0);
+		h = mix(h, s[i]->len);
+	}
+
+	return h;
+}
+
+/* decode a chunked body in pieces, body is set to the decoded size */
+static uint64_t
+decode_pieces(const char *buf, size_t len, size_t piece, size_t *body)
+{
+	struct http_chunked c;
+	struct http_slice s;
+	uint64_t h = 14695981039346656037ULL;
+	size_t off = 0, have = 0;
+	ssize_t n;
+
+	*body = 0;
+	http_chunked_init(&c);
+	while (c.state != HTTP_CHUNK_DONE) {
+		if (off == have) {
+			if (have == len)
+				break;
+			have += piece ? piece : 1 + rnd() % 97;
+			if (have > len)
+				have = len;
+		}
+		n = http_chunked_next(&c, buf + off, have - off, &s);
+		if (n == -1)	/* the offset depends on the pieces */
+			return mix(h, c.state);
+		off += n;
+		*body += s.len;
+		for (size_t i = 0; i < s.len; i++)
+			h = mix(h, (unsigned char)s.ptr[i]);
+	}
+
+	h = mix(h, c.state);
+	return mix(h, off);
+}
+
+/* compare the parse of the whole buffer with parses in pieces */
+static void
+check_pieces(const char *name, const char *buf, size_t len, enum kind kind)
+{
+	static const size_t pieces[] = { 1, 2, 3, 7, 16, 31, 64, 1000, 0 };
+	uint64_t whole, req;
+	size_t body;
+
+	if (kind == CHUNKED) {
+		whole = decode_pieces(buf, len, len, &body);
+		for (size_t i = 0; i < sizeof pieces / sizeof *pieces; i++)
+			if (decode_pieces(buf, len, pieces[i], &body) != whole)
+				errx(EXIT_FAILURE, "%s: body differs in pieces "
+				    "of %zu", name, pieces[i]);
+		return;
+	}
+
+	whole = parse_pieces(buf, len, len, true);
+	req = request_pieces(buf, len, len);
+
+	for (size_t i = 0; i < sizeof pieces / sizeof *pieces; i++) {
+		if (parse_pieces(buf, len, pieces[i], true) != whole)
+			errx(EXIT_FAILURE, "%s: tokens differ in pieces of %zu",
+			    name, pieces[i]);
+		if (kind == REQUEST &&
+		    request_pieces(buf, len, pieces[i]) != req)
+			errx(EXIT_FAILURE, "%s: request differs in pieces of "
+			    "%zu", name, pieces[i]);
+	}
+}
+
+/* the old line parser and the new field parser agree on the corpus */
+static void
+check_fields(const struct entry *e)
+{
+	struct http_response old, new;
+	struct http_parser p;
+	struct http_slice name, value;
+	enum http_token t;
+	char buf[BUFSIZ * 2];
+	FILE *fh;
+
+	if ((fh = fmemopen(e->buf, e->head, "r")) == NULL)
+		err(EXIT_FAILURE, "fmemopen");
+	memset(&old, 0, sizeof old);
+	if (http_read_line_fh(fh, buf, sizeof buf) == -1)
+		errx(EXIT_FAILURE, "%s: http_read_line_fh", e->name);
+	old.code = http_parse_code(buf, sizeof buf);
+	do {
+		if (http_read_line_fh(fh, buf, sizeof buf) == -1 ||
+		    http_parse_line(&old, buf) == -1)
+			errx(EXIT_FAILURE, "%s: http_parse_line", e->name);
+	} while (strcmp(buf, "\r\n") != 0);
+	fclose(fh);
+
+	memset(&new, 0, sizeof new);
+	http_parser_init(&p, true);
+	while ((t = http_next(&p, e->buf, e->head, &name, &value)) ==
+	    HTTP_START_LINE || t == HTTP_FIELD) {
+		if (t == HTTP_START_LINE)
+			new.code = http_parse_status(&name);
+		else
+			http_parse_field(&new, &name, &value);
+	}
+
+	if (t != HTTP_END || p.off != e->head || old.code != new.code ||
+	    old.content_length != new.content_length ||
+	    old.content_encoding != new.content_encoding ||
+	    old.transfer_encoding != new.transfer_encoding)
+		errx(EXIT_FAILURE, "%s: old and new parser differ", e->name);
+}
+
+/* the whole body is decoded in any pieces */
+static void
+check_chunked(const struct entry *e)
+{
+	const char *buf = e->buf + e->head;
+	size_t len = e->len - e->head, body;
+	uint64_t whole;
+
+	whole = decode_pieces(buf, len, len, &body);
+	if (body != e->body)
+		errx(EXIT_FAILURE, "%s: decoded %zu of %zu bytes", e->name,
+		    body, e->body);
+	if (decode_pieces(buf, len, 1, &body) != whole ||
+	    decode_pieces(buf, len, 0, &body) != whole)
+		errx(EXIT_FAILURE, "%s: body differs in pieces", e->name);
+}
+
+static void
+check(void)
+{
+	static const char bytes[] = "\r\n: \t\0aZ9,;\x80\xff";
+	size_t mutations = 0;
+	char *buf;
+
+	for (size_t i = 0; i < ncorpus; i++) {
+		struct entry *e = &corpus[i];
+		const char *data = e->buf;
+		size_t size = e->head;
+
+		if (e->kind == RESPONSE)
+			check_fields(e);
+		if (e->kind == CHUNKED) {
+			check_chunked(e);
+
+			/* mutate just the beginning of large bodies */
+			data = e->buf + e->head;
+			size = e->len - e->head;
+			if (size > 4096)
+				size = 4096;
+		}
+		check_pieces(e->name, data, size, e->kind);
+
+		/* an exact copy lets memory checkers see overreads */
+		for (int m = 0; m < MUTATIONS; m++, mutations++) {
+			size_t len = size;
+
+			if ((buf = malloc(len)) == NULL)
+				err(EXIT_FAILURE, "malloc");
+			memcpy(buf, data, len);
+
+			switch (rnd() % 3) {
+			case 0:	/* overwrite bytes */
+				for (int n = 1 + rnd() % 4; n > 0; n--)
+					buf[rnd() % len] =
+					    bytes[rnd() % (sizeof bytes - 1)];
+				break;
+			case 1:	/* cut the end */
+				len = rnd() % len;
+				break;
+			case 2:	/* line ends without CR */
+				for (size_t j = 0; j + 1 < len; j++)
+					if (buf[j] == '\r' && rnd() % 2)
+						buf[j] = ' ';
+				break;
+			}
+			check_pieces(e->name, buf, len, e->kind);
+			free(buf);
+		}
+	}
+
+	printf("check corpus=%zu mutations=%zu ok\n", ncorpus, mutations);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "httpbench [-t] [-c httpc] [-d msec]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *errstr = NULL;
+	bool test = false;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:d:th")) != -1) {
+		switch (ch) {
+		case 'c':
+			httpc = optarg;
+			break;
+		case 'd':
+			duration = strtonum(optarg, 1, 60000, &errstr) / 1e3;
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "duration is %s: %s", errstr,
+				    optarg);
+			break;
+		case 't':
+			test = true;
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	build_corpus();
+
+	if (test) {
+		check();
+		return EXIT_SUCCESS;
+	}
+
+	for (size_t i = 0; i < ncorpus; i++) {
+		struct entry *e = &corpus[i];
+
+		switch (e->kind) {
+		case REQUEST:
+			bench("next", e, run_next);
+			bench("request", e, run_request);
+			break;
+		case RESPONSE:
+			bench("next", e, run_next);
+			bench("field", e, run_response);
+			bench("line_fh", e, run_line_fh);
+			break;
+		case CHUNKED:
+			bench_decoder(e);
+			bench_httpc(e);
+			break;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
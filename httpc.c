@@ -14,16 +14,30 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
+#include <zlib.h>
+
 #include "http_parser.h"
 
 #include "dprintf.c"
@@ -31,118 +45,1024 @@
 #define READ_FD 6
 #define WRITE_FD 7
 
+#define MAXDEPTH 64	/* outstanding requests */
+#define MAXSEGS 64	/* parallel connections of a segmented download */
+#define PROGRESS (1024 * 1024)	/* bytes between two reports of a segment */
+#define VALIDATOR 256	/* longest ETag or date we keep */
+
 static void
 usage(void)
 {
-	fprintf(stderr, "httpc [-h] [-H HOST] [-o file] [URI]\n");
+	fprintf(stderr, "httpc [-h] [-c chain] [-H HOST] [-n depth] "
+	    "[-o file] [-r retries] [-s segments] [URI ... | -]\n");
 	exit(EXIT_FAILURE);
 }
 
-void
-read_header(struct http_response *head, FILE *fh)
+/* buffered input of the connection */
+struct input {
+	int fd;
+	size_t off;	/* first unused byte */
+	size_t len;	/* end of the data */
+	char buf[HTTP_HEAD_MAX];
+};
+
+/* one download of the queue */
+struct job {
+	const char *uri;
+	const char *file;	/* NULL for stdout */
+	off_t done;		/* bytes of the content we have */
+	off_t last;		/* last byte of a segment, -1 for all */
+	off_t shown;		/* decoded bytes written to stdout */
+	char validator[VALIDATOR];	/* If-Range of ranges, empty for none */
+	bool resumable;		/* done is valid for a Range request */
+};
+
+/* destination of a response */
+struct sink {
+	FILE *fh;		/* NULL to discard */
+	int fd;			/* file of a segment, -1 for fh */
+	off_t pos;		/* of the next write into fd */
+	off_t reported;		/* pos we told the parent */
+	int coding;		/* content coding of the body */
+	bool zinit;		/* z is set up */
+	bool zend;		/* z is at the end of a stream */
+	z_stream z;
+	off_t skip;		/* decoded bytes stdout got already */
+	bool restart;		/* the range does not fit to what we have */
+	struct job *job;
+};
+
+static char *host;
+static bool host_opt;	/* host is not from the environment */
+static char *chain;
+static int depth = 1;
+static int retries = 3;
+static bool failed;
+
+/* read as much as fits behind the data, return 0 at the end of input */
+static size_t
+fill(struct input *in)
 {
-	char buf[BUFSIZ];
+	ssize_t n;
+
+	while ((n = read(in->fd, in->buf + in->len, sizeof in->buf - in->len))
+	    == -1 && errno == EINTR)
+		;
+	if (n == -1 && errno == ECONNRESET)	/* like an early close */
+		n = 0;
+	if (n == -1)
+		err(EXIT_FAILURE, "read");
+
+	in->len += n;
+	return n;
+}
+
+/* move the unused data to the beginning of the buffer */
+static void
+compact(struct input *in)
+{
+	memmove(in->buf, in->buf + in->off, in->len - in->off);
+	in->len -= in->off;
+	in->off = 0;
+}
+
+/* return -1 if the connection ends before the header */
+static int
+read_header(struct http_response *head, struct input *in)
+{
+	struct http_parser p;
+	struct http_slice name, value;
 
 	memset(head, 0, sizeof *head);
+	head->content_length = SIZE_MAX;	/* up to the end */
 
-	if (http_read_line_fh(fh , buf, sizeof buf) == -1)
-		errx(EXIT_FAILURE, "http_read_line failed");
+	compact(in);
+	http_parser_init(&p, true);
 
-	head->code = http_parse_code(buf, sizeof buf);
-	if (head->code == -1)
-		errx(EXIT_FAILURE, "unable to parse HTTP RETURN CODE");
+	for (;;) {
+		switch (http_next(&p, in->buf, in->len, &name, &value)) {
+		case HTTP_MORE:
+			if (in->len == sizeof in->buf)
+				errx(EXIT_FAILURE, "header too large");
+			if (fill(in) == 0)
+				return -1;
+			break;
+		case HTTP_START_LINE:
+			head->code = http_parse_status(&name);
+			if (head->code == -1)
+				errx(EXIT_FAILURE,
+				    "unable to parse HTTP RETURN CODE");
+			if (strncmp(name.ptr, "HTTP/1.0", 8) == 0)
+				head->close = true;
+			break;
+		case HTTP_FIELD:
+			if (http_parse_field(head, &name, &value) == -1)
+				errx(EXIT_FAILURE, "http_parse_field failed");
+			break;
+		case HTTP_END:
+			in->off = p.off;
+			return 0;
+		case HTTP_ERROR:
+			errx(EXIT_FAILURE, "malformed header");
+		}
+	}
+}
 
-	if (head->code != 200)
-		errx(EXIT_FAILURE, "http_parse_code...%d %s\n", head->code,
-		    http_reason_phrase(head->code));
+/* tell the parent of a segmented download where we are */
+static void
+report(struct sink *out)
+{
+	if (dprintf(STDOUT_FILENO, "%lld\n", (long long)out->pos) < 0)
+		err(EXIT_FAILURE, "dprintf");
+	out->reported = out->pos;
+}
+
+static void
+put(struct sink *out, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	if (out->fd != -1) {
+		/* the neighbour segment must stay untouched */
+		if (out->pos + (off_t)len > out->job->last + 1)
+			errx(EXIT_FAILURE, "%s: more than the range",
+			    out->job->uri);
+		for (; len > 0; len -= n, out->pos += n) {
+			if ((n = pwrite(out->fd, buf, len, out->pos)) == -1)
+				err(EXIT_FAILURE, "pwrite");
+			buf = (const char *)buf + n;
+		}
+		if (out->pos - out->reported >= PROGRESS)
+			report(out);
+		return;
+	}
+
+	if (out->skip > 0) {
+		n = (off_t)len > out->skip ? out->skip : (off_t)len;
+		out->skip -= n;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+
+	if (len > 0 && out->fh != NULL && fwrite(buf, len, 1, out->fh) == 0)
+		err(EXIT_FAILURE, "fwrite");
+	if (out->fh == stdout)
+		out->job->shown += len;
+}
 
-	/* read response header */
+/*
+ * Inflate encoded content into the destination.  The memory is bounded by
+ * the window of zlib and our output buffer.
+ */
+static void
+decode(struct sink *out, const char *buf, size_t len)
+{
+	static unsigned char zbuf[BUFSIZ * 2];
+	const unsigned char *p = (const unsigned char *)buf;
+	int ret, bits = 16 + MAX_WBITS;	/* gzip */
+
+	if (out->fh == NULL || len == 0)
+		return;
+
+	if (!out->zinit) {
+		/* deflate is meant with zlib header, some servers send raw */
+		if (out->coding == HTTP_CONT_ENC_DEFLATE)
+			bits = (p[0] & 0x0f) == Z_DEFLATED && (p[0] >> 4) < 8 &&
+			    (len < 2 || (p[0] << 8 | p[1]) % 31 == 0) ?
+			    MAX_WBITS : -MAX_WBITS;
+		if (inflateInit2(&out->z, bits) != Z_OK)
+			errx(EXIT_FAILURE, "inflateInit2");
+		out->zinit = true;
+	}
+
+	out->z.next_in = (unsigned char *)p;
+	out->z.avail_in = len;
 	do {
-		if (http_read_line_fh(fh, buf, sizeof buf) == -1)
-			errx(EXIT_FAILURE, "http_read_line_fh failed");
+		if (out->zend) {
+			/* gzip members may follow each other */
+			if (out->coding != HTTP_CONT_ENC_GZIP)
+				break;
+			if (inflateReset(&out->z) != Z_OK)
+				errx(EXIT_FAILURE, "inflateReset");
+			out->zend = false;
+		}
 
-		if (http_parse_line(head, buf) == -1)
-			errx(EXIT_FAILURE, "http_parse_line failed");
-	} while (strcmp(buf, "\r\n") != 0);
+		out->z.next_out = zbuf;
+		out->z.avail_out = sizeof zbuf;
+		ret = inflate(&out->z, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			out->zend = true;
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+			errx(EXIT_FAILURE, "%s: inflate: %s", out->job->uri,
+			    out->z.msg ? out->z.msg : "failed");
+		put(out, zbuf, sizeof zbuf - out->z.avail_out);
+	} while (out->z.avail_in > 0 || out->z.avail_out == 0);
 }
 
-void
-read_content(size_t content_length, FILE *in, FILE *out)
+static void
+emit(struct sink *out, const char *buf, size_t len)
 {
-	char buf[BUFSIZ];
-	size_t size = sizeof buf;
+	out->job->done += len;
 
-	/* handle content */
-	for (;content_length > 0; content_length -= size) {
-		if (content_length < size)
+	if (out->coding != HTTP_CONT_ENC_PLAIN)
+		decode(out, buf, len);
+	else
+		put(out, buf, len);
+}
+
+/*
+ * Write the buffered data and read the rest in large pieces.  Returns -1
+ * if the connection ends early.  SIZE_MAX reads up to the end.
+ */
+static int
+read_content(size_t content_length, struct input *in, struct sink *out)
+{
+	size_t size;
+
+	while (content_length > 0) {
+		if (in->off == in->len) {
+			in->off = in->len = 0;
+			if (fill(in) == 0)
+				return content_length == SIZE_MAX ? 0 : -1;
+		}
+
+		size = in->len - in->off;
+		if (size > content_length)
 			size = content_length;
 
-		if (fread(buf, size , 1, in) == 0)
-			err(EXIT_FAILURE, "fread");
+		emit(out, in->buf + in->off, size);
 
-		if (fwrite(buf, size, 1, out) == 0)
-			err(EXIT_FAILURE, "fwrite");
+		in->off += size;
+		if (content_length != SIZE_MAX)
+			content_length -= size;
 	}
+
+	return 0;
 }
 
-void
-read_content_chunked(struct http_response *head, FILE *in, FILE *out)
+/* decode the chunked body in place, the trailer is skipped */
+static int
+read_content_chunked(struct input *in, struct sink *out)
 {
-	size_t content_length = 0;
-	char buf[BUFSIZ];
-	int old_errno = 0;
+	struct http_chunked c;
+	struct http_slice body;
+	ssize_t n;
 
-	do {
-		/* read: chunk-size [chunk-ext] CRLF */
-		if (http_read_line_fh(in, buf, sizeof buf) == -1)
-			errx(EXIT_FAILURE, "http_read_line failed");
-
-		/* parse: chunk-size */
-		old_errno = errno; errno = 0;
-		content_length = strtol(buf, NULL, 16);
-		if (errno != 0)
-			errx(EXIT_FAILURE, "unreadable chunk size");
-		errno = old_errno;
-
-		if (content_length > 0) {
-			/* read: chunk-data */
-			read_content(content_length, in, out);
-
-			/* read: CRLF */
-			if (http_read_line_fh(in , buf, sizeof buf) == -1)
-				errx(EXIT_FAILURE, "http_read_line failed");
-		} else {
-			/* read: trailer-part */
-			read_header(head, in);
+	http_chunked_init(&c);
+	while (c.state != HTTP_CHUNK_DONE) {
+		if (in->off == in->len) {
+			in->off = in->len = 0;
+			if (fill(in) == 0)
+				return -1;
 		}
-	} while (content_length > 0);
+
+		n = http_chunked_next(&c, in->buf + in->off, in->len - in->off,
+		    &body);
+		if (n == -1)
+			errx(EXIT_FAILURE, "malformed chunked content");
+		in->off += n;
+
+		if (body.len > 0)
+			emit(out, body.ptr, body.len);
+	}
+
+	return 0;
+}
+
+/* keep a strong ETag or else the date of the last modification */
+static void
+keep_validator(struct job *job, struct http_response *head)
+{
+	struct http_slice *v = &head->etag;
+
+	if (v->len == 0 || v->len >= VALIDATOR ||
+	    strncmp(v->ptr, "W/", 2) == 0)	/* weak ones are no use */
+		v = &head->last_modified;
+
+	job->validator[0] = '\0';
+	if (v->len > 0 && v->len < VALIDATOR) {
+		memcpy(job->validator, v->ptr, v->len);
+		job->validator[v->len] = '\0';
+	}
+}
+
+/* open the destination of a response with the given code */
+static void
+open_sink(struct sink *out, struct job *job, struct http_response *head)
+{
+	const char *mode = "w";
+
+	memset(out, 0, sizeof *out);
+	out->fd = -1;
+	out->job = job;
+
+	if (head->code != 200 && head->code != 206) {
+		warnx("%s: %d %s", job->uri, head->code,
+		    http_reason_phrase(head->code));
+		failed = true;
+		job->resumable = false;
+		return;
+	}
+
+	/* a range has to continue the content we have, or we start over */
+	if (head->code == 206 && (!head->partial ||
+	    head->range_first != (size_t)job->done ||
+	    head->content_encoding != HTTP_CONT_ENC_PLAIN)) {
+		warnx("%s: wrong range, starting over", job->uri);
+		job->done = 0;
+		job->resumable = false;
+		out->restart = true;
+		return;
+	}
+
+	/* ranges of encoded content do not fit to the decoded file */
+	job->resumable = head->content_encoding == HTTP_CONT_ENC_PLAIN;
+	keep_validator(job, head);
+	if (head->code == 206 && job->done > 0)
+		mode = "a";
+	else if (job->file == NULL)
+		out->skip = job->shown;	/* stdout got it already */
+	if (head->code == 200 || !job->resumable)
+		job->done = 0;
+
+	if (head->content_encoding == HTTP_CONT_ENC_COMPRESS) {
+		warnx("%s: compress coding is not supported", job->uri);
+		failed = true;
+		return;
+	}
+	out->coding = head->content_encoding;
+
+	if (job->file == NULL)
+		out->fh = stdout;
+	else if ((out->fh = fopen(job->file, mode)) == NULL)
+		err(EXIT_FAILURE, "fopen: %s", job->file);
+}
+
+/* complete is false if the connection ended inside of the body */
+static void
+close_sink(struct sink *out, bool complete)
+{
+	if (out->zinit) {
+		if (complete && !out->zend)
+			errx(EXIT_FAILURE, "%s: truncated %s content",
+			    out->job->uri, out->coding == HTTP_CONT_ENC_GZIP ?
+			    "gzip" : "deflate");
+		inflateEnd(&out->z);
+	}
+	if (out->fh != NULL && out->fh != stdout && fclose(out->fh) == EOF)
+		err(EXIT_FAILURE, "fclose");
+	out->fh = NULL;
+}
+
+/*
+ * Receive the response of one job.  Returns -1 if the connection ended
+ * early, 1 if the server closes it behind this response and 0 otherwise.
+ */
+static int
+fetch(struct input *in, struct job *job)
+{
+	struct http_response head;
+	struct sink out;
+	int ret;
+
+	if (read_header(&head, in) == -1)
+		return -1;
+
+	open_sink(&out, job, &head);
+	if (head.transfer_encoding == HTTP_TRANS_ENC_CHUNKED)
+		ret = read_content_chunked(in, &out);
+	else
+		ret = read_content(head.content_length, in, &out);
+	close_sink(&out, ret == 0);
+
+	if (out.restart && chain == NULL)
+		errx(EXIT_FAILURE, "%s: wrong range", job->uri);
+	if (ret == -1 || out.restart)
+		return -1;
+	if (head.close || (head.content_length == SIZE_MAX &&
+	    head.transfer_encoding != HTTP_TRANS_ENC_CHUNKED))
+		return 1;
+	return 0;
+}
+
+/* requests are collected and written at once */
+struct output {
+	size_t len;
+	char buf[BUFSIZ * 4];
+};
+
+static void
+flush(struct output *req)
+{
+	ssize_t n;
+
+	for (size_t off = 0; off < req->len; off += n)
+		if ((n = write(WRITE_FD, req->buf + off, req->len - off)) == -1)
+			err(EXIT_FAILURE, "write");
+	req->len = 0;
+}
+
+/* sizes and segments are requested without content coding */
+static void
+request(struct output *req, const struct job *job, const char *method,
+    bool last)
+{
+	char range[96] = "";
+	const char *cond = NULL;
+	bool plain = job->last != -1 || strcmp(method, "HEAD") == 0;
+	int n;
+
+	if (job->last != -1)
+		snprintf(range, sizeof range, "Range: bytes=%lld-%lld\r\n",
+		    (long long)job->done, (long long)job->last);
+	else if (job->done > 0 && job->resumable)
+		snprintf(range, sizeof range, "Range: bytes=%lld-\r\n",
+		    (long long)job->done);
+	if (range[0] != '\0' && job->validator[0] != '\0')
+		cond = job->validator;
+
+	for (;;) {
+		n = snprintf(req->buf + req->len, sizeof req->buf - req->len,
+		    "%s %s HTTP/1.1\r\n%s%s%s%s%s%s%s%s%s\r\n", method,
+		    job->uri,
+		    host ? "Host: " : "", host ? host : "", host ? "\r\n" : "",
+		    range, cond ? "If-Range: " : "", cond ? cond : "",
+		    cond ? "\r\n" : "",
+		    plain ? "" : "Accept-Encoding: gzip, deflate\r\n",
+		    last ? "Connection: close\r\n" : "");
+		if (n < 0)
+			err(EXIT_FAILURE, "snprintf");
+		if ((size_t)n < sizeof req->buf - req->len)
+			break;
+		if (req->len == 0)
+			errx(EXIT_FAILURE, "%s: URI too long", job->uri);
+		flush(req);
+	}
+	req->len += n;
+}
+
+/* run the chain with the command line in argv behind sh -c */
+static void
+exec_chain(char *argv[]) __attribute__((noreturn));
+
+static void
+exec_chain(char *argv[])
+{
+	if (asprintf(&argv[2], "exec %s \"$0\" \"$@\"", chain) == -1)
+		err(EXIT_FAILURE, "asprintf");
+
+	execv("/bin/sh", argv);
+	err(EXIT_FAILURE, "execv");
+}
+
+/*
+ * Start the chain again with ourselves and the jobs left.  The first job
+ * continues behind the content we already have, if possible.  Otherwise the
+ * new process skips what stdout got already.  Earlier failures are passed
+ * on for the exit status.
+ */
+static void
+reconnect(const char *self, struct job *job, size_t njobs, bool progress)
+    __attribute__((noreturn));
+
+static void
+reconnect(const char *self, struct job *job, size_t njobs, bool progress)
+{
+	char *argv[24 + njobs];
+	char num[4][32];
+	size_t argc = 0;
+
+	if (chain == NULL)
+		errx(EXIT_FAILURE, "connection closed early");
+	if (!progress && retries-- == 0)
+		errx(EXIT_FAILURE, "connection closed early, giving up");
+
+	snprintf(num[0], sizeof num[0], "%d", depth);
+	snprintf(num[1], sizeof num[1], "%d", retries);
+	snprintf(num[2], sizeof num[2], "%lld",
+	    job->resumable ? (long long)job->done : 0LL);
+	snprintf(num[3], sizeof num[3], "%lld", (long long)job->shown);
+
+	argv[argc++] = "sh";
+	argv[argc++] = "-c";
+	argv[argc++] = NULL;	/* command */
+	argv[argc++] = (char *)self;
+	argv[argc++] = "-c";
+	argv[argc++] = chain;
+	argv[argc++] = "-n";
+	argv[argc++] = num[0];
+	argv[argc++] = "-r";
+	argv[argc++] = num[1];
+	argv[argc++] = "-R";
+	argv[argc++] = num[2];
+	if (job->file == NULL && job->shown > 0) {
+		argv[argc++] = "-W";
+		argv[argc++] = num[3];
+	}
+	if (job->resumable && job->done > 0 && job->validator[0] != '\0') {
+		argv[argc++] = "-V";
+		argv[argc++] = job->validator;
+	}
+	if (failed)
+		argv[argc++] = "-F";
+	if (host_opt) {
+		argv[argc++] = "-H";
+		argv[argc++] = host;
+	}
+	if (job->file != NULL && njobs == 1) {
+		argv[argc++] = "-o";
+		argv[argc++] = (char *)job->file;
+	}
+	argv[argc++] = "--";
+	for (size_t i = 0; i < njobs; i++)
+		argv[argc++] = (char *)job[i].uri;
+	argv[argc] = NULL;
+
+	close(READ_FD);
+	close(WRITE_FD);
+	exec_chain(argv);
+}
+
+/*
+ * Fetch the range of one segment into the file at the same offsets and
+ * report the progress to the parent on stdout.  Returns -1 if the segment is
+ * incomplete.
+ */
+static int
+segment(struct input *in, struct job *job)
+{
+	static struct output req;
+	struct http_response head;
+	struct sink out;
+	int ret;
+
+	request(&req, job, "GET", true);
+	flush(&req);
+
+	if (read_header(&head, in) == -1)
+		errx(EXIT_FAILURE, "connection closed early");
+	/* a 200 is also the answer to an If-Range of changed content */
+	if (head.code != 206)
+		errx(EXIT_FAILURE, "%s: %d %s", job->uri, head.code,
+		    http_reason_phrase(head.code));
+	if (!head.partial)
+		errx(EXIT_FAILURE, "%s: no Content-Range", job->uri);
+	if (head.range_first != (size_t)job->done ||
+	    head.range_last > (size_t)job->last)
+		errx(EXIT_FAILURE, "%s: wrong range %zu-%zu", job->uri,
+		    head.range_first, head.range_last);
+	if (head.transfer_encoding != HTTP_TRANS_ENC_CHUNKED &&
+	    head.content_length != head.range_last - head.range_first + 1)
+		errx(EXIT_FAILURE, "%s: %zu bytes for range %zu-%zu", job->uri,
+		    head.content_length, head.range_first, head.range_last);
+	if (head.content_encoding != HTTP_CONT_ENC_PLAIN)
+		errx(EXIT_FAILURE, "%s: encoded range", job->uri);
+
+	memset(&out, 0, sizeof out);
+	out.job = job;
+	out.pos = out.reported = job->done;
+	if ((out.fd = open(job->file, O_WRONLY)) == -1)
+		err(EXIT_FAILURE, "open: %s", job->file);
+
+	if (head.transfer_encoding == HTTP_TRANS_ENC_CHUNKED)
+		ret = read_content_chunked(in, &out);
+	else
+		ret = read_content(head.content_length, in, &out);
+	report(&out);
+
+	if (close(out.fd) == -1)
+		err(EXIT_FAILURE, "close");
+
+	return ret == 0 && job->done > job->last ? 0 : -1;
+}
+
+/* one connection of a segmented download */
+struct seg {
+	off_t first;		/* next byte to fetch */
+	off_t last;
+	off_t start;		/* first at the start of the connection */
+	pid_t pid;		/* -1 if not running */
+	int fd;			/* progress of the connection */
+	size_t len;
+	char line[32];		/* incomplete report */
+};
+
+/*
+ * The state file holds the size and one line per segment in fixed width, so
+ * progress overwrites its line in place.  The validator of the content
+ * follows in the last line.
+ */
+#define STATE_LINE 42	/* "%20lld %20lld\n" */
+
+static void
+save_state(int fd, struct seg *seg, size_t i)
+{
+	char line[STATE_LINE + 1];
+
+	snprintf(line, sizeof line, "%20lld %20lld\n",
+	    (long long)seg[i].first, (long long)seg[i].last);
+	if (pwrite(fd, line, STATE_LINE, (i + 1) * STATE_LINE) != STATE_LINE)
+		err(EXIT_FAILURE, "pwrite");
+}
+
+/* returns the number of segments, 0 if the file is of another download */
+static size_t
+load_state(const char *path, off_t size, const char *validator,
+    struct seg *seg)
+{
+	long long first, last, total;
+	char *line = NULL;
+	size_t n, count, linesize = 0;
+	ssize_t len;
+	FILE *fh;
+
+	if ((fh = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			err(EXIT_FAILURE, "fopen: %s", path);
+		return 0;
+	}
+
+	n = 0;
+	if (fscanf(fh, "%lld %zu", &total, &count) != 2 ||
+	    fgetc(fh) != '\n' || total != size || count > MAXSEGS)
+		goto out;
+	for (; n < count; n++) {
+		if (fscanf(fh, "%lld %lld", &first, &last) != 2 ||
+		    fgetc(fh) != '\n' ||
+		    first < 0 || last >= size || first > last + 1)
+			break;
+		seg[n].first = first;
+		seg[n].last = last;
+	}
+
+	/* the content changed since the download started */
+	if ((len = getline(&line, &linesize, fh)) > 0 &&
+	    line[len - 1] == '\n')
+		line[len - 1] = '\0';
+	if (n != count || len <= 0 || strcmp(line, validator) != 0)
+		n = 0;
+	free(line);
+ out:
+	fclose(fh);
+	return n;
+}
+
+/* reserve the blocks of the whole file, if the system is able to */
+static void
+preallocate(int fd, off_t size)
+{
+	if (ftruncate(fd, size) == -1)
+		err(EXIT_FAILURE, "ftruncate");
+#ifdef __linux__
+	errno = posix_fallocate(fd, 0, size);
+	if (errno != 0 && errno != EOPNOTSUPP && errno != EINVAL)
+		err(EXIT_FAILURE, "posix_fallocate");
+#endif
+}
+
+/*
+ * Ask the server for the size and the validator of the content, -1 if it has
+ * no ranges.
+ */
+static off_t
+probe(struct input *in, struct job *job)
+{
+	static struct output req;
+	struct http_response head;
+
+	request(&req, job, "HEAD", true);
+	flush(&req);
+
+	if (read_header(&head, in) == -1)
+		errx(EXIT_FAILURE, "connection closed early");
+	if (head.code != 200)
+		errx(EXIT_FAILURE, "%s: %d %s", job->uri, head.code,
+		    http_reason_phrase(head.code));
+	if (!head.ranges || head.content_length == SIZE_MAX ||
+	    head.content_length > LLONG_MAX ||
+	    head.content_encoding != HTTP_CONT_ENC_PLAIN)
+		return -1;
+
+	keep_validator(job, &head);
+
+	return head.content_length;
+}
+
+/* start a connection which fetches the rest of the segment */
+static void
+spawn(const char *self, struct job *job, struct seg *seg)
+{
+	char *argv[20], range[64];
+	size_t argc = 0;
+	int fds[2];
+
+	snprintf(range, sizeof range, "%lld-%lld", (long long)seg->first,
+	    (long long)seg->last);
+
+	argv[argc++] = "sh";
+	argv[argc++] = "-c";
+	argv[argc++] = NULL;	/* command */
+	argv[argc++] = (char *)self;
+	if (host_opt) {
+		argv[argc++] = "-H";
+		argv[argc++] = host;
+	}
+	argv[argc++] = "-o";
+	argv[argc++] = (char *)job->file;
+	argv[argc++] = "-S";
+	argv[argc++] = range;
+	if (job->validator[0] != '\0') {
+		argv[argc++] = "-V";
+		argv[argc++] = job->validator;
+	}
+	argv[argc++] = "--";
+	argv[argc++] = (char *)job->uri;
+	argv[argc] = NULL;
+
+	if (pipe(fds) == -1)
+		err(EXIT_FAILURE, "pipe");
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1)
+		err(EXIT_FAILURE, "fcntl");
+
+	switch (seg->pid = fork()) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0:
+		if (dup2(fds[1], STDOUT_FILENO) == -1)
+			err(EXIT_FAILURE, "dup2");
+		close(fds[1]);
+		exec_chain(argv);
+	}
+
+	close(fds[1]);
+	seg->fd = fds[0];
+	seg->len = 0;
+	seg->start = seg->first;
+}
+
+/* take the reports of a connection, returns false at its end */
+static bool
+progress(int state, struct seg *seg, size_t i)
+{
+	const char *errstr;
+	char *nl;
+	ssize_t n;
+
+	n = read(seg[i].fd, seg[i].line + seg[i].len,
+	    sizeof seg[i].line - seg[i].len - 1);
+	if (n == -1 && errno == EINTR)
+		return true;
+	if (n == -1)
+		err(EXIT_FAILURE, "read");
+	if (n == 0)
+		return false;
+
+	seg[i].len += n;
+	seg[i].line[seg[i].len] = '\0';
+	while ((nl = strchr(seg[i].line, '\n')) != NULL) {
+		off_t pos;
+
+		*nl = '\0';
+		pos = strtonum(seg[i].line, seg[i].first, seg[i].last + 1,
+		    &errstr);
+		if (errstr != NULL)
+			errx(EXIT_FAILURE, "wrong progress %s: %s", errstr,
+			    seg[i].line);
+		seg[i].first = pos;
+		save_state(state, seg, i);
+
+		seg[i].len -= nl + 1 - seg[i].line;
+		memmove(seg[i].line, nl + 1, seg[i].len + 1);
+	}
+	if (seg[i].len == sizeof seg[i].line - 1)
+		errx(EXIT_FAILURE, "progress line too long");
+
+	return true;
+}
+
+/*
+ * Learn the size of the content and fetch it in segments over parallel
+ * connections of the chain into a preallocated file.  The state file next
+ * to it allows to resume an interrupted download.
+ */
+static int
+segmented(const char *self, struct input *in, struct job *job, size_t nsegs)
+{
+	struct seg seg[MAXSEGS];
+	struct pollfd pfd[MAXSEGS];
+	char *path, head[STATE_LINE + 1];
+	char line[VALIDATOR + 1];
+	size_t running = 0, n;
+	ssize_t len;
+	off_t size;
+	int fd, state;
+
+	if ((size = probe(in, job)) == -1) {
+		/* the server is not able to, just get it in one piece */
+		reconnect(self, job, 1, true);
+	}
+	close(READ_FD);
+	close(WRITE_FD);
+
+	if (asprintf(&path, "%s.seg", job->file) == -1)
+		err(EXIT_FAILURE, "asprintf");
+
+	if ((n = load_state(path, size, job->validator, seg)) == 0) {
+		/* new download: split up the file into equal segments */
+		if ((off_t)nsegs > size)
+			nsegs = size > 0 ? size : 1;
+		for (n = 0; n < nsegs; n++) {
+			seg[n].first = size * n / nsegs;
+			seg[n].last = size * (n + 1) / nsegs - 1;
+		}
+		if ((fd = open(job->file, O_WRONLY | O_CREAT, 0666)) == -1)
+			err(EXIT_FAILURE, "open: %s", job->file);
+		preallocate(fd, size);
+		if (close(fd) == -1)
+			err(EXIT_FAILURE, "close");
+		if ((state = open(path,
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1)
+			err(EXIT_FAILURE, "open: %s", path);
+		snprintf(head, sizeof head, "%20lld %20zu\n", (long long)size,
+		    n);
+		if (write(state, head, STATE_LINE) != STATE_LINE)
+			err(EXIT_FAILURE, "write");
+		len = snprintf(line, sizeof line, "%s\n", job->validator);
+		if (pwrite(state, line, len, (n + 1) * STATE_LINE) != len)
+			err(EXIT_FAILURE, "pwrite");
+	} else if ((state = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+		err(EXIT_FAILURE, "open: %s", path);
+	nsegs = n;
+
+	for (size_t i = 0; i < nsegs; i++) {
+		seg[i].pid = -1;
+		save_state(state, seg, i);
+		if (seg[i].first <= seg[i].last) {
+			spawn(self, job, &seg[i]);
+			running++;
+		}
+	}
+
+	while (running > 0) {
+		for (size_t i = 0; i < nsegs; i++) {
+			pfd[i].fd = seg[i].pid == -1 ? -1 : seg[i].fd;
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, nsegs, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+
+		for (size_t i = 0; i < nsegs; i++) {
+			if (pfd[i].revents == 0 || progress(state, seg, i))
+				continue;
+
+			close(seg[i].fd);
+			if (waitpid(seg[i].pid, NULL, 0) == -1)
+				err(EXIT_FAILURE, "waitpid");
+			seg[i].pid = -1;
+			running--;
+
+			if (seg[i].first > seg[i].last)
+				continue;
+
+			/* connections without progress count as failure */
+			if (seg[i].first == seg[i].start && retries-- == 0) {
+				for (size_t j = 0; j < nsegs; j++)
+					if (seg[j].pid != -1)
+						kill(seg[j].pid, SIGTERM);
+				errx(EXIT_FAILURE, "segment %lld-%lld failed, "
+				    "giving up", (long long)seg[i].first,
+				    (long long)seg[i].last);
+			}
+			spawn(self, job, &seg[i]);
+			running++;
+		}
+	}
+
+	if (close(state) == -1)
+		err(EXIT_FAILURE, "close");
+	if (unlink(path) == -1)
+		err(EXIT_FAILURE, "unlink: %s", path);
+	free(path);
+
+	return EXIT_SUCCESS;
+}
+
+/* read the URIs line by line */
+static char **
+read_uris(FILE *fh, int *count)
+{
+	char **uris = NULL, *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int n = 0;
+
+	while ((len = getline(&line, &size, fh)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' ||
+		    line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if ((uris = reallocarray(uris, n + 1, sizeof *uris)) == NULL ||
+		    (uris[n++] = strdup(line)) == NULL)
+			err(EXIT_FAILURE, "read_uris");
+	}
+	if (ferror(fh))
+		err(EXIT_FAILURE, "getline");
+	free(line);
+
+	*count = n;
+	return uris;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int ch;
-	int verbosity = 0;
-	char *host = getenv("TCPREMOTEHOST");
+	static struct input in = { READ_FD, 0, 0, "" };
+	static struct output req;
+	static char *root[] = { "/" };
+	const char *errstr = NULL;
+	const char *self = argv[0];
+	struct job *jobs;
 	char *file = NULL;
-	char *uri = "/";
-	struct http_response head;
-	FILE *fh = NULL;
-	FILE *out = stdout;
+	char **uris = root;
+	const char *validator = NULL;
+	off_t resume = 0, shown = 0, first = -1, last = -1;
+	size_t sent = 0, recv = 0, njobs, nsegs = 0;
+	int ch;
+
+	host = getenv("TCPREMOTEHOST");
 
 	if (setvbuf(stdout, NULL, _IONBF, 0) != 0)
 		err(EXIT_FAILURE, "setvbuf");
 
-	while ((ch = getopt(argc, argv, "H:o:gvh")) != -1) {
+	while ((ch = getopt(argc, argv, "c:FH:n:o:R:r:S:s:V:vW:h")) != -1) {
 		switch (ch) {
+		case 'c':
+			chain = optarg;
+			break;
+		case 'F':
+			failed = true;
+			break;
 		case 'H':
-			if ((host = strdup(optarg)) == NULL) goto err;
+			host = optarg;
+			host_opt = true;
+			break;
+		case 'n':
+			depth = strtonum(optarg, 1, MAXDEPTH, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "depth is %s: %s", errstr,
+				    optarg);
 			break;
 		case 'o':
-			if ((file = strdup(optarg)) == NULL) goto err;
+			file = optarg;
+			break;
+		case 'R':
+			resume = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "offset is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'r':
+			retries = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "retries is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'S': {
+			char *dash = strchr(optarg, '-');
+
+			if (dash == NULL)
+				errx(EXIT_FAILURE, "range is invalid: %s",
+				    optarg);
+			*dash = '\0';
+			first = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr == NULL)
+				last = strtonum(dash + 1, first, LLONG_MAX,
+				    &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "range is %s: %s-%s", errstr,
+				    optarg, dash + 1);
+			break;
+		}
+		case 's':
+			nsegs = strtonum(optarg, 1, MAXSEGS, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "segments is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'V':
+			validator = optarg;
 			break;
 		case 'v':
-			verbosity++;
+			break;
+		case 'W':
+			shown = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "offset is %s: %s", errstr,
+				    optarg);
 			break;
 		case 'h':
 		default:
@@ -153,37 +1073,87 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc > 0)
-		uri = argv[0];
+	if (argc == 1 && strcmp(argv[0], "-") == 0)
+		uris = read_uris(stdin, &argc);
+	else if (argc > 0)
+		uris = argv;
+	else
+		argc = 1;
 
-	/* write HTTP request header */
-	dprintf(WRITE_FD, "GET %s HTTP/1.1\r\n", uri);
-	if (host != NULL)
-		dprintf(WRITE_FD, "Host: %s\r\n", host);
-	dprintf(WRITE_FD, "Accept-Encoding: gzip\r\n");
-	dprintf(WRITE_FD, "Connection: close\r\n");
-	dprintf(WRITE_FD, "\r\n");
+	if (argc == 0)
+		errx(EXIT_FAILURE, "no URI");
+	if (file != NULL && argc > 1)
+		errx(EXIT_FAILURE, "-o needs a single URI");
+	if ((nsegs > 0 || first != -1) && file == NULL)
+		errx(EXIT_FAILURE, "segments need -o");
+	if (nsegs > 0 && chain == NULL)
+		errx(EXIT_FAILURE, "segments need -c");
 
-	if ((fh = fdopen(READ_FD, "r")) == NULL)
-		err(EXIT_FAILURE, "fdopen");
+	njobs = argc;
+	if ((jobs = calloc(njobs, sizeof *jobs)) == NULL)
+		err(EXIT_FAILURE, "calloc");
 
-	if (file == NULL)
-		file = basename(uri);
+	/* one URI goes to stdout, a queue into files named like the path */
+	for (size_t i = 0; i < njobs; i++) {
+		jobs[i].uri = uris[i];
+		jobs[i].file = file;
+		jobs[i].last = -1;
+		if (njobs > 1) {
+			char *path, *base;
 
-	read_header(&head, fh);
+			if ((path = strdup(uris[i])) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			path[strcspn(path, "?#")] = '\0';
+			base = basename(path);
+			if (strcmp(base, "/") == 0 || strcmp(base, ".") == 0)
+				base = "index.html";
+			if ((jobs[i].file = strdup(base)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			free(path);
+		}
+	}
+	jobs[0].done = resume;
+	jobs[0].resumable = resume > 0;
+	jobs[0].shown = shown;
+	if (validator != NULL && (size_t)snprintf(jobs[0].validator,
+	    sizeof jobs[0].validator, "%s", validator) >=
+	    sizeof jobs[0].validator)
+		errx(EXIT_FAILURE, "validator too long: %s", validator);
 
-	if (head.content_encoding == HTTP_CONT_ENC_GZIP) {
-		if ((out = popen("exec gunzip", "w")) == NULL)
-			err(EXIT_FAILURE, "popen");
+	if (first != -1) {
+		jobs[0].done = first;
+		jobs[0].last = last;
+		return segment(&in, &jobs[0]) == 0 ? EXIT_SUCCESS :
+		    EXIT_FAILURE;
 	}
+	if (nsegs > 0)
+		return segmented(self, &in, &jobs[0], nsegs);
 
-	if (head.transfer_encoding == HTTP_TRANS_ENC_CHUNKED)
-		read_content_chunked(&head, fh, out);
-	else
-		read_content(head.content_length, fh, out);
+	while (recv < njobs) {
+		/* keep the pipeline filled */
+		for (; sent < njobs && sent - recv < (size_t)depth; sent++)
+			request(&req, &jobs[sent], "GET", sent == njobs - 1);
+		flush(&req);
 
-	return EXIT_SUCCESS;
- err:
-	perror("err: httpc:");
-	return EXIT_FAILURE;
+		switch (fetch(&in, &jobs[recv])) {
+		case -1:
+			/* new content or a finished job are progress */
+			reconnect(self, &jobs[recv], njobs - recv, recv > 0 ||
+			    (jobs[recv].resumable && jobs[recv].done > resume));
+			/* NOTREACHED */
+		case 1:
+			if (++recv < njobs) {
+				jobs[recv].done = 0;
+				jobs[recv].resumable = false;
+				reconnect(self, &jobs[recv], njobs - recv,
+				    true);
+			}
+			break;
+		default:
+			recv++;
+			break;
+		}
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -14,7 +14,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,10 +36,163 @@
 #define READ_FD 6
 #define WRITE_FD 7
 
+#define MAXHOPS 8	/* proxies behind the first one */
+
 void
 usage(void)
 {
-	fprintf(stderr, "httppc host port prog\n");
+	fprintf(stderr, "httppc [-o] [-x host:port] host port prog\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Ask the proxy on the other end of the connection for a tunnel to
+ * authority (host:port).
+ */
+static void
+request(const char *authority, const char *basic)
+{
+	/* write HTTP request header at once */
+	if (dprintf(WRITE_FD, "CONNECT %s HTTP/1.1\r\nHost: %s\r\n%s%s%s\r\n",
+	    authority, authority,
+	    basic != NULL ? "Proxy-Authorization: basic " : "",
+	    basic != NULL ? basic : "", basic != NULL ? "\r\n" : "") < 0)
+		err(EXIT_FAILURE, "dprintf");
+}
+
+/* read the answer of the proxy and fail if the tunnel was refused */
+static void
+answer(const char *authority)
+{
+	char buf[BUFSIZ];
+
+	if (http_read_head_fd(READ_FD, buf, sizeof buf) == -1)
+		err(EXIT_FAILURE, "http_read_head_fd");
+
+	int code = http_parse_code(buf, sizeof buf);
+	if (code != 200)
+		errx(EXIT_FAILURE, "%s: %d %s", authority, code,
+		    http_reason_phrase(code));
+}
+
+/*
+ * The proxy may drop data which arrives before its answer, thus the hops of
+ * a chain are negotiated one after the other.
+ */
+static void
+tunnel(const char *authority, const char *basic)
+{
+	request(authority, basic);
+	answer(authority);
+}
+
+static int chld_fd = -1;	/* writing end of the SIGCHLD self-pipe */
+
+static void
+chld(int sig)
+{
+	int saved_errno = errno;
+
+	(void)sig;
+	write(chld_fd, "", 1);
+	errno = saved_errno;
+}
+
+/*
+ * Optimistic mode: the program is started before the answer of the proxy
+ * arrives and writes its first data directly behind the request.  This
+ * process stays in front of the reading side to strip the answer and
+ * relays the rest of the tunnel to the program.
+ */
+static void
+shim(const char *authority)
+{
+	char buf[BUFSIZ * 8];
+	int fds[2], sig[2], status;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe(fds) == -1)
+		err(EXIT_FAILURE, "pipe");
+
+	/* the relay has to end with the program, even on an idle tunnel */
+	if (pipe(sig) == -1)
+		err(EXIT_FAILURE, "pipe");
+	if (fcntl(sig[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(sig[1], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(sig[1], F_SETFL, O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "fcntl");
+	chld_fd = sig[1];
+	if (signal(SIGCHLD, chld) == SIG_ERR)
+		err(EXIT_FAILURE, "signal");
+
+	switch ((pid = fork())) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0:
+		if (signal(SIGCHLD, SIG_DFL) == SIG_ERR)
+			err(EXIT_FAILURE, "signal");
+		if (dup2(fds[0], READ_FD) == -1)
+			err(EXIT_FAILURE, "dup2");
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	close(fds[0]);
+	close(WRITE_FD);	/* the program writes into the tunnel itself */
+
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		err(EXIT_FAILURE, "signal");
+
+	/* on a refused tunnel the program is stopped and we fail */
+	if (http_read_head_fd(READ_FD, buf, sizeof buf) == -1) {
+		kill(pid, SIGTERM);
+		err(EXIT_FAILURE, "http_read_head_fd");
+	}
+
+	int code = http_parse_code(buf, sizeof buf);
+	if (code != 200) {
+		kill(pid, SIGTERM);
+		errx(EXIT_FAILURE, "%s: %d %s", authority, code,
+		    http_reason_phrase(code));
+	}
+
+	struct pollfd pfd[2] = {
+		{ .fd = READ_FD, .events = POLLIN },
+		{ .fd = sig[0], .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+		if (pfd[1].revents != 0) {
+			/* tell the server that nobody reads the tunnel */
+			shutdown(READ_FD, SHUT_RD);
+			break;		/* the program is gone */
+		}
+		if ((n = read(READ_FD, buf, sizeof buf)) <= 0) {
+			if (n == -1)
+				warn("read");
+			break;
+		}
+		for (ssize_t off = 0, w; off < n; off += w)
+			if ((w = write(fds[1], buf + off, n - off)) == -1)
+				goto out;
+	}
+ out:
+	close(fds[1]);
+
+	/* the program still writes into the tunnel on its own copy */
+	close(READ_FD);
+
+	if (waitpid(pid, &status, 0) == -1)
+		err(EXIT_FAILURE, "waitpid");
+	if (WIFEXITED(status))
+		exit(WEXITSTATUS(status));
 	exit(EXIT_FAILURE);
 }
 
@@ -40,15 +201,26 @@ main(int argc, char *argv[])
 {
 	int ch;
 	char *basic = NULL;
-	char buf[BUFSIZ];
+	char *hop[MAXHOPS];
+	char target[BUFSIZ];
+	int nhops = 0;
+	bool optimistic = false;
 
-	while ((ch = getopt(argc, argv, "bh")) != -1) {
+	while ((ch = getopt(argc, argv, "b:hox:")) != -1) {
 		switch (ch) {
 		case 'b':
 			if ((basic = strdup(optarg)) == NULL)
 				err(EXIT_FAILURE, "strdup");
 			/* TODO: transform username and password into basic */
 			break;
+		case 'o':
+			optimistic = true;
+			break;
+		case 'x':
+			if (nhops == MAXHOPS)
+				errx(EXIT_FAILURE, "too many proxies");
+			hop[nhops++] = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -65,24 +237,15 @@ main(int argc, char *argv[])
 	char *port = *argv; argc--; argv++;
 	char *prog = *argv;
 
-	/* write HTTP request header */
-	dprintf(WRITE_FD, "CONNECT %s:%s HTTP/1.1\r\n", host, port);
-	dprintf(WRITE_FD, "Host: %s:%s\r\n", host, port);
-	if (basic != NULL)
-		dprintf(WRITE_FD, "Proxy-Authorization: basic %s\r\n", basic);
-	dprintf(WRITE_FD, "\r\n");
+	/* the credentials are just for the first proxy */
+	for (int i = 0; i < nhops; i++)
+		tunnel(hop[i], i == 0 ? basic : NULL);
 
-	if (http_read_line_fd(READ_FD, buf, sizeof buf) == -1)
-		errx(EXIT_FAILURE, "http_read_line_fd failed");
-
-	int code = http_parse_code(buf, sizeof buf);
-	if (code != 200)
-		errx(EXIT_FAILURE, "%d %s\n", code, http_reason_phrase(code));
-
-	do {
-		if (http_read_line_fd(READ_FD, buf, sizeof buf) == -1)
-			errx(EXIT_FAILURE, "http_read_line_fd failed");
-	} while (strcmp(buf, "\r\n") != 0);
+	snprintf(target, sizeof target, "%s:%s", host, port);
+	if (optimistic)
+		request(target, nhops == 0 ? basic : NULL);
+	else
+		tunnel(target, nhops == 0 ? basic : NULL);
 
 	/* prepare environment variables */
 	/* remove all lost address information */
@@ -101,6 +264,9 @@ main(int argc, char *argv[])
 	if (setenv("TCPREMOTEPORT", port, 1) == -1)
 		err(EXIT_FAILURE, "unsetenv");
 
+	if (optimistic)
+		shim(target);
+
 	/* start client program */                                              
 	execvp(prog, argv);
 	err(EXIT_FAILURE, "execvp: %s", prog);
@@ -18,39 +18,64 @@
 
 #include <err.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define S_(x)	#x
-#define S(x)	S_(x)
+#include "http_parser.h"
 
 #define respond(str) do {				\
 	fputs("HTTP/1.1 " str "\r\n\r\n", stdout);	\
 	exit(EXIT_SUCCESS);				\
 } while (0)
 
+static void
+usage(void)
+{
+	fprintf(stderr, "https [-d htdocs]\n");
+	exit(EXIT_FAILURE);
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
+	static char in[HTTP_HEAD_MAX];	/* requests are read in bulk */
+	size_t len = 0;
 	char buf[BUFSIZ];
-	char method[BUFSIZ+1];
 	char path[pathconf("/", _PC_PATH_MAX)+1];
 	char file[pathconf("/", _PC_PATH_MAX)+1];
 	char htdocs[pathconf("/", _PC_PATH_MAX)+1];
 	char resolved[pathconf("/", _PC_PATH_MAX)+1];
 	char host[sysconf(_SC_HOST_NAME_MAX)+1];
-	enum connection { KEEP_ALIVE, CLOSE } connection;
 	struct stat sb;
-	unsigned int major;
-	unsigned int minor;
+	struct http_parser p;
+	struct http_request req;
+	enum http_token t;
+	bool keep_alive;
+	ssize_t r;
 	size_t n;
 	FILE *fh;
+	int ch;
 
 	strcpy(htdocs, "/var/www/htdocs");
 
+	while ((ch = getopt(argc, argv, "d:h")) != -1) {
+		switch (ch) {
+		case 'd':
+			if ((size_t)snprintf(htdocs, sizeof htdocs, "%s",
+			    optarg) >= sizeof htdocs)
+				errx(EXIT_FAILURE, "htdocs path too long");
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
 #ifdef __OpenBSD__
 	if (unveil(htdocs, "r") == -1)
 		respond("500 Internal Server Error");
@@ -58,25 +83,40 @@ main(void)
 		respond("500 Internal Server Error");
 #endif
  next:
-	connection = CLOSE;
 	memset(host, 0, sizeof host);
 	memset(&sb, 0, sizeof sb);
 	memset(path, 0, sizeof path);
 	memset(resolved, 0, sizeof resolved);
 
-	/* parse method */
-	if (scanf("%" S(BUFSIZ) "s %" S(PATH_MAX) "s HTTP/%u.%u\r\n",
-	    method, path, &major, &minor) != 4)
-		respond("400 Bad Request");
-
-	/* parse header fields */
-	while (fgets(buf, sizeof buf, stdin) != NULL &&
-	    strcmp(buf, "\r\n") != 0) {
-		if (strcmp(buf, "Connection: keep-alive\r\n") == 0)
-			connection = KEEP_ALIVE;
-		if (sscanf(buf, "Host: %" S(sysconf(_SC_HOST_NAME_MAX)+1) "s\r\n", host) == 1)
+	/* parse the request in one pass, pipelined ones stay in the buffer */
+	http_parser_init(&p, true);
+	while ((t = http_parse_request(&p, &req, in, len)) == HTTP_MORE) {
+		if (len == sizeof in)
+			respond("431 Request Header Fields Too Large");
+		if ((r = read(STDIN_FILENO, in + len, sizeof in - len)) == -1 &&
+		    errno == EINTR)
 			continue;
+		if (r == 0 && len == 0)
+			return EXIT_SUCCESS;
+		if (r <= 0)
+			respond("400 Bad Request");
+		len += r;
 	}
+	if (t == HTTP_ERROR || req.major != 1)
+		respond("400 Bad Request");
+	if (req.method != HTTP_METHOD_GET && req.method != HTTP_METHOD_HEAD)
+		respond("501 Not Implemented");
+	if (req.target.len >= sizeof path)
+		respond("414 URI Too Long");
+	if (req.host.len >= sizeof host)
+		respond("400 Bad Request");
+
+	memcpy(path, req.target.ptr, req.target.len);
+	memcpy(host, req.host.ptr, req.host.len);
+	keep_alive = req.keep_alive;
+
+	len -= p.off;
+	memmove(in, in + p.off, len);
 
 	/* check for default file */
 	if (strcmp(path, "/") == 0)
@@ -104,7 +144,8 @@ main(void)
 	fputs("\r\n", stdout);
 
 	/* transfer body */
-	while ((n = fread(buf, sizeof *buf, sizeof buf, fh)) > 0)
+	while (req.method == HTTP_METHOD_GET &&
+	    (n = fread(buf, sizeof *buf, sizeof buf, fh)) > 0)
 		if (fwrite(buf, sizeof *buf, n, stdout) == 0)
 			return EXIT_FAILURE;
 
@@ -114,7 +155,7 @@ main(void)
 	if (fflush(stdout) == EOF)
 		err(EXIT_FAILURE, "fflush");
 
-	if (connection == KEEP_ALIVE)
+	if (keep_alive)
 		goto next;
 
 	return EXIT_SUCCESS;
@@ -17,94 +17,358 @@
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
 #	include <bsd/string.h>
 #else
 #	include <string.h>
 #endif
 
+#include "socks.h"
+
 /* ucspi */
 #define READ_FD 6
 #define WRITE_FD 7
 
-/* negotiation fields */
-#define SOCKSv5 0x05
-#define RSV 0x00
-
-/* authentication methods */
-#define NO_AUTH 0x00
-#define GSSAPI 	0x01	/* not supported */
-#define USRPASS 0x02	/* not supported */
-#define NOT_ACC 0xFF
-
-/* address types */
-#define IPv4 0x01
-#define BIND 0x03
-#define IPv6 0x04
-
-/* commands */
-#define CMD_CONNECT 0x01
-#define CMD_BIND    0x02 /* not supported */
-#define CMD_UDP_ASS 0x03 /* not supported */
-
-struct nego {
-	uint8_t ver;
-	uint8_t nmethods;
-	uint8_t method;
-};
-
-struct nego_ans {
-	uint8_t ver;
-	uint8_t method;
-};
-
-struct request {
-	uint8_t  ver;
-	uint8_t  cmd;
-	uint8_t  rsv;
-	uint8_t  atyp;
-	union {
-		uint8_t ip6[16];
-		uint8_t ip4[4];
-		struct {
-			uint8_t len;
-			char str[255];
-		} name;
-	} addr;
-	uint16_t port;
-};
-
-static char *
-rep_mesg(uint8_t rep)
+#define MAXHOPS 8	/* proxies behind the first one */
+
+/* write the whole vector, even if the kernel takes it piece by piece */
+static void
+writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "writev");
+		}
+		for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Read until buf holds need bytes.  Never read more, the data behind the
+ * reply belongs to the program.
+ */
+static void
+fill(uint8_t *buf, size_t *len, size_t need)
+{
+	ssize_t n;
+
+	while (*len < need) {
+		if ((n = read(READ_FD, buf + *len, need - *len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "read");
+		}
+		if (n == 0)
+			errx(EXIT_FAILURE, "proxy closed the connection");
+		*len += n;
+	}
+}
+
+static size_t
+addr_len(const struct request *r)
+{
+	if (r->atyp == IPv6)
+		return sizeof r->addr.ip6;
+	if (r->atyp == IPv4)
+		return sizeof r->addr.ip4;
+	return 1 + r->addr.name.len;
+}
+
+/* send all packets, a packet refused by the peer is dropped */
+static void
+send_batch(int fd, struct mmsghdr *msg, int cnt)
+{
+	int n;
+
+	while (cnt > 0) {
+		if ((n = sendmmsg(fd, msg, cnt, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ECONNREFUSED)
+				err(EXIT_FAILURE, "sendmmsg");
+			n = 1;
+		}
+		msg += n;
+		cnt -= n;
+	}
+}
+
+/*
+ * UDP ASSOCIATE: The program gets one end of a local packet socket on
+ * descriptor 6 and 7.  Each packet it writes is sent through the UDP relay
+ * of the proxy to the target.  Packets from the relay are handed to the
+ * program without their SOCKS header.  The association ends with the TCP
+ * connection to the proxy or with the program.
+ */
+static int
+udp_relay(const struct request *request, const struct request *reply,
+    char *prog, char *argv[])
+{
+	static uint8_t buf[UDP_BATCH][UDP_MAX];
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH][2];
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+	struct pollfd pfd[3];
+	uint8_t hdr[4 + 1 + 255 + 2] = { RSV, RSV, 0, request->atyp };
+	size_t hlen = 4;
+	const char *ip;
+	bool eof = false;
+	int sv[2], s, n, k;
+
+	/* the header to the target is the same for every packet */
+	memcpy(hdr + hlen, &request->addr, addr_len(request));
+	hlen += addr_len(request);
+	memcpy(hdr + hlen, &request->port, sizeof request->port);
+	hlen += sizeof request->port;
+
+	/* address of the relay, the unspecified address means the proxy */
+	memset(&ss, 0, sizeof ss);
+	if (reply->atyp == IPv4) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = reply->port;
+		memcpy(&sin->sin_addr, reply->addr.ip4, 4);
+		if (sin->sin_addr.s_addr == INADDR_ANY &&
+		    ((ip = getenv("SOCKSREMOTEIP")) == NULL ||
+		    inet_pton(AF_INET, ip, &sin->sin_addr) != 1))
+			errx(EXIT_FAILURE, "unknown address of the UDP relay");
+	} else if (reply->atyp == IPv6) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = reply->port;
+		memcpy(&sin6->sin6_addr, reply->addr.ip6, 16);
+		if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr) &&
+		    ((ip = getenv("SOCKSREMOTEIP")) == NULL ||
+		    inet_pton(AF_INET6, ip, &sin6->sin6_addr) != 1))
+			errx(EXIT_FAILURE, "unknown address of the UDP relay");
+	} else {
+		errx(EXIT_FAILURE, "UDP relay without address");
+	}
+
+	if ((s = socket(ss.ss_family, SOCK_DGRAM, 0)) == -1)
+		err(EXIT_FAILURE, "socket");
+	if (connect(s, (struct sockaddr *)&ss, ss.ss_family == AF_INET6 ?
+	    sizeof *sin6 : sizeof *sin) == -1)
+		err(EXIT_FAILURE, "connect");
+
+	/* keeps the packet boundaries and tells us, when the program ends */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1)
+		err(EXIT_FAILURE, "socketpair");
+
+	switch (fork()) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0:
+		if (dup2(sv[1], READ_FD) == -1) err(EXIT_FAILURE, "dup2");
+		if (dup2(sv[1], WRITE_FD) == -1) err(EXIT_FAILURE, "dup2");
+		close(sv[0]);
+		close(sv[1]);
+		close(s);
+		execvp(prog, argv);
+		err(EXIT_FAILURE, "execvp: %s", prog);
+	default:
+		break;
+	}
+	close(sv[1]);
+
+	pfd[0].fd = sv[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = READ_FD;
+	pfd[2].events = POLLIN;
+
+	while (!eof) {
+		if (poll(pfd, 3, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+
+		/* the proxy ends the association with the TCP connection */
+		if (pfd[2].revents != 0)
+			break;
+
+		/* program -> relay: put the header in front of each packet */
+		if (pfd[0].revents != 0) {
+			for (int i = 0; i < UDP_BATCH; i++) {
+				memset(&msg[i], 0, sizeof msg[i]);
+				iov[i][0].iov_base = hdr;
+				iov[i][0].iov_len = hlen;
+				iov[i][1].iov_base = buf[i];
+				iov[i][1].iov_len = UDP_MAX - hlen;
+				msg[i].msg_hdr.msg_iov = &iov[i][1];
+				msg[i].msg_hdr.msg_iovlen = 1;
+			}
+			if ((n = recvmmsg(sv[0], msg, UDP_BATCH, MSG_DONTWAIT,
+			    NULL)) == -1) {
+				if (errno != EAGAIN && errno != EINTR)
+					err(EXIT_FAILURE, "recvmmsg");
+				n = 0;
+			}
+			for (k = 0; k < n; k++) {
+				/*
+				 * Empty packets are valid, they just mean the
+				 * end after the program closed its socket.
+				 */
+				if (msg[k].msg_len == 0 &&
+				    (pfd[0].revents & POLLHUP)) {
+					eof = true;
+					break;
+				}
+				iov[k][1].iov_len = msg[k].msg_len;
+				msg[k].msg_hdr.msg_iov = iov[k];
+				msg[k].msg_hdr.msg_iovlen = 2;
+			}
+			send_batch(s, msg, k);
+		}
+
+		/* relay -> program: strip the header */
+		if (pfd[1].revents != 0) {
+			for (int i = 0; i < UDP_BATCH; i++) {
+				memset(&msg[i], 0, sizeof msg[i]);
+				iov[i][0].iov_base = buf[i];
+				iov[i][0].iov_len = UDP_MAX;
+				msg[i].msg_hdr.msg_iov = iov[i];
+				msg[i].msg_hdr.msg_iovlen = 1;
+			}
+			if ((n = recvmmsg(s, msg, UDP_BATCH, MSG_DONTWAIT,
+			    NULL)) == -1) {
+				if (errno != EAGAIN && errno != EINTR &&
+				    errno != ECONNREFUSED)
+					err(EXIT_FAILURE, "recvmmsg");
+				n = 0;
+			}
+			k = 0;
+			for (int i = 0; i < n; i++) {
+				size_t len = msg[i].msg_len;
+				size_t off = udp_hlen(buf[i], len);
+
+				if (off == 0)
+					continue;
+				iov[k][0].iov_base = buf[i] + off;
+				iov[k][0].iov_len = len - off;
+				msg[k].msg_hdr.msg_iov = iov[k];
+				k++;
+			}
+			send_batch(sv[0], msg, k);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* fill in the address and port of a CONNECT request */
+static void
+request_addr(struct request *r, const char *host, const char *port)
 {
-	switch (rep) {
-	case 0x00: return "succeeded";
-	case 0x01: return "general SOCKS server failure";
-	case 0x02: return "connection not allowed by ruleset";
-	case 0x03: return "Network unreachable";
-	case 0x04: return "Host unreachable";
-	case 0x05: return "Connection refused";
-	case 0x06: return "TTL expired";
-	case 0x07: return "Command not supported";
-	case 0x08: return "Address type not supported";
-	case 0x09:
-	default: break;
+	const char *errstr;
+
+	if (strlen(host) > 255)
+		errx(EXIT_FAILURE, "hostname is too long: %s", host);
+
+	if (inet_pton(AF_INET6, host, &r->addr.ip6) == 1) {
+		r->atyp = IPv6;
+	} else if (inet_pton(AF_INET, host, &r->addr.ip4) == 1) {
+		r->atyp = IPv4;
+	} else {
+		r->atyp = BIND;
+		r->addr.name.len = strlen(host);
+		memcpy(r->addr.name.str, host, r->addr.name.len);
+	}
+
+	r->port = htons(strtonum(port, 1, UINT16_MAX, &errstr));
+	if (errstr != NULL)
+		errx(EXIT_FAILURE, "port is %s: %s", errstr, port);
+}
+
+/* split a hop of the proxy chain: host:port or [ipv6]:port */
+static void
+hop_addr(struct request *r, char *hop)
+{
+	char *host = hop;
+	char *port;
+
+	if ((port = strrchr(hop, ':')) == NULL)
+		errx(EXIT_FAILURE, "proxy without port: %s", hop);
+	*port++ = '\0';
+
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		host++;
 	}
 
-	return "unassigned";
+	request_addr(r, host, port);
+}
+
+/* read the method answer and the reply of one proxy */
+static void
+read_reply(struct request *reply, const char *proxy)
+{
+	uint8_t buf[REPLY_MAX];
+	uint8_t *rep = buf + sizeof(struct nego_ans);
+	size_t len = 0, alen;
+
+	fill(buf, &len, sizeof(struct nego_ans));
+	if (buf[0] != SOCKSv5)
+		errx(EXIT_FAILURE, "%s: unknown SOCKS version %d", proxy,
+		    buf[0]);
+	if (buf[1] != NO_AUTH)
+		errx(EXIT_FAILURE, "%s: No acceptable authentication methods",
+		    proxy);
+
+	/* header and the first byte of the address */
+	fill(buf, &len, sizeof(struct nego_ans) + 4 + 1);
+	reply->ver = rep[0];
+	reply->cmd = rep[1];
+	reply->atyp = rep[3];
+
+	if (reply->cmd != REP_SUCCEEDED)
+		errx(EXIT_FAILURE, "%s: %s", proxy, rep_mesg(reply->cmd));
+
+	if (reply->atyp == IPv6)
+		alen = sizeof reply->addr.ip6;
+	else if (reply->atyp == IPv4)
+		alen = sizeof reply->addr.ip4;
+	else if (reply->atyp == BIND)
+		alen = 1 + rep[4];
+	else
+		errx(EXIT_FAILURE, "%s: unknown address type in reply", proxy);
+
+	fill(buf, &len,
+	    sizeof(struct nego_ans) + 4 + alen + sizeof reply->port);
+	memcpy(&reply->addr, rep + 4, alen);
+	memcpy(&reply->port, rep + 4 + alen, sizeof reply->port);
 }
 
 static void
 usage(void)
 {
-	fputs("tcpclient proxyhost proxyport sockc host port prog [args...]\n",
-	    stderr);
+	fputs("tcpclient proxyhost proxyport sockc [-hu] [-x host:port] host "
+	    "port prog [args...]\n", stderr);
 	exit(EXIT_FAILURE);
 }
 
@@ -112,13 +376,29 @@ int
 main(int argc, char *argv[])
 {
 	struct nego nego = {SOCKSv5, 1, NO_AUTH};
-	struct nego_ans nego_ans = {0, 0};
 	struct request request = {SOCKSv5, CMD_CONNECT, RSV, 0, {{0}}, 0};
 	struct request reply = {SOCKSv5, 0, RSV, 0, {{0}}, 0};
-	int ch, af = AF_INET6;
-
-	while ((ch = getopt(argc, argv, "p:")) != -1) {
+	struct request assoc = {SOCKSv5, CMD_UDP_ASS, RSV, IPv4, {{0}}, 0};
+	struct request hop[MAXHOPS + 1];	/* further proxies and target */
+	char *name[MAXHOPS + 1];
+	struct iovec iov[(MAXHOPS + 1) * 4];
+	int nhops = 0;
+	bool udp = false;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "hux:")) != -1) {
 		switch (ch) {
+		case 'u':
+			udp = true;
+			break;
+		case 'x':
+			if (nhops == MAXHOPS)
+				errx(EXIT_FAILURE, "too many proxies");
+			hop[nhops] = request;
+			if ((name[nhops] = strdup(optarg)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			hop_addr(&hop[nhops++], optarg);
+			break;
 		case 'h':
 		default:
 			usage();
@@ -129,78 +409,51 @@ main(int argc, char *argv[])
 	argv += optind;
 
 	if (argc < 3) usage();
+
+	/*
+	 * A proxy takes the packets of the host its TCP peer is on, that is the
+	 * previous proxy in a chain.  Our packets would also go straight to its
+	 * relay, around the chain.
+	 */
+	if (udp && nhops > 0)
+		errx(EXIT_FAILURE, "UDP association through a chain of proxies "
+		    "is not supported");
+
 	char *host = *argv; argv++; argc--;
 	char *port = *argv; argv++; argc--;
 	char *prog = *argv; /* argv[0] == program name */
 
-	if (strlen(host) > 255)
-		perror("sockc: hostname is too long");
-
-	/* parsing address argument */
-	if (inet_pton(AF_INET6, host, &request.addr.ip6) == 1) {
-		af = AF_INET6;
-		request.atyp = IPv6;
-	} else if (inet_pton(AF_INET, host, &request.addr.ip4) == 1) {
-		af = AF_INET;
-		request.atyp = IPv4;
-	} else if ((memcpy(request.addr.name.str, host, strlen(host))) != NULL){
-		af = AF_INET;
-		request.atyp = BIND;
-	} else {
-		perror("could not handle address");
+	request_addr(&request, host, port);
+	hop[nhops] = udp ? assoc : request;
+	name[nhops] = host;
+
+	/*
+	 * Send the greetings and requests of all proxies at once.  We just
+	 * offer NO_AUTH, thus the choice of each proxy is known in advance.
+	 * Each proxy reads just its own request and passes the rest on to the
+	 * next one, after it is connected.  So, the whole chain is negotiated
+	 * in one round trip per proxy instead of two and without a process per
+	 * hop.  The address of an UDP association is left open, the proxy
+	 * takes the packets of our host.
+	 */
+	for (int i = 0; i <= nhops; i++) {
+		struct request *req = &hop[i];
+
+		iov[i * 4].iov_base = &nego;
+		iov[i * 4].iov_len = sizeof nego;
+		iov[i * 4 + 1].iov_base = req;
+		iov[i * 4 + 1].iov_len = 4;
+		iov[i * 4 + 2].iov_base = &req->addr;
+		iov[i * 4 + 2].iov_len = addr_len(req);
+		iov[i * 4 + 3].iov_base = &req->port;
+		iov[i * 4 + 3].iov_len = sizeof req->port;
 	}
 
-	/* parsing port number */
-	if ((request.port = htons((uint16_t)strtol(port, NULL, 0))) == 0)
-		goto err;
-
-	/* sockc: start negotiation */
-	if (write(WRITE_FD, &nego, sizeof nego) < 0) goto err;
-	if (read(READ_FD, &nego_ans, sizeof nego_ans) < 0) goto err;
-
-	if (nego_ans.method == NOT_ACC)
-		perror("No acceptable authentication methods");
-
-	/* sockc: request for connection */
-	if (write(WRITE_FD, &request, 4) < 0) goto err;
-
-	if (request.atyp == IPv6) {
-		write(WRITE_FD, &request.addr.ip6, 16);
-	} else if (request.atyp == IPv4) {
-		write(WRITE_FD, &request.addr.ip4, 4);
-	} else if (request.atyp == BIND) {
-		request.addr.name.len = strlen(host);
-		write(WRITE_FD, &request.addr.name.len, \
-		    sizeof request.addr.name.len);
-		write(WRITE_FD, request.addr.name.str, request.addr.name.len);
-	} else {
-		perror("this should not happen");
-	}
-
-	/* sockc: send requested port */
-	if (write(WRITE_FD, &request.port, sizeof request.port) < 0) goto err;
+	writev_all(WRITE_FD, iov, (nhops + 1) * 4);
 
-	/* sockc: start analysing reply */
-	if (read(READ_FD, &reply, 4) < 0) goto err;
-
-	if (reply.cmd != 0)
-		perror(rep_mesg(reply.cmd));
-
-	/* read the bind address of the reply */
-	if (reply.atyp == IPv6) {
-		af = AF_INET6;
-		read(READ_FD, &reply.addr.ip6, sizeof reply.addr.ip6);
-	} else if (reply.atyp == IPv4) {
-		read(READ_FD, &reply.addr.ip4, sizeof reply.addr.ip4);
-	} else if (reply.atyp ==  BIND) {
-		read(READ_FD, &reply.addr.name.len, sizeof reply.addr.name.len);
-		read(READ_FD, &reply.addr.name.str, reply.addr.name.len);
-	} else {
-		perror("sockc: unknown address type in reply");
-	}
-
-	/* read the port of the replay */
-	read(READ_FD, &reply.port, sizeof reply.port);
+	/* sockc: analyse the answers in the order of the chain */
+	for (int i = 0; i <= nhops; i++)
+		read_reply(&reply, name[i]);
 
 	/* set ucspi enviroment variables */
 	char *tcp_remote_ip   = getenv("TCPREMOTEIP");
@@ -225,7 +478,8 @@ main(int argc, char *argv[])
 
 	char tmp[BUFSIZ];
 	if (request.atyp == IPv6 || request.atyp == IPv4) {
-		inet_ntop(af, &request.addr, tmp, sizeof tmp);
+		inet_ntop(request.atyp == IPv6 ? AF_INET6 : AF_INET,
+		    &request.addr, tmp, sizeof tmp);
 		setenv("TCPREMOTEIP", tmp, 1);
 		unsetenv("TCPREMOTEHOST");
 	} else {
@@ -236,20 +490,23 @@ main(int argc, char *argv[])
 	setenv("TCPREMOTEPORT", tmp, 1);
 
 	if (reply.atyp == IPv6 || reply.atyp == IPv4) {
-		inet_ntop(af, &reply.addr, tmp, sizeof tmp);
+		inet_ntop(reply.atyp == IPv6 ? AF_INET6 : AF_INET,
+		    &reply.addr, tmp, sizeof tmp);
 		setenv("TCPLOCALIP", tmp, 1);
 		unsetenv("TCPLOCALHOST");
 	} else {
-		strlcpy(tmp, reply.addr.name.str, reply.addr.name.len);
+		memcpy(tmp, reply.addr.name.str, reply.addr.name.len);
+		tmp[reply.addr.name.len] = '\0';
 		setenv("TCPLOCALHOST", tmp, 1);
 		unsetenv("TCPLOCALIP");
 	}
 	snprintf(tmp, sizeof tmp, "%d", ntohs(reply.port));
 	setenv("TCPLOCALPORT", tmp, 1);
 
+	if (udp)
+		return udp_relay(&request, &reply, prog, argv);
+
 	/* start client program */
 	execvp(prog, argv);
- err:
-	perror("sockc");
-	return EXIT_FAILURE;
+	err(EXIT_FAILURE, "execvp: %s", prog);
 }
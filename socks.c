@@ -15,276 +15,794 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <arpa/inet.h>
+#include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
-#include <signal.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef USE_LIBBSD
-#	include <bsd/string.h>
-#else
-#	include <string.h>
+#	include <bsd/stdlib.h>
 #endif
 
-/* enviroment */
-extern char **environ;
+#include "socks.h"
 
-/* uscpi */
+/* ucspi */
 #define READ_FD STDIN_FILENO
 #define WRITE_FD STDOUT_FILENO
 
-/* Set enviroment variable if value is not empty. */
-#define set_env(name, value)			\
-	if (strcmp((value), "") != 0)		\
-		setenv((name), (value), 1)
-
-/* negotiation fields */
-#define SOCKSv5 0x05
-#define RSV 0x00
-
-/* authentication methods */
-#define NO_AUTH 0x00
-#define GSSAPI 	0x01	/* not supported */
-#define USRPASS 0x02	/* not supported */
-#define NOT_ACC 0xFF
-
-/* address types */
-#define IPv4 0x01
-#define BIND 0x03
-#define IPv6 0x04
-
-/* commands */
-#define CMD_CONNECT 0x01
-#define CMD_BIND    0x02 /* not supported */
-#define CMD_UDP_ASS 0x03 /* not supported */
-
-#define WRITE(fd, ptr, len) do {				\
-		if (write((fd), (ptr), (len)) < (len))		\
-			goto err;				\
-	} while(0);
-
-struct nego {
-	uint8_t ver;
-	uint8_t nmethods;
-	uint8_t method;
-};
+#define MAXADDR 16		/* addresses tried per target */
+#define RELAY_PIPE (64 * 1024)	/* bytes moved at once */
 
-struct nego_ans {
-	uint8_t ver;
-	uint8_t method;
-};
+static void
+usage(void)
+{
+	fprintf(stderr, "tcpserver host port socks [-h] [-c cache_dir] "
+	    "[-T ttl] [-t timeout]\n");
+	exit(EXIT_FAILURE);
+}
 
-struct request {
-	uint8_t  ver;
-	uint8_t  cmd;
-	uint8_t  rsv;
-	uint8_t  atyp;
-	union {
-		uint8_t ip6[16];
-		uint8_t ip4[4];
-		struct {
-			uint8_t len;
-			char str[255];
-		} name;
-	} addr;
-	uint16_t port;
-};
+static void
+nonblock(int fd)
+{
+	int flags;
 
-char *
-rep_mesg(uint8_t rep)
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		err(EXIT_FAILURE, "fcntl");
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "fcntl");
+}
+
+static void
+write_all(int fd, const void *buf, size_t len)
 {
-	switch (rep) {
-	case 0x00: return "succeeded";
-	case 0x01: return "general SOCKS server failure";
-	case 0x02: return "connection not allowed by ruleset";
-	case 0x03: return "Network unreachable";
-	case 0x04: return "Host unreachable";
-	case 0x05: return "Connection refused";
-	case 0x06: return "TTL expired";
-	case 0x07: return "Command not supported";
-	case 0x08: return "Address type not supported";
-	case 0x09:
-	default: break;
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "write");
+		}
+		p += n;
+		len -= n;
 	}
+}
+
+/*
+ * Read until buf holds need bytes.  Never read more, the data behind the
+ * request belongs to the target.
+ */
+static void
+fill(uint8_t *buf, size_t *len, size_t need)
+{
+	ssize_t n;
 
-	return "unassigned";
+	while (*len < need) {
+		if ((n = read(READ_FD, buf + *len, need - *len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "read");
+		}
+		if (n == 0)
+			exit(EXIT_FAILURE);	/* client gave up */
+		*len += n;
+	}
 }
 
-void
-usage(void)
+static socklen_t
+sa_len(const struct sockaddr_storage *ss)
 {
-	fprintf(stderr, "tcpclient PROXY-HOST PROXY-PORT "
-			"socks HOST PORT PROGRAM [ARGS...]\n");
-	exit(EXIT_FAILURE);
+	return ss->ss_family == AF_INET6 ?
+	    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 }
 
-#if 0
-int
-read_request(struct request *request)
+/* answer the request, the bound address is taken from socket s */
+static void
+reply(uint8_t rep, int s)
 {
-	read(READ_FD, request, 4);
-
-	if (request->atyp == IPv6) {
-		read(READ_FD, &request->addr.ip6, 16);
-	} else if (request->atyp == IPv4) {
-		read(READ_FD, &request->addr.ip4, 4);
-	} else if (request->atyp == BIND) {
-		read(READ_FD, &request->addr.name.len, \
-		    sizeof request->addr.name.len);
-		read(READ_FD, request->addr.name.str, request->addr.name.len);
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof ss;
+	uint8_t buf[4 + 16 + 2] = { SOCKSv5, rep, RSV, IPv4 };
+	size_t off = 4;
+
+	memset(&ss, 0, sizeof ss);
+	if (s == -1 || getsockname(s, (struct sockaddr *)&ss, &len) == -1)
+		ss.ss_family = AF_INET;
+
+	if (ss.ss_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		buf[3] = IPv6;
+		memcpy(buf + off, &sin6->sin6_addr, 16);
+		off += 16;
+		memcpy(buf + off, &sin6->sin6_port, 2);
 	} else {
-		/* XXX: send err */
-		perror("this should not happen");
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		memcpy(buf + off, &sin->sin_addr, 4);
+		off += 4;
+		memcpy(buf + off, &sin->sin_port, 2);
+	}
+
+	write_all(WRITE_FD, buf, off + 2);
+}
+
+static uint8_t
+rep_code(int error)
+{
+	switch (error) {
+	case ENETUNREACH:
+		return REP_NET_UNREACH;
+	case EHOSTUNREACH:
+	case ETIMEDOUT:
+		return REP_HOST_UNREACH;
+	case ECONNREFUSED:
+		return REP_REFUSED;
+	default:
+		return REP_FAILURE;
 	}
+}
 
-	/* socks: send requested port */
-	if (read(READ_FD, &request->port, sizeof request->port) == -1) goto err;
+/*
+ * The resolver cache holds one file per target in cache_dir.  It contains
+ * the addresses as struct sockaddr_storage records and is valid for ttl
+ * seconds after its last modification.  Thus, it is just valid on the host
+ * it was written.  The files are replaced by rename(2), so concurrent socks
+ * processes never see a partial entry and no locking is needed.
+ */
+static int
+cache_path(char *path, size_t size, const char *dir, const char *host,
+    const char *port)
+{
+	if (snprintf(path, size, "%s/%s:%s", dir, host, port) >= (int)size)
+		return -1;
+
+	/* don't let the hostname escape the cache directory */
+	for (char *p = path + strlen(dir) + 1; *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';
 
 	return 0;
- err:
+}
+
+static int
+cache_load(const char *path, int ttl, struct sockaddr_storage *ss)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+
+	if (fstat(fd, &st) == -1 || time(NULL) - st.st_mtime > ttl ||
+	    (n = read(fd, ss, MAXADDR * sizeof *ss)) == -1)
+		n = 0;
+	close(fd);
+
+	return n / sizeof *ss;
+}
+
+static void
+cache_save(const char *path, const struct sockaddr_storage *ss, int cnt)
+{
+	char tmp[PATH_MAX];
+	int fd;
+
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("mkstemp: %s", tmp);
+		return;
+	}
+	if (write(fd, ss, cnt * sizeof *ss) != (ssize_t)(cnt * sizeof *ss) ||
+	    fchmod(fd, 0644) == -1 || close(fd) == -1 ||
+	    rename(tmp, path) == -1) {
+		warn("cache_save: %s", path);
+		unlink(tmp);
+	}
+}
+
+static int
+resolve(const char *host, const char *port, const char *cache_dir, int ttl,
+    struct sockaddr_storage *ss)
+{
+	struct addrinfo hints, *res, *res0;
+	char path[PATH_MAX];
+	int error, cnt = 0;
+
+	if (cache_dir != NULL &&
+	    cache_path(path, sizeof path, cache_dir, host, port) == -1)
+		cache_dir = NULL;
+
+	if (cache_dir != NULL && (cnt = cache_load(path, ttl, ss)) > 0)
+		return cnt;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	if ((error = getaddrinfo(host, port, &hints, &res0)) != 0) {
+		warnx("%s: %s", host, gai_strerror(error));
+		return 0;
+	}
+	for (res = res0; res != NULL && cnt < MAXADDR; res = res->ai_next) {
+		memset(&ss[cnt], 0, sizeof ss[cnt]);
+		memcpy(&ss[cnt++], res->ai_addr, res->ai_addrlen);
+	}
+	freeaddrinfo(res0);
+
+	if (cache_dir != NULL && cnt > 0)
+		cache_save(path, ss, cnt);
+
+	return cnt;
+}
+
+/* connect to the first address which answers within timeout seconds */
+static int
+connect_to(const struct sockaddr_storage *ss, int cnt, int timeout,
+    int *error)
+{
+	struct pollfd pfd;
+	socklen_t len = sizeof *error;
+	int s;
+
+	*error = EHOSTUNREACH;
+
+	for (int i = 0; i < cnt; i++) {
+		if ((s = socket(ss[i].ss_family, SOCK_STREAM, 0)) == -1) {
+			*error = errno;
+			continue;
+		}
+		nonblock(s);
+
+		if (connect(s, (const struct sockaddr *)&ss[i], sa_len(&ss[i]))
+		    == 0)
+			return s;
+		*error = errno;
+
+		if (*error == EINPROGRESS) {
+			pfd.fd = s;
+			pfd.events = POLLOUT;
+
+			switch (poll(&pfd, 1, timeout * 1000)) {
+			case -1:
+				err(EXIT_FAILURE, "poll");
+			case 0:
+				*error = ETIMEDOUT;
+				break;
+			default:
+				if (getsockopt(s, SOL_SOCKET, SO_ERROR, error,
+				    &len) == -1)
+					*error = errno;
+				if (*error == 0)
+					return s;
+			}
+		}
+		close(s);
+	}
+
 	return -1;
 }
+
+/*
+ * One direction of the relay.  On Linux the data is moved by splice(2)
+ * from the socket into a pipe and from the pipe into the other socket,
+ * thus the payload never enters userspace.  Other systems use a buffer.
+ */
+struct dir {
+	int from;
+	int to;
+#ifdef __linux__
+	int pipe[2];
+#else
+	char buf[RELAY_PIPE];
 #endif
+	size_t len;	/* bytes waiting to be written */
+	bool eof;
+	bool done;
+};
 
-int
-main(int argc, char *argv[], char *envp[])
+#ifdef __linux__
+static ssize_t
+pull(struct dir *d)
 {
-	struct nego nego = {SOCKSv5, 1, NO_AUTH};
-	struct nego_ans nego_ans = {0, 0};
-	struct request request = {SOCKSv5, CMD_CONNECT, RSV, 0, {{0}}, 0};
-	struct request reply = {SOCKSv5, 0, RSV, 0, {{0}}, 0};
-	int ch, af = AF_INET6;
-
-	environ = envp;
-	while ((ch = getopt(argc, argv, "p:")) != -1) {
-		switch (ch) {
-		case 'h':
-		default:
-			usage();
-			/* NOTREACHED */
+	return splice(d->from, NULL, d->pipe[1], NULL, RELAY_PIPE - d->len,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+static ssize_t
+push(struct dir *d)
+{
+	return splice(d->pipe[0], NULL, d->to, NULL, d->len,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+#else
+static ssize_t
+pull(struct dir *d)
+{
+	return read(d->from, d->buf + d->len, sizeof d->buf - d->len);
+}
+
+static ssize_t
+push(struct dir *d)
+{
+	ssize_t n;
+
+	if ((n = write(d->to, d->buf, d->len)) > 0)
+		memmove(d->buf, d->buf + n, d->len - n);
+	return n;
+}
+#endif
+
+static void
+dir_init(struct dir *d, int from, int to)
+{
+	d->from = from;
+	d->to = to;
+	d->len = 0;
+	d->eof = d->done = false;
+#ifdef __linux__
+	if (pipe(d->pipe) == -1)
+		err(EXIT_FAILURE, "pipe");
+#endif
+}
+
+/* move what is possible without blocking, returns true on progress */
+static bool
+dir_move(struct dir *d)
+{
+	bool progress = false;
+	ssize_t n;
+
+	if (!d->eof && d->len < RELAY_PIPE) {
+		if ((n = pull(d)) > 0) {
+			d->len += n;
+			progress = true;
+		} else if (n == 0 || errno == ECONNRESET) {
+			d->eof = progress = true;
+		} else if (errno != EAGAIN && errno != EINTR) {
+			err(EXIT_FAILURE, "read");
 		}
 	}
-	argc -= optind;
-	argv += optind;
-
-	if (argc < 3) usage();
-	char *host = *argv; argv++; argc--;
-	char *port = *argv; argv++; argc--;
-	char *prog = *argv; /* argv[0] == program name */
-
-	if (strlen(host) > 255)
-		perror("socks: hostname is too long");
-
-	/* parsing address argument */
-	if (inet_pton(AF_INET6, host, &request.addr.ip6) == 1) {
-		af = AF_INET6;
-		request.atyp = IPv6;
-	} else if (inet_pton(AF_INET, host, &request.addr.ip4) == 1) {
-		af = AF_INET;
-		request.atyp = IPv4;
-	} else if ((memcpy(request.addr.name.str, host, strlen(host))) != NULL){
-		af = AF_INET;
-		request.atyp = BIND;
-	} else {
-		perror("could not handle address");
+
+	if (d->len > 0) {
+		if ((n = push(d)) > 0) {
+			d->len -= n;
+			progress = true;
+		} else if (n == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+			exit(EXIT_SUCCESS);	/* nobody is listening */
+		} else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+			err(EXIT_FAILURE, "write");
+		}
 	}
 
-	/* parsing port number */
-	if ((request.port = htons((uint16_t)strtol(port, NULL, 0))) == 0) goto err;
+	/* forward the end of file */
+	if (d->eof && d->len == 0 && !d->done) {
+		if (shutdown(d->to, SHUT_WR) == -1 && errno == ENOTSOCK)
+			close(d->to);
+		d->done = progress = true;
+	}
 
-	/* socks: start negotiation */
-	if (write(WRITE_FD, &nego, sizeof nego) < 0) goto err;
-	if (read(READ_FD, &nego_ans, sizeof nego_ans) < 0) goto err;
+	return progress;
+}
 
-	if (nego_ans.method == NOT_ACC)
-		perror("No acceptable authentication methods");
+static void
+relay(int s)
+{
+	struct dir dir[2];
+	struct pollfd pfd[4];
+
+	nonblock(READ_FD);
+	nonblock(WRITE_FD);
+
+	dir_init(&dir[0], READ_FD, s);
+	dir_init(&dir[1], s, WRITE_FD);
+
+	while (!dir[0].done || !dir[1].done) {
+		bool progress = false;
+
+		for (int i = 0; i < 2; i++)
+			if (dir_move(&dir[i]))
+				progress = true;
+		if (progress)
+			continue;
+
+		/*
+		 * Sleep until one side is able to move.  A full pipe just
+		 * waits for its reader, otherwise poll would not sleep.
+		 */
+		for (int i = 0; i < 2; i++) {
+			struct dir *d = &dir[i];
+
+			pfd[i * 2].fd = !d->eof && d->len == 0 ? d->from : -1;
+			pfd[i * 2].events = POLLIN;
+			pfd[i * 2 + 1].fd = d->len > 0 ? d->to : -1;
+			pfd[i * 2 + 1].events = POLLOUT;
+		}
+		if (poll(pfd, 4, -1) == -1 && errno != EINTR)
+			err(EXIT_FAILURE, "poll");
+	}
+}
+
+static bool
+same_host(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return false;
+	if (a->ss_family == AF_INET6)
+		return memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+		    &((struct sockaddr_in6 *)b)->sin6_addr, 16) == 0;
+	return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+	    ((struct sockaddr_in *)b)->sin_addr.s_addr;
+}
 
-	/* socks: request for connection */
-	if (write(WRITE_FD, &request, 4) < 0) goto err;
+static in_port_t
+port_of(const struct sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET6)
+		return ((struct sockaddr_in6 *)ss)->sin6_port;
+	return ((struct sockaddr_in *)ss)->sin_port;
+}
 
-	if (request.atyp == IPv6) {
-		write(WRITE_FD, &request.addr.ip6, 16);
-	} else if (request.atyp == IPv4) {
-		write(WRITE_FD, &request.addr.ip4, 4);
-	} else if (request.atyp == BIND) {
-		request.addr.name.len = strlen(host);
-		write(WRITE_FD, &request.addr.name.len, \
-		    sizeof request.addr.name.len);
-		write(WRITE_FD, request.addr.name.str, request.addr.name.len);
+/* build the SOCKS header of a packet from ss, returns its length */
+static size_t
+udp_wrap(uint8_t *hdr, const struct sockaddr_storage *ss)
+{
+	in_port_t port = port_of(ss);
+	size_t len = 4;
+
+	hdr[0] = hdr[1] = RSV;
+	hdr[2] = 0;	/* no fragment */
+	if (ss->ss_family == AF_INET6) {
+		hdr[3] = IPv6;
+		memcpy(hdr + len, &((struct sockaddr_in6 *)ss)->sin6_addr, 16);
+		len += 16;
 	} else {
-		perror("this should not happen");
+		hdr[3] = IPv4;
+		memcpy(hdr + len, &((struct sockaddr_in *)ss)->sin_addr, 4);
+		len += 4;
 	}
+	memcpy(hdr + len, &port, sizeof port);
+
+	return len + sizeof port;
+}
 
-	/* socks: send requested port */
-	if (write(WRITE_FD, &request.port, sizeof request.port) < 0) goto err;
+/*
+ * Names of UDP targets are resolved once per association.  Names without an
+ * address are kept, too.  If the table is full, the oldest entry goes.
+ */
+#define UDP_NAMES 32
+
+struct udp_names {
+	size_t n;		/* entries in use */
+	size_t next;		/* entry to replace */
+	struct {
+		char host[256];
+		uint16_t port;	/* network byte order */
+		bool found;	/* ss is valid */
+		struct sockaddr_storage ss;
+	} e[UDP_NAMES];
+};
 
-	/* socks: start analysing reply */
-	if (read(READ_FD, &reply, 4) < 0) goto err;
+/* target of a client packet with a valid header, reachable by family af */
+static int
+udp_target(const uint8_t *p, struct sockaddr_storage *ss, sa_family_t af,
+    struct udp_names *names, const char *cache_dir, int ttl)
+{
+	struct sockaddr_storage res[MAXADDR];
+	size_t slot;
+	int cnt;
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+	char host[256];
+	char port[6];
+	uint16_t nport;
+
+	memset(ss, 0, sizeof *ss);
+
+	switch (p[3]) {
+	case IPv4:
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, p + 4, 4);
+		memcpy(&sin->sin_port, p + 8, 2);
+		return 0;
+	case IPv6:
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, p + 4, 16);
+		memcpy(&sin6->sin6_port, p + 20, 2);
+		return 0;
+	}
 
-	if (reply.cmd != 0)
-		perror(rep_mesg(reply.cmd));
+	memcpy(host, p + 5, p[4]);
+	host[p[4]] = '\0';
+	memcpy(&nport, p + 5 + p[4], sizeof nport);
 
-	/* read the bind address of the reply */
-	if (reply.atyp == IPv6) {
-		af = AF_INET6;
-		read(READ_FD, &reply.addr.ip6, sizeof reply.addr.ip6);
-	} else if (reply.atyp == IPv4) {
-		read(READ_FD, &reply.addr.ip4, sizeof reply.addr.ip4);
-	} else if (reply.atyp ==  BIND) {
-		read(READ_FD, &reply.addr.name.len, sizeof reply.addr.name.len);
-		read(READ_FD, &reply.addr.name.str, reply.addr.name.len);
-	} else {
-		perror("socks: unknown address type in reply");
+	for (size_t i = 0; i < names->n; i++) {
+		if (names->e[i].port == nport &&
+		    strcmp(names->e[i].host, host) == 0) {
+			*ss = names->e[i].ss;
+			return names->e[i].found ? 0 : -1;
+		}
 	}
 
-	/* read the port of the replay */
-	read(READ_FD, &reply.port, sizeof reply.port);
-
-	/* set ucspi enviroment variables */
-	char *tcp_remote_ip   = getenv("TCPREMOTEIP");
-	char *tcp_remote_port = getenv("TCPREMOTEPORT");
-	char *tcp_remote_host = getenv("TCPREMOTEHOST");
-	char *tcp_local_ip    = getenv("TCPLOCALIP");
-	char *tcp_local_port  = getenv("TCPLOCALPORT");
-	char *tcp_local_host  = getenv("TCPLOCALHOST");
-
-	set_env("SOCKSREMOTEIP",   strdup(tcp_remote_ip));
-	set_env("SOCKSREMOTEPORT", strdup(tcp_remote_port));
-	set_env("SOCKSREMOTEHOST", strdup(tcp_remote_host));
-	set_env("SOCKSLOCALIP",    strdup(tcp_local_ip));
-	set_env("SOCKSLOCALPORT",  strdup(tcp_local_port));
-	set_env("SOCKSLOCALHOST",  strdup(tcp_local_host));
-
-	char tmp[BUFSIZ];
-	if (request.atyp == IPv6 || request.atyp == IPv4) {
-		inet_ntop(af, &request.addr, tmp, sizeof tmp);
-		setenv("TCPREMOTEIP", tmp, 1);
-		unsetenv("TCPREMOTEHOST");
-	} else {
-		setenv("TCPREMOTEHOST", host, 1);
-		unsetenv("TCPREMOTEIP");
+	if (names->n < UDP_NAMES)
+		slot = names->n++;
+	else {
+		slot = names->next;
+		names->next = (names->next + 1) % UDP_NAMES;
+	}
+	memcpy(names->e[slot].host, host, sizeof host);
+	names->e[slot].port = nport;
+	names->e[slot].found = false;
+
+	snprintf(port, sizeof port, "%u", ntohs(nport));
+	cnt = resolve(host, port, cache_dir, ttl, res);
+	for (int i = 0; i < cnt; i++) {
+		if (res[i].ss_family == af) {
+			names->e[slot].ss = *ss = res[i];
+			names->e[slot].found = true;
+			return 0;
+		}
 	}
-	snprintf(tmp, sizeof tmp, "%d", ntohs(request.port));
-	setenv("TCPREMOTEPORT", tmp, 1);
 
-	if (reply.atyp == IPv6 || reply.atyp == IPv4) {
-		inet_ntop(af, &reply.addr, tmp, sizeof tmp);
-		setenv("TCPLOCALIP", tmp, 1);
-		unsetenv("TCPLOCALHOST");
+	return -1;
+}
+
+/*
+ * UDP ASSOCIATE: Packets of the client are sent to the target of their
+ * SOCKS header.  Packets of anybody else are sent to the client with their
+ * source in the header.  The client is the first sender with the address
+ * of the TCP connection.  The association lasts as long as the TCP
+ * connection.  Packets are received and sent in batches of UDP_BATCH.
+ */
+static void
+udp_associate(const char *cache_dir, int ttl)
+{
+	static uint8_t buf[UDP_BATCH][UDP_MAX];
+	static struct udp_names names;
+	uint8_t hdr[UDP_BATCH][4 + 16 + 2];
+	struct sockaddr_storage from[UDP_BATCH], to[UDP_BATCH];
+	struct sockaddr_storage local, peer, client;
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH][2];
+	struct pollfd pfd[2];
+	socklen_t len;
+	bool known = false;
+	int s, n, k;
+
+	len = sizeof local;
+	if (getsockname(READ_FD, (struct sockaddr *)&local, &len) == -1) {
+		reply(REP_FAILURE, -1);
+		err(EXIT_FAILURE, "getsockname");
+	}
+	len = sizeof peer;
+	if (getpeername(READ_FD, (struct sockaddr *)&peer, &len) == -1) {
+		reply(REP_FAILURE, -1);
+		err(EXIT_FAILURE, "getpeername");
+	}
+
+	/* the relay listens on the address the client already talks to */
+	if (local.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&local)->sin6_port = 0;
+	else
+		((struct sockaddr_in *)&local)->sin_port = 0;
+
+	if ((s = socket(local.ss_family, SOCK_DGRAM, 0)) == -1 ||
+	    bind(s, (struct sockaddr *)&local, sa_len(&local)) == -1) {
+		reply(REP_FAILURE, -1);
+		err(EXIT_FAILURE, "udp socket");
+	}
+	reply(REP_SUCCEEDED, s);
+
+	pfd[0].fd = READ_FD;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+		if (pfd[0].revents != 0)
+			return;
+		if (pfd[1].revents == 0)
+			continue;
+
+		for (int i = 0; i < UDP_BATCH; i++) {
+			memset(&msg[i], 0, sizeof msg[i]);
+			iov[i][0].iov_base = buf[i];
+			iov[i][0].iov_len = UDP_MAX;
+			msg[i].msg_hdr.msg_name = &from[i];
+			msg[i].msg_hdr.msg_namelen = sizeof from[i];
+			msg[i].msg_hdr.msg_iov = iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		if ((n = recvmmsg(s, msg, UDP_BATCH, MSG_DONTWAIT, NULL))
+		    == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				err(EXIT_FAILURE, "recvmmsg");
+			continue;
+		}
+
+		/* reuse the message headers for sending, k <= i */
+		k = 0;
+		for (int i = 0; i < n; i++) {
+			size_t plen = msg[i].msg_len;
+			size_t hlen;
+
+			if (!known && same_host(&from[i], &peer)) {
+				client = from[i];
+				known = true;
+			}
+			if (!known)
+				continue;
+
+			if (same_host(&from[i], &client) &&
+			    port_of(&from[i]) == port_of(&client)) {
+				if ((hlen = udp_hlen(buf[i], plen)) == 0 ||
+				    udp_target(buf[i], &to[k], local.ss_family,
+				    &names, cache_dir, ttl) == -1)
+					continue;
+				iov[k][0].iov_base = buf[i] + hlen;
+				iov[k][0].iov_len = plen - hlen;
+				msg[k].msg_hdr.msg_iovlen = 1;
+			} else {
+				iov[k][0].iov_base = hdr[k];
+				iov[k][0].iov_len = udp_wrap(hdr[k], &from[i]);
+				iov[k][1].iov_base = buf[i];
+				iov[k][1].iov_len = plen;
+				msg[k].msg_hdr.msg_iovlen = 2;
+				to[k] = client;
+			}
+			msg[k].msg_hdr.msg_name = &to[k];
+			msg[k].msg_hdr.msg_namelen = sa_len(&to[k]);
+			msg[k].msg_hdr.msg_iov = iov[k];
+			k++;
+		}
+
+		/* a packet which is not deliverable is dropped */
+		for (int i = 0; i < k; i += n)
+			if ((n = sendmmsg(s, msg + i, k - i, 0)) == -1)
+				n = 1;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_storage ss[MAXADDR];
+	uint8_t buf[REPLY_MAX];
+	size_t len = 0, alen;
+	char host[256];
+	char port[6];
+	char *cache_dir = NULL;
+	const char *errstr;
+	uint16_t nport;
+	int cnt = 0, ttl = 60, timeout = 10;
+	int ch, s, error;
+	bool no_auth = false;
+
+	while ((ch = getopt(argc, argv, "c:hT:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'T':
+			ttl = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "ttl is %s: %s", errstr,
+				    optarg);
+			break;
+		case 't':
+			timeout = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "timeout is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	/* greeting: version and list of methods */
+	fill(buf, &len, 2);
+	if (buf[0] != SOCKSv5)
+		errx(EXIT_FAILURE, "unknown SOCKS version %d", buf[0]);
+	fill(buf, &len, 2 + buf[1]);
+	for (size_t i = 2; i < len; i++)
+		if (buf[i] == NO_AUTH)
+			no_auth = true;
+
+	buf[0] = SOCKSv5;
+	buf[1] = no_auth ? NO_AUTH : NOT_ACC;
+	write_all(WRITE_FD, buf, sizeof(struct nego_ans));
+	if (!no_auth)
+		return EXIT_FAILURE;
+
+	/* request: header and the first byte of the address */
+	len = 0;
+	fill(buf, &len, 4 + 1);
+	if (buf[0] != SOCKSv5)
+		errx(EXIT_FAILURE, "unknown SOCKS version %d", buf[0]);
+
+	if (buf[3] == IPv4)
+		alen = 4;
+	else if (buf[3] == IPv6)
+		alen = 16;
+	else if (buf[3] == BIND)
+		alen = 1 + buf[4];
+	else {
+		reply(REP_ATYP, -1);
+		return EXIT_FAILURE;
+	}
+	fill(buf, &len, 4 + alen + sizeof nport);
+
+	if (buf[1] == CMD_UDP_ASS) {
+		udp_associate(cache_dir, ttl);
+		return EXIT_SUCCESS;
+	}
+	if (buf[1] != CMD_CONNECT) {
+		reply(REP_CMD, -1);
+		return EXIT_FAILURE;
+	}
+
+	memcpy(&nport, buf + 4 + alen, sizeof nport);
+	snprintf(port, sizeof port, "%u", ntohs(nport));
+
+	if (buf[3] == BIND) {
+		memcpy(host, buf + 5, buf[4]);
+		host[buf[4]] = '\0';
+		cnt = resolve(host, port, cache_dir, ttl, ss);
 	} else {
-		strlcpy(tmp, reply.addr.name.str, reply.addr.name.len);
-		setenv("TCPLOCALHOST", tmp, 1);
-		unsetenv("TCPLOCALIP");
+		memset(&ss[0], 0, sizeof ss[0]);
+		if (buf[3] == IPv4) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&ss[0];
+
+			sin->sin_family = AF_INET;
+			sin->sin_port = nport;
+			memcpy(&sin->sin_addr, buf + 4, 4);
+		} else {
+			struct sockaddr_in6 *sin6 =
+			    (struct sockaddr_in6 *)&ss[0];
+
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = nport;
+			memcpy(&sin6->sin6_addr, buf + 4, 16);
+		}
+		inet_ntop(ss[0].ss_family, buf + 4, host, sizeof host);
+		cnt = 1;
+	}
+
+	if ((s = connect_to(ss, cnt, timeout, &error)) == -1) {
+		if (cnt > 0)
+			warnx("%s:%s: %s", host, port, strerror(error));
+		reply(cnt > 0 ? rep_code(error) : REP_HOST_UNREACH, -1);
+		return EXIT_FAILURE;
 	}
-	snprintf(tmp, sizeof tmp, "%d", ntohs(reply.port));
-	setenv("TCPLOCALPORT", tmp, 1);
-
-	/* start client program */
-	execve(prog, argv, environ);
- err:
-	perror("socks");
-	return EXIT_FAILURE;
+	reply(REP_SUCCEEDED, s);
+
+	relay(s);
+
+	return EXIT_SUCCESS;
 }
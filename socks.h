@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2013-2021 Jan Klemkow <j.klemkow@wemelug.de>
+ * Copyright (c) 2015 Stefan Thiemann <stefanthiemann@icloud.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOCKS_H
+#define SOCKS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* SOCKS 5 protocol (RFC 1928) shared by sockc and socks */
+
+/* negotiation fields */
+#define SOCKSv5 0x05
+#define RSV 0x00
+
+/* authentication methods */
+#define NO_AUTH 0x00
+#define GSSAPI 	0x01	/* not supported */
+#define USRPASS 0x02	/* not supported */
+#define NOT_ACC 0xFF
+
+/* address types */
+#define IPv4 0x01
+#define BIND 0x03
+#define IPv6 0x04
+
+/* commands */
+#define CMD_CONNECT 0x01
+#define CMD_BIND    0x02 /* not supported */
+#define CMD_UDP_ASS 0x03
+
+/* replies */
+#define REP_SUCCEEDED	0x00
+#define REP_FAILURE	0x01
+#define REP_NOT_ALLOWED	0x02
+#define REP_NET_UNREACH	0x03
+#define REP_HOST_UNREACH 0x04
+#define REP_REFUSED	0x05
+#define REP_TTL_EXPIRED	0x06
+#define REP_CMD		0x07
+#define REP_ATYP	0x08
+
+/* method answer and the longest reply: header, name and port */
+#define REPLY_MAX (2 + 4 + 1 + 255 + 2)
+
+/* UDP relay: RSV RSV FRAG ATYP DST.ADDR DST.PORT and the payload */
+#define UDP_BATCH 32		/* packets per system call */
+#define UDP_MAX (64 * 1024)	/* largest packet */
+
+struct nego {
+	uint8_t ver;
+	uint8_t nmethods;
+	uint8_t method;
+};
+
+struct nego_ans {
+	uint8_t ver;
+	uint8_t method;
+};
+
+struct request {
+	uint8_t  ver;
+	uint8_t  cmd;
+	uint8_t  rsv;
+	uint8_t  atyp;
+	union {
+		uint8_t ip6[16];
+		uint8_t ip4[4];
+		struct {
+			uint8_t len;
+			char str[255];
+		} name;
+	} addr;
+	uint16_t port;
+};
+
+static inline const char *
+rep_mesg(uint8_t rep)
+{
+	switch (rep) {
+	case REP_SUCCEEDED:	return "succeeded";
+	case REP_FAILURE:	return "general SOCKS server failure";
+	case REP_NOT_ALLOWED:	return "connection not allowed by ruleset";
+	case REP_NET_UNREACH:	return "Network unreachable";
+	case REP_HOST_UNREACH:	return "Host unreachable";
+	case REP_REFUSED:	return "Connection refused";
+	case REP_TTL_EXPIRED:	return "TTL expired";
+	case REP_CMD:		return "Command not supported";
+	case REP_ATYP:		return "Address type not supported";
+	default: break;
+	}
+
+	return "unassigned";
+}
+
+/* length of the SOCKS header of UDP packet p, 0 if it is invalid */
+static inline size_t
+udp_hlen(const uint8_t *p, size_t len)
+{
+	size_t hlen;
+
+	if (len < 5 || p[2] != 0)	/* fragments are not supported */
+		return 0;
+
+	switch (p[3]) {
+	case IPv4:	hlen = 4 + 4 + 2; break;
+	case IPv6:	hlen = 4 + 16 + 2; break;
+	case BIND:	hlen = 4 + 1 + p[4] + 2; break;
+	default:	return 0;
+	}
+
+	return hlen <= len ? hlen : 0;
+}
+
+#endif
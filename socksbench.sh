@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Compare the throughput of a plain tcpc connection with a connection
+# through sockc and the socks server.  The receiving dd(1) measures the time.
+
+set -eu
+
+count=${1:-8192}	# 64 KiB blocks
+
+tmpdir=$(mktemp -d socksbench_XXXXXX)
+trap 'kill $target $proxy 2>/dev/null; rm -rf $tmpdir' EXIT
+
+./tcps -d 127.0.0.1 0 dd if=/dev/zero bs=64k count=$count \
+    2>$tmpdir/target.log &
+target=$!
+./tcps -d 127.0.0.1 0 ./socks 2>$tmpdir/proxy.log &
+proxy=$!
+
+until grep -q '^listen: ' $tmpdir/target.log &&
+    grep -q '^listen: ' $tmpdir/proxy.log; do sleep 1; done
+target_port=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/target.log)
+proxy_port=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/proxy.log)
+
+# print the seconds of GNU and BSD dd(1)
+seconds() {
+	sed -ne 's/.* copied, \([0-9.e-]*\) s.*/\1/p' \
+	    -e 's/.* transferred in \([0-9.e-]*\) secs.*/\1/p'
+}
+
+report() {
+	awk -v t="$1" -v n=$((count * 65536)) -v s="$2" 'BEGIN {
+		printf("socks transport=%s bytes=%.0f wall_s=%.3f mb_per_s=%.1f\n",
+		    t, n, s, n / s / 1e6) }'
+}
+
+reader="dd bs=64k of=/dev/null <&6"
+
+report direct $(./tcpc 127.0.0.1 $target_port sh -c "$reader" 2>&1 | seconds)
+report socks $(./tcpc 127.0.0.1 $proxy_port \
+    ./sockc 127.0.0.1 $target_port sh -c "$reader" 2>&1 | seconds)
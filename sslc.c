@@ -15,12 +15,18 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/select.h>
+#include <sys/wait.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -32,6 +38,20 @@
 
 /* enviroment */
 char **environ;
+
+#ifdef SSL_OP_ENABLE_KTLS
+static int chld_fd = -1;	/* writing end of the SIGCHLD self-pipe */
+
+static void
+chld(int sig)
+{
+	int saved_errno = errno;
+
+	(void)sig;
+	write(chld_fd, "", 1);
+	errno = saved_errno;
+}
+#endif
 #if 0
 static bool
 check_hostname(SSL *ssl, const char *hostname)
@@ -53,7 +73,7 @@ check_hostname(SSL *ssl, const char *hostname)
 static void
 usage(void)
 {
-	fprintf(stderr, "sslc [-hN] [-f CAFILE] [-p CAPATH] PROGRAM [ARGS]\n");
+	fprintf(stderr, "sslc [-hKN] [-f CAFILE] [-p CAPATH] PROGRAM [ARGS]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -76,8 +96,9 @@ main(int argc, char *argv[], char *envp[])
 	char *ca_file = NULL;
 	char *ca_path = NULL;
 	int verify_mode = SSL_VERIFY_PEER;
+	bool ktls = false;
 
-	while ((ch = getopt(argc, argv, "f:p:Nh")) != -1) {
+	while ((ch = getopt(argc, argv, "f:p:KNh")) != -1) {
 		switch (ch) {
 		case 'f':
 			if ((ca_file = strdup(optarg)) == NULL) goto err;
@@ -85,6 +106,9 @@ main(int argc, char *argv[], char *envp[])
 		case 'p':
 			if ((ca_path = strdup(optarg)) == NULL) goto err;
 			break;
+		case 'K':
+			ktls = true;
+			break;
 		case 'N':
 			verify_mode = SSL_VERIFY_NONE;
 			break;
@@ -100,6 +124,129 @@ main(int argc, char *argv[], char *envp[])
 	if (argc < 1)
 		usage();
 
+	SSL_load_error_strings();
+	SSL_library_init();
+	if ((ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) goto err;
+
+	/* prepare certificate checking */
+	if (ca_file != NULL || ca_path != NULL)
+		SSL_CTX_load_verify_locations(ssl_ctx, ca_file, ca_path);
+	else
+		SSL_CTX_set_default_verify_paths(ssl_ctx);
+
+	SSL_CTX_set_verify(ssl_ctx, verify_mode, NULL);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/*
+	 * The program writes into the socket behind our back, so the keys of
+	 * the sending direction must never change.  Thus, the kernel offload
+	 * is just used up to TLS 1.2 and without renegotiation, TLS 1.3 key
+	 * updates would change them.
+	 */
+	if (ktls) {
+		SSL_CTX_set_options(ssl_ctx,
+		    SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+		if (SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION) == 0)
+			goto err;
+	}
+#endif
+
+	if ((ssl = SSL_new(ssl_ctx)) == NULL) goto err;
+	if (ktls) {
+		/* kTLS needs the socket as one BIO in both directions */
+		if (SSL_set_fd(ssl, sin) == 0) goto err;
+	} else {
+		if (SSL_set_rfd(ssl, sin) == 0) goto err;
+		if (SSL_set_wfd(ssl, sout) == 0) goto err;
+	}
+	if ((ret = SSL_connect(ssl)) < 1) goto err;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/*
+	 * If the kernel took over the sending direction, the socket itself is
+	 * handed to the program as its write descriptor.  It sends plain text
+	 * and the kernel does the crypto.  The receiving direction stays with
+	 * a relay: alerts like close_notify are no data records and a plain
+	 * read(2) of the socket would fail with EIO instead of the end of
+	 * file.  SSL_read() handles them and the program gets a clean EOF.
+	 */
+	if (ktls && BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+		int pr[2], sig[2], status;
+		char buf[BUFSIZ * 4];
+
+		if (setenv("PROTO", "SSL", 1) == -1) goto err;
+		if (sin != sout && dup2(sin, sout) == -1) goto err;
+		if (pipe(pr) == -1) goto err;
+
+		/* the relay has to end with the program, even on idle input */
+		if (pipe(sig) == -1) goto err;
+		if (fcntl(sig[0], F_SETFD, FD_CLOEXEC) == -1) goto err;
+		if (fcntl(sig[1], F_SETFD, FD_CLOEXEC) == -1) goto err;
+		if (fcntl(sig[1], F_SETFL, O_NONBLOCK) == -1) goto err;
+		chld_fd = sig[1];
+		if (signal(SIGCHLD, chld) == SIG_ERR) goto err;
+
+		switch (fork()) {
+		case -1:
+			goto err;
+		case 0: {
+			int fd;
+
+			/* the pipe may overlap with descriptor 6 */
+			if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) goto err;
+			if (close(pr[1]) == -1) goto err;
+			if ((fd = dup(pr[0])) == -1) goto err;
+			if (close(pr[0]) == -1) goto err;
+			if (dup2(fd, sin) == -1) goto err;
+			if (close(fd) == -1) goto err;
+			execvp(argv[0], argv);
+			goto err;
+		}
+		}
+
+		if (close(pr[0]) == -1) goto err;
+		if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) goto err;
+
+		struct pollfd pfd[2] = {
+			{ .fd = sin, .events = POLLIN },
+			{ .fd = sig[0], .events = POLLIN },
+		};
+
+		for (;;) {
+			int n;
+
+			if (!SSL_has_pending(ssl)) {
+				if (poll(pfd, 2, -1) == -1) {
+					if (errno == EINTR)
+						continue;
+					goto err;
+				}
+				if (pfd[1].revents != 0)
+					break;	/* the program is gone */
+			}
+
+			if ((n = SSL_read(ssl, buf, sizeof buf)) <= 0) {
+				if (SSL_get_error(ssl, n) !=
+				    SSL_ERROR_ZERO_RETURN)
+					ERR_print_errors_fp(stderr);
+				break;
+			}
+			for (int off = 0, w; off < n; off += w)
+				if ((w = write(pr[1], buf + off, n - off))
+				    == -1)
+					goto eof;
+		}
+ eof:
+		close(pr[1]);
+
+		if (wait(&status) == -1) goto err;
+		return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+	}
+#endif
+	if (ktls)
+		fprintf(stderr, "sslc: kernel TLS not available, "
+		    "fallback to relay\n");
+
 	/* fork front end program */
 	char *prog = argv[0];
 #	define PIPE_READ 0
@@ -108,7 +255,8 @@ main(int argc, char *argv[], char *envp[])
 	int po[2];
 	if (pipe(pi) < 0) goto err;
 	if (pipe(po) < 0) goto err;
-	switch (fork()) {
+	pid_t pid;
+	switch ((pid = fork())) {
 	case 0: /* start client program */
 		if (close(pi[PIPE_READ]) < 0) goto err;
 		if (close(po[PIPE_WRITE]) < 0) goto err;
@@ -134,23 +282,6 @@ main(int argc, char *argv[], char *envp[])
 	in = pi[PIPE_READ];
 	out = po[PIPE_WRITE];
 
-	SSL_load_error_strings();
-	SSL_library_init();
-	if ((ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) goto err;
-
-	/* prepare certificate checking */
-	if (ca_file != NULL || ca_path != NULL)
-		SSL_CTX_load_verify_locations(ssl_ctx, ca_file, ca_path);
-	else
-		SSL_CTX_set_default_verify_paths(ssl_ctx);
-
-	SSL_CTX_set_verify(ssl_ctx, verify_mode, NULL);
-
-	if ((ssl = SSL_new(ssl_ctx)) == NULL) goto err;
-	if (SSL_set_rfd(ssl, sin) == 0) goto err;
-	if (SSL_set_wfd(ssl, sout) == 0) goto err;
-	if ((ret = SSL_connect(ssl)) < 1) goto err;
-
 	//check_hostname(ssl, "www.google.de");
 
 	for (;;) {
@@ -166,7 +297,11 @@ main(int argc, char *argv[], char *envp[])
 
 		if (FD_ISSET(sin, &readfds)) {
 			do {
-				if ((n = SSL_read(ssl, buf, BUFSIZ)) <= 0) goto err;
+				n = SSL_read(ssl, buf, BUFSIZ);
+				if (n == 0 && SSL_get_error(ssl, n) ==
+				    SSL_ERROR_ZERO_RETURN)
+					goto end;
+				if (n <= 0) goto err;
 				e = SSL_get_error(ssl, n);
 				write(out, buf, n);
 			} while (e == SSL_ERROR_WANT_READ || n == sizeof buf);
@@ -176,7 +311,12 @@ main(int argc, char *argv[], char *envp[])
 		}
 	}
 
-	return EXIT_SUCCESS;
+	/* the program gets the end of file and we wait for its result */
+ end:
+	close(out);
+	int status;
+	if (waitpid(pid, &status, 0) == -1) goto err;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
  err:
 /*
 	if (ret != 1) {
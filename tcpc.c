@@ -14,6 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -21,14 +25,63 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
+#define MAXBACKEND 64
+#define TABLE_MAGIC 0x74637063	/* "tcpc" */
+
+/* shared connect statistics of one backend */
+struct backend {
+	char name[NI_MAXHOST + NI_MAXSERV];	/* "host port" */
+	uint32_t ewma;		/* smoothed connect latency in usec */
+	uint32_t fails;		/* consecutive connect failures */
+	int64_t open_until;	/* circuit breaker is open until this time */
+};
+
+struct table {
+	uint32_t magic;
+	uint32_t n;
+	struct backend b[MAXBACKEND];
+};
+
+/* one target of the batch mode */
+struct job {
+	char *host;
+	char *port;
+	struct addrinfo *res0;	/* from the resolver, freed by free_addrs */
+	struct addrinfo *res;	/* address currently tried */
+	struct timespec start;
+	pid_t resolver;		/* -1 if the addresses are known */
+	int rfd;		/* answer of the resolver */
+	int s;
+	int error;		/* errno of the last connect */
+	int gai_error;
+	int64_t usec;		/* connect latency */
+	bool connected;
+};
+
+/* one entry of the host list given on the command line */
+struct target {
+	char *host;
+	char *port;
+	struct backend *stat;
+	bool untracked;		/* stat is allocated, not in the table */
+};
+
 /* Set enviroment variable if value is not empty. */
 #define set_env(name, value)			\
 	if (strcmp((value), "") != 0)		\
@@ -80,80 +133,199 @@ set_local_addr(int s, int family, char *local_addr_str, char *local_port_str)
 	return bind(s, (struct sockaddr *)&ia, slen);
 }
 
-void
-usage(void)
+static int table_fd = -1;
+static uint32_t maxfails = 3;
+static int64_t cooldown = 30;
+
+static void
+table_lock(int op)
 {
-	fprintf(stderr, "tcpclient [-4|6] [-Hh] host port program [args]\n");
-	exit(EXIT_FAILURE);
+	if (table_fd != -1 && flock(table_fd, op) == -1)
+		err(EXIT_FAILURE, "flock");
 }
 
-int
-main(int argc, char*argv[])
+/*
+ * Map the backend statistics shared by all tcpc processes using the same
+ * state file.  Without a state file, the statistics are process local.
+ */
+static struct table *
+table_open(const char *file)
 {
-	struct addrinfo hints, *res, *res0;
-	int error = 0;
-	int save_errno;
-	int s;
-	int ch;
-	char *argv0 = argv[0];
-	bool h_flag = true;
-	bool debug = false;
+	struct table *t;
+	struct stat sb;
 
-	/* set some default values */
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	if (file == NULL) {
+		if ((t = calloc(1, sizeof *t)) == NULL)
+			err(EXIT_FAILURE, "calloc");
+		t->magic = TABLE_MAGIC;
+		return t;
+	}
 
-	char *local_addr_str = NULL;
-	char *local_port_str = NULL;
+	if ((table_fd = open(file, O_RDWR|O_CREAT|O_CLOEXEC, 0644)) == -1)
+		err(EXIT_FAILURE, "open: %s", file);
 
-	/* parsing command line arguments */
-	while ((ch = getopt(argc, argv, "46dHhi:p:")) != -1) {
-		switch (ch) {
-		case '4':
-			if (hints.ai_family == AF_INET6)
-				usage();
-			hints.ai_family = AF_INET;
-			break;
-		case '6':
-			if (hints.ai_family == AF_INET)
-				usage();
-			hints.ai_family = AF_INET6;
-			break;
-		case 'd':
-			debug = true;
-			break;
-		case 'H':
-			h_flag = false;
-			break;
-		case 'h':
-			h_flag = true;
-			break;
-		case 'i':
-			if ((local_addr_str = strdup(optarg)) == NULL)
-				err(EXIT_FAILURE, "strdup");
-			break;
-		case 'p':
-			if ((local_port_str = strdup(optarg)) == NULL)
-				err(EXIT_FAILURE, "strdup");
-			break;
-		default:
-			usage();
-			/* NOTREACHED */
+	table_lock(LOCK_EX);
+	if (fstat(table_fd, &sb) == -1)
+		err(EXIT_FAILURE, "fstat");
+	if (sb.st_size < (off_t)sizeof *t &&
+	    ftruncate(table_fd, sizeof *t) == -1)
+		err(EXIT_FAILURE, "ftruncate");
+
+	t = mmap(NULL, sizeof *t, PROT_READ|PROT_WRITE, MAP_SHARED, table_fd, 0);
+	if (t == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap");
+
+	if (t->magic != TABLE_MAGIC || t->n > MAXBACKEND) {
+		memset(t, 0, sizeof *t);
+		t->magic = TABLE_MAGIC;
+	}
+	table_lock(LOCK_UN);
+
+	return t;
+}
+
+/*
+ * Find or create the statistics entry of a backend, NULL if the table is
+ * full.  Needs LOCK_EX.
+ */
+static struct backend *
+table_lookup(struct table *t, const char *host, const char *port)
+{
+	char name[sizeof t->b[0].name];
+	struct backend *b;
+
+	snprintf(name, sizeof name, "%s %s", host, port);
+
+	for (uint32_t i = 0; i < t->n; i++)
+		if (strcmp(t->b[i].name, name) == 0)
+			return &t->b[i];
+
+	if (t->n == MAXBACKEND)
+		return NULL;
+
+	b = &t->b[t->n++];
+	memset(b, 0, sizeof *b);
+	snprintf(b->name, sizeof b->name, "%s", name);
+
+	return b;
+}
+
+static void
+update_stat(struct backend *b, bool success, int64_t usec)
+{
+	table_lock(LOCK_EX);
+	if (success) {
+		/* ewma with a gain of 1/8 like the smoothed RTT of TCP */
+		if (b->ewma == 0)
+			b->ewma = usec;
+		else
+			b->ewma += (usec - (int64_t)b->ewma) / 8;
+		b->fails = 0;
+		b->open_until = 0;
+	} else if (++b->fails >= maxfails) {
+		b->open_until = time(NULL) + cooldown;
+	}
+	table_lock(LOCK_UN);
+}
+
+/*
+ * Split a comma separated list of hosts.  Every host could have its own
+ * port number as host:port or [host]:port.
+ */
+static size_t
+parse_targets(char *list, char *port, struct target *tg, size_t max)
+{
+	size_t n = 0;
+	char *str, *p;
+
+	while ((str = strsep(&list, ",")) != NULL) {
+		if (*str == '\0')
+			continue;
+		if (n == max)
+			errx(EXIT_FAILURE, "too many hosts");
+
+		tg[n].port = port;
+		if (*str == '[' && (p = strchr(str, ']')) != NULL) {
+			*p++ = '\0';
+			str++;
+			if (*p == ':')
+				tg[n].port = p + 1;
+		} else if ((p = strchr(str, ':')) != NULL &&
+		    strchr(p + 1, ':') == NULL) {
+			*p = '\0';
+			tg[n].port = p + 1;
 		}
+		tg[n].host = str;
+		n++;
 	}
-	argc -= optind;
-	argv += optind;
 
-	if (argc < 3) usage();
-	char *host = *argv; argv++; argc--;
-	char *port = *argv; argv++; argc--;
-	char *prog = *argv;
+	return n;
+}
+
+#define SWAP(a, b) do {			\
+		struct target tmp = (a);	\
+		(a) = (b);			\
+		(b) = tmp;			\
+	} while (0)
+
+/*
+ * Order the targets by trial sequence.  Backends with an open circuit breaker
+ * are moved to the end.  The first one is picked by the power of two choices
+ * out of the remaining ones.
+ */
+static void
+order_targets(struct target *tg, size_t n)
+{
+	time_t now = time(NULL);
+	size_t avail = 0;
+	size_t a, b;
+
+	table_lock(LOCK_SH);
+	for (size_t i = 0; i < n; i++) {
+		if (tg[i].stat->open_until <= now) {
+			SWAP(tg[avail], tg[i]);
+			avail++;
+		}
+	}
+
+	/* all breakers are open, so we choose between all of them */
+	if (avail == 0)
+		avail = n;
+
+	if (avail >= 2) {
+		a = arc4random_uniform(avail);
+		b = arc4random_uniform(avail - 1);
+		if (b >= a)
+			b++;
+		if (tg[b].stat->ewma < tg[a].stat->ewma)
+			SWAP(tg[a], tg[b]);
+		SWAP(tg[0], tg[a]);
+	}
+	table_lock(LOCK_UN);
+}
+
+#undef SWAP
+
+static int
+connect_target(struct target *tg, struct addrinfo *hints, int *gai_error,
+    char *local_addr_str, char *local_port_str, bool debug)
+{
+	struct addrinfo *res, *res0;
+	struct timespec start, end;
+	int save_errno;
+	int s = -1;
+
+	if (debug)
+		fprintf(stderr, "connect: %s %s\n", tg->host, tg->port);
+
+	if ((*gai_error = getaddrinfo(tg->host, tg->port, hints, &res0)) != 0) {
+		update_stat(tg->stat, false, 0);
+		return -1;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
 
-	error = getaddrinfo(host, port, &hints, &res0);
-	if (error)
-		errx(EXIT_FAILURE, "%s", gai_strerror(error));
-	s = -1;
 	for (res = res0; res; res = res->ai_next) {
 		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 		if (s == -1)
@@ -179,10 +351,25 @@ main(int argc, char*argv[])
 		}
 		break;  /* okay we got one */
 	}
-	if (s == -1) goto err;
+	save_errno = errno;
 	freeaddrinfo(res0);
 
-	/* prepare environment variables */
+	if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+
+	update_stat(tg->stat, s != -1, (end.tv_sec - start.tv_sec) * 1000000 +
+	    (end.tv_nsec - start.tv_nsec) / 1000);
+	errno = save_errno;
+
+	return s;
+}
+
+/* Set the ucspi environment of socket s and execute the program. */
+static void
+start_prog(int s, bool h_flag, bool debug, char *prog, char *argv[])
+{
+	int error;
+
 	char local_ip[NI_MAXHOST] = "";
 	char local_host[NI_MAXHOST] = "";
 	char local_port[NI_MAXSERV] = "";
@@ -236,10 +423,554 @@ main(int argc, char*argv[])
 	/* prepare file descriptors */
 	if (dup2(s, 6) == -1) err(EXIT_FAILURE, "dup2");
 	if (dup2(s, 7) == -1) err(EXIT_FAILURE, "dup2");
-	if (close(s) == -1) err(EXIT_FAILURE, "close");
+	if (s != 6 && s != 7 && close(s) == -1) err(EXIT_FAILURE, "close");
 
 	execvp(prog, argv);
 	err(EXIT_FAILURE, "execvp: %s", prog);
+}
+
+static int64_t
+usec_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Read "host port" lines of the batch file. */
+static struct job *
+read_jobs(const char *file, size_t *njobs)
+{
+	struct job *jobs = NULL;
+	size_t n = 0, size = 0;
+	char *line = NULL;
+	size_t linesize = 0;
+	FILE *fh = stdin;
+
+	if (strcmp(file, "-") != 0 && (fh = fopen(file, "r")) == NULL)
+		err(EXIT_FAILURE, "fopen: %s", file);
+
+	while (getline(&line, &linesize, fh) != -1) {
+		char *str = line, *host, *port;
+
+		do host = strsep(&str, " \t\n"); while (host && *host == '\0');
+		do port = strsep(&str, " \t\n"); while (port && *port == '\0');
+
+		if (host == NULL || *host == '#')
+			continue;
+		if (port == NULL)
+			errx(EXIT_FAILURE, "%s: missing port for %s", file, host);
+
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			if ((jobs = reallocarray(jobs, size, sizeof *jobs)) ==
+			    NULL)
+				err(EXIT_FAILURE, "reallocarray");
+		}
+		memset(&jobs[n], 0, sizeof jobs[n]);
+		jobs[n].s = -1;
+		jobs[n].rfd = -1;
+		jobs[n].resolver = -1;
+		if ((jobs[n].host = strdup(host)) == NULL ||
+		    (jobs[n].port = strdup(port)) == NULL)
+			err(EXIT_FAILURE, "strdup");
+		n++;
+	}
+	if (ferror(fh))
+		err(EXIT_FAILURE, "getline: %s", file);
+
+	free(line);
+	if (fh != stdin)
+		fclose(fh);
+
+	*njobs = n;
+	return jobs;
+}
+
+/* address of the resolver answer, behind the error code of getaddrinfo */
+struct addr {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+/*
+ * Resolve the name of the job in a child process, so slow lookups don't
+ * hold up the other jobs.  The answer is read from j->rfd.
+ */
+static void
+job_resolve(struct job *j, struct addrinfo *hints)
+{
+	struct addrinfo *res;
+	struct addr a;
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		err(EXIT_FAILURE, "pipe");
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1)
+		err(EXIT_FAILURE, "fcntl");
+
+	switch (j->resolver = fork()) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0:
+		close(fds[0]);
+		j->gai_error = getaddrinfo(j->host, j->port, hints, &j->res0);
+		if (write(fds[1], &j->gai_error, sizeof j->gai_error) == -1)
+			_exit(EXIT_FAILURE);
+		for (res = j->res0; j->gai_error == 0 && res != NULL;
+		    res = res->ai_next) {
+			memset(&a, 0, sizeof a);
+			a.family = res->ai_family;
+			a.socktype = res->ai_socktype;
+			a.protocol = res->ai_protocol;
+			a.addrlen = res->ai_addrlen;
+			memcpy(&a.addr, res->ai_addr, res->ai_addrlen);
+			if (write(fds[1], &a, sizeof a) == -1)
+				_exit(EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+	j->rfd = fds[0];
+}
+
+static void
+free_addrs(struct addrinfo *res)
+{
+	struct addrinfo *next;
+
+	for (; res != NULL; res = next) {
+		next = res->ai_next;
+		free(res);
+	}
+}
+
+/* read the answer of the resolver and build the address list of the job */
+static void
+job_resolved(struct job *j)
+{
+	struct addrinfo **tail = &j->res0;
+	struct addr a;
+	ssize_t n;
+
+	j->gai_error = EAI_FAIL;
+	while ((n = read(j->rfd, &j->gai_error, sizeof j->gai_error)) == -1 &&
+	    errno == EINTR)
+		;
+	if (n != sizeof j->gai_error)
+		j->gai_error = EAI_FAIL;
+
+	while (j->gai_error == 0 &&
+	    (n = read(j->rfd, &a, sizeof a)) == sizeof a) {
+		struct addrinfo *res;
+
+		if ((res = calloc(1, sizeof *res + sizeof a.addr)) == NULL)
+			err(EXIT_FAILURE, "calloc");
+		res->ai_family = a.family;
+		res->ai_socktype = a.socktype;
+		res->ai_protocol = a.protocol;
+		res->ai_addrlen = a.addrlen;
+		res->ai_addr = (struct sockaddr *)(res + 1);
+		memcpy(res->ai_addr, &a.addr, sizeof a.addr);
+		*tail = res;
+		tail = &res->ai_next;
+	}
+
+	close(j->rfd);
+	j->rfd = -1;
+	if (waitpid(j->resolver, NULL, 0) == -1)
+		err(EXIT_FAILURE, "waitpid");
+	j->resolver = -1;
+	j->res = j->res0;
+
+	/* the latency and the timeout of the connect start now */
+	if (clock_gettime(CLOCK_MONOTONIC, &j->start) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+}
+
+/* stop the resolver of a timed out job */
+static void
+job_abort(struct job *j)
+{
+	if (j->resolver != -1) {
+		kill(j->resolver, SIGKILL);
+		close(j->rfd);
+		j->rfd = -1;
+		if (waitpid(j->resolver, NULL, 0) == -1)
+			err(EXIT_FAILURE, "waitpid");
+		j->resolver = -1;
+	}
+	if (j->s != -1) {
+		close(j->s);
+		j->s = -1;
+	}
+}
+
+/*
+ * Start a non-blocking connect to the next address of the job.  Returns true,
+ * if the connection is in progress.
+ */
+static bool
+job_connect(struct job *j, char *local_addr_str, char *local_port_str)
+{
+	for (; j->res != NULL; j->res = j->res->ai_next) {
+		struct addrinfo *res = j->res;
+
+		j->s = socket(res->ai_family, res->ai_socktype,
+		    res->ai_protocol);
+		if (j->s == -1) {
+			j->error = errno;
+			continue;
+		}
+
+		/* don't leak sockets into the programs of other jobs */
+		if (fcntl(j->s, F_SETFD, FD_CLOEXEC) == -1 ||
+		    fcntl(j->s, F_SETFL, O_NONBLOCK) == -1)
+			err(EXIT_FAILURE, "fcntl");
+
+		if ((local_addr_str != NULL || local_port_str != NULL) &&
+		    set_local_addr(j->s, res->ai_family, local_addr_str,
+		    local_port_str) == -1) {
+			j->error = errno;
+			close(j->s);
+			j->s = -1;
+			continue;
+		}
+
+		if (connect(j->s, res->ai_addr, res->ai_addrlen) == 0 ||
+		    errno == EINPROGRESS)
+			return true;
+
+		j->error = errno;
+		close(j->s);
+		j->s = -1;
+	}
+
+	/* no address was tried at all */
+	if (j->error == 0)
+		j->error = EADDRNOTAVAIL;
+
+	return false;
+}
+
+static void
+job_spawn(struct job *j, bool h_flag, bool debug, char *prog, char *argv[])
+{
+	j->usec = usec_since(&j->start);
+	j->connected = true;
+
+	switch (fork()) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0:
+		if (fcntl(j->s, F_SETFD, 0) == -1 ||
+		    fcntl(j->s, F_SETFL, 0) == -1)
+			err(EXIT_FAILURE, "fcntl");
+		start_prog(j->s, h_flag, debug, prog, argv);
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	close(j->s);
+	j->s = -1;
+}
+
+/*
+ * Resolve and connect to all targets of the batch file concurrently, with at
+ * most window jobs in flight.  The program is spawned for every established
+ * connection.
+ */
+static int
+batch(const char *file, size_t window, int timeout, bool h_flag, bool debug,
+    struct addrinfo *hints, char *local_addr_str, char *local_port_str,
+    char *prog, char *argv[])
+{
+	struct job *jobs, **conn;
+	struct pollfd *pfd;
+	size_t njobs, next = 0, nconn = 0;
+	int ret = EXIT_SUCCESS;
+	int status;
+
+	jobs = read_jobs(file, &njobs);
+
+	if ((conn = calloc(window, sizeof *conn)) == NULL ||
+	    (pfd = calloc(window, sizeof *pfd)) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	while (next < njobs || nconn > 0) {
+		int64_t tmo = -1;
+
+		/* fill the window */
+		while (nconn < window && next < njobs) {
+			struct job *j = &jobs[next++];
+
+			if (clock_gettime(CLOCK_MONOTONIC, &j->start) == -1)
+				err(EXIT_FAILURE, "clock_gettime");
+			job_resolve(j, hints);
+			conn[nconn++] = j;
+		}
+
+		for (size_t i = 0; i < nconn; i++) {
+			int64_t left = timeout * 1000LL -
+			    usec_since(&conn[i]->start) / 1000;
+
+			if (conn[i]->resolver != -1) {
+				pfd[i].fd = conn[i]->rfd;
+				pfd[i].events = POLLIN;
+			} else {
+				pfd[i].fd = conn[i]->s;
+				pfd[i].events = POLLOUT;
+			}
+			if (tmo == -1 || left < tmo)
+				tmo = left < 0 ? 0 : left;
+		}
+
+		if (nconn == 0)
+			continue;
+
+		if (poll(pfd, nconn, tmo) == -1)
+			err(EXIT_FAILURE, "poll");
+
+		for (size_t i = 0; i < nconn; i++) {
+			struct job *j = conn[i];
+			socklen_t len = sizeof j->error;
+
+			if (pfd[i].revents == 0) {
+				if (usec_since(&j->start) < timeout * 1000000LL)
+					continue;
+				j->error = ETIMEDOUT;
+				job_abort(j);
+			} else if (j->resolver != -1) {
+				job_resolved(j);
+				if (j->gai_error == 0 && job_connect(j,
+				    local_addr_str, local_port_str))
+					continue;
+			} else if (getsockopt(j->s, SOL_SOCKET, SO_ERROR,
+			    &j->error, &len) == -1) {
+				j->error = errno;
+			}
+
+			if (j->s == -1) {
+				/* resolver failed, no address or timeout */
+			} else if (j->error == 0) {
+				job_spawn(j, h_flag, debug, prog, argv);
+			} else {
+				close(j->s);
+				j->s = -1;
+				j->res = j->res->ai_next;
+				if (job_connect(j, local_addr_str,
+				    local_port_str))
+					continue;
+			}
+
+			/* job is finished, remove it from the window */
+			free_addrs(j->res0);
+			j->res0 = NULL;
+			conn[i] = conn[--nconn];
+			pfd[i] = pfd[nconn];
+			i--;
+		}
+	}
+
+	/* wait for all programs */
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ret = EXIT_FAILURE;
+
+	/* summary */
+	for (size_t i = 0; i < njobs; i++) {
+		struct job *j = &jobs[i];
+
+		if (j->gai_error != 0) {
+			fprintf(stderr, "%s %s failed: %s\n", j->host, j->port,
+			    gai_strerror(j->gai_error));
+			ret = EXIT_FAILURE;
+		} else if (!j->connected) {
+			fprintf(stderr, "%s %s failed: %s\n", j->host, j->port,
+			    strerror(j->error));
+			ret = EXIT_FAILURE;
+		} else {
+			fprintf(stderr, "%s %s connected: %lld.%03lld ms\n",
+			    j->host, j->port, (long long)j->usec / 1000,
+			    (long long)j->usec % 1000);
+		}
+	}
+
+	return ret;
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "tcpclient [-4|6] [-Hh] [-s statefile] [-c cooldown] "
+	    "[-f maxfails] host[,host...] port program [args]\n"
+	    "tcpclient [-4|6] [-Hh] -B file [-n window] [-t timeout] "
+	    "program [args]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char*argv[])
+{
+	struct addrinfo hints;
+	struct target tg[MAXBACKEND];
+	struct table *table;
+	size_t ntg;
+	int error = 0;
+	int s;
+	int ch;
+	char *argv0 = argv[0];
+	char *state_file = NULL;
+	char *batch_file = NULL;
+	size_t window = 64;
+	int timeout = 10;
+	const char *errstr = NULL;
+	bool h_flag = true;
+	bool debug = false;
+
+	/* set some default values */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	char *local_addr_str = NULL;
+	char *local_port_str = NULL;
+
+	/* parsing command line arguments */
+	while ((ch = getopt(argc, argv, "46B:c:df:Hhi:n:p:s:t:")) != -1) {
+		switch (ch) {
+		case '4':
+			if (hints.ai_family == AF_INET6)
+				usage();
+			hints.ai_family = AF_INET;
+			break;
+		case '6':
+			if (hints.ai_family == AF_INET)
+				usage();
+			hints.ai_family = AF_INET6;
+			break;
+		case 'B':
+			if ((batch_file = strdup(optarg)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			break;
+		case 'c':
+			cooldown = strtonum(optarg, 0, INT32_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "cooldown is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'd':
+			debug = true;
+			break;
+		case 'f':
+			maxfails = strtonum(optarg, 1, UINT32_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "maxfails is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'H':
+			h_flag = false;
+			break;
+		case 'h':
+			h_flag = true;
+			break;
+		case 'i':
+			if ((local_addr_str = strdup(optarg)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			break;
+		case 'n':
+			window = strtonum(optarg, 1, 65536, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "window is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'p':
+			if ((local_port_str = strdup(optarg)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			break;
+		case 's':
+			if ((state_file = strdup(optarg)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			break;
+		case 't':
+			timeout = strtonum(optarg, 1, INT32_MAX / 1000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "timeout is %s: %s", errstr,
+				    optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (batch_file != NULL) {
+		if (argc < 1)
+			usage();
+		return batch(batch_file, window, timeout, h_flag, debug,
+		    &hints, local_addr_str, local_port_str, *argv, argv);
+	}
+
+	if (argc < 3) usage();
+	char *host = *argv; argv++; argc--;
+	char *port = *argv; argv++; argc--;
+	char *prog = *argv;
+
+	if ((ntg = parse_targets(host, port, tg, MAXBACKEND)) == 0)
+		usage();
+
+	table = table_open(state_file);
+	table_lock(LOCK_EX);
+	for (size_t i = 0; i < ntg; i++) {
+		tg[i].stat = table_lookup(table, tg[i].host, tg[i].port);
+		tg[i].untracked = tg[i].stat == NULL;
+		/* table full, don't track */
+		if (tg[i].untracked &&
+		    (tg[i].stat = calloc(1, sizeof *tg[i].stat)) == NULL)
+			err(EXIT_FAILURE, "calloc");
+	}
+	table_lock(LOCK_UN);
+
+	order_targets(tg, ntg);
+
+	if (debug) {
+		time_t now = time(NULL);
+
+		table_lock(LOCK_SH);
+		for (size_t i = 0; i < ntg; i++)
+			fprintf(stderr, "backend: %s %s ewma=%u fails=%u%s\n",
+			    tg[i].host, tg[i].port, tg[i].stat->ewma,
+			    tg[i].stat->fails,
+			    tg[i].stat->open_until > now ? " open" : "");
+		table_lock(LOCK_UN);
+	}
+
+	s = -1;
+	for (size_t i = 0; i < ntg && s == -1; i++)
+		s = connect_target(&tg[i], &hints, &error, local_addr_str,
+		    local_port_str, debug);
+	for (size_t i = 0; i < ntg; i++)
+		if (tg[i].untracked)
+			free(tg[i].stat);
+	if (s == -1) {
+		if (error != 0)
+			errx(EXIT_FAILURE, "%s", gai_strerror(error));
+		goto err;
+	}
+
+	start_prog(s, h_flag, debug, prog, argv);
+	/* NOTREACHED */
  err:
 	perror(argv0);
 	return EXIT_FAILURE;
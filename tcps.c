@@ -14,21 +14,37 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <netdb.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
+#include <tls.h>
+
+#include "tls_relay.h"
+
 #define MAXSOCK 10
-#define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MAXHANDSHAKE 128
+
+#ifndef INFTIM
+#define INFTIM (-1)
+#endif
 
 /* Set enviroment variable if value is not empty. */
 #define set_env(name, value)			\
@@ -42,35 +58,52 @@ struct sock {
 	char serv[NI_MAXSERV];
 };
 
-void
-start_prog(struct sock *sock, char *prog, char *argv[])
+/* TLS connection, which is still in its handshake */
+struct handshake {
+	int s;
+	struct tls *cctx;
+	struct sock *sock;
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int events;		/* poll events libtls waits for */
+	int64_t deadline;	/* msec */
+};
+
+static struct sock sock[MAXSOCK];
+static int nsock;
+
+static struct handshake hs[MAXHANDSHAKE];
+static int nhs;
+
+static bool debug = false;
+static struct tls_relay_conf relay = { RELAY_BUFSIZ, true, 0, 0 };
+
+static int64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void
+set_environment(struct sock *sock, struct sockaddr_storage *addr,
+    socklen_t len, const char *proto)
 {
 	int ecode = 0;
-	int s = -1;
-	struct sockaddr_storage addr;
-	socklen_t len = sizeof addr;
 	char ip[NI_MAXHOST] = "";
 	char host[NI_MAXHOST] = "";
 	char serv[NI_MAXSERV] = "";
 
-	if ((s = accept(sock->s, (struct sockaddr *)&addr, &len)) == -1)
-		err(EXIT_FAILURE, "accept");
-
-	switch (fork()) {
-	case -1: err(EXIT_FAILURE, "fork()");	/* error */
-	case  0: break;				/* child */
-	default:				/* parent */
-		if (close(s) == -1)
-			err(EXIT_FAILURE, "close");
-		return;
-	}
-
 	/* get remote address information */
-	if ((ecode = getnameinfo((struct sockaddr *)&addr, len, ip, sizeof ip,
+	if ((ecode = getnameinfo((struct sockaddr *)addr, len, ip, sizeof ip,
 	    serv, sizeof serv, NI_NUMERICHOST|NI_NUMERICSERV)) != 0)
 		errx(EXIT_FAILURE, "getnameinfo: %s", gai_strerror(ecode));
 
-	if ((ecode = getnameinfo((struct sockaddr *)&addr, len, host,
+	if ((ecode = getnameinfo((struct sockaddr *)addr, len, host,
 	    sizeof host, NULL, 0, 0)) != 0)
 		errx(EXIT_FAILURE, "getnameinfo: %s", gai_strerror(ecode));
 
@@ -82,7 +115,29 @@ start_prog(struct sock *sock, char *prog, char *argv[])
 	set_env("TCPLOCALIP"  , sock->ip);
 	set_env("TCPLOCALHOST", sock->host);
 	set_env("TCPLOCALPORT", sock->serv);
-	set_env("PROTO", "TCP");
+	set_env("PROTO", proto);
+}
+
+void
+start_prog(struct sock *sock, char *prog, char *argv[])
+{
+	int s = -1;
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
+
+	if ((s = accept(sock->s, (struct sockaddr *)&addr, &len)) == -1)
+		err(EXIT_FAILURE, "accept");
+
+	switch (fork()) {
+	case -1: err(EXIT_FAILURE, "fork()");	/* error */
+	case  0: break;				/* child */
+	default:				/* parent */
+		if (close(s) == -1)
+			err(EXIT_FAILURE, "close");
+		return;
+	}
+
+	set_environment(sock, &addr, len, "TCP");
 
 	/* prepare file descriptors */
 	if (dup2(s, STDIN_FILENO) == -1) err(EXIT_FAILURE, "dup2");
@@ -94,10 +149,131 @@ start_prog(struct sock *sock, char *prog, char *argv[])
 	err(EXIT_FAILURE, "execvp: %s", prog);
 }
 
+/*
+ * Start the program behind a finished TLS handshake.  The child process
+ * relays between the TLS connection and the program like tlss does.  Thus,
+ * just successful handshakes cost a fork.
+ */
+static void
+tls_start_prog(struct handshake *h, char *prog, char *argv[])
+{
+	int pi[2];	/* input pipe */
+	int po[2];	/* output pipe */
+
+	switch (fork()) {
+	case -1: err(EXIT_FAILURE, "fork()");	/* error */
+	case  0: break;				/* child */
+	default:				/* parent */
+		/* the child owns the connection now, don't shut it down */
+		tls_free(h->cctx);
+		if (close(h->s) == -1)
+			err(EXIT_FAILURE, "close");
+		return;
+	}
+
+	/* other connections and the listeners belong to the parent */
+	for (int i = 0; i < nsock; i++)
+		close(sock[i].s);
+	for (int i = 0; i < nhs; i++)
+		if (&hs[i] != h)
+			close(hs[i].s);
+
+	set_environment(h->sock, &h->addr, h->len, "SSL");
+
+	if (pipe(pi) == -1) err(EXIT_FAILURE, "pipe");
+	if (pipe(po) == -1) err(EXIT_FAILURE, "pipe");
+
+	switch (fork()) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0: /* client program */
+		if (close(h->s) == -1) err(EXIT_FAILURE, "close");
+		if (close(pi[0]) == -1) err(EXIT_FAILURE, "close");
+		if (close(po[1]) == -1) err(EXIT_FAILURE, "close");
+
+		/* move pipe end to ucspi defined fd numbers */
+		if (dup2(po[0], STDIN_FILENO) == -1) err(EXIT_FAILURE, "dup2");
+		if (dup2(pi[1], STDOUT_FILENO) == -1) err(EXIT_FAILURE, "dup2");
+
+		if (close(po[0]) == -1) err(EXIT_FAILURE, "close");
+		if (close(pi[1]) == -1) err(EXIT_FAILURE, "close");
+
+		execvp(prog, argv);
+		err(EXIT_FAILURE, "execvp: %s", prog);
+	default: break;	/* relay */
+	}
+
+	if (close(pi[1]) == -1) err(EXIT_FAILURE, "close");
+	if (close(po[0]) == -1) err(EXIT_FAILURE, "close");
+
+	exit(tls_relay(h->cctx, h->s, h->s, pi[0], po[1], &relay));
+}
+
+/* Returns true if a new handshake was added. */
+static bool
+tls_accept_conn(struct tls *tls, struct sock *sock, int timeout)
+{
+	struct handshake *h = &hs[nhs];
+	int flags;
+
+	h->len = sizeof h->addr;
+	if ((h->s = accept(sock->s, (struct sockaddr *)&h->addr, &h->len))
+	    == -1) {
+		if (errno == EINTR || errno == ECONNABORTED)
+			return false;
+		err(EXIT_FAILURE, "accept");
+	}
+
+	if ((flags = fcntl(h->s, F_GETFL)) == -1 ||
+	    fcntl(h->s, F_SETFL, flags | O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "fcntl");
+
+	if (tls_accept_socket(tls, &h->cctx, h->s) == -1) {
+		if (debug)
+			fprintf(stderr, "tls_accept_socket: %s\n",
+			    tls_error(tls));
+		close(h->s);
+		return false;
+	}
+
+	h->sock = sock;
+	h->events = POLLIN;
+	h->deadline = now_ms() + timeout * 1000LL;
+	nhs++;
+
+	return true;
+}
+
+/* Returns true if the handshake is finished or failed. */
+static bool
+tls_progress(struct handshake *h, char *prog, char *argv[])
+{
+	switch (tls_handshake(h->cctx)) {
+	case TLS_WANT_POLLIN:
+		h->events = POLLIN;
+		return false;
+	case TLS_WANT_POLLOUT:
+		h->events = POLLOUT;
+		return false;
+	case -1:
+		if (debug)
+			fprintf(stderr, "tls_handshake: %s\n",
+			    tls_error(h->cctx));
+		tls_free(h->cctx);
+		close(h->s);
+		return true;
+	}
+
+	tls_start_prog(h, prog, argv);
+	return true;
+}
+
 static void
 usage(void)
 {
-	fprintf(stderr, "tcps [-46h] address port program [args]\n");
+	fprintf(stderr, "tcps [-46CdhR] [-b bufsize] [-c cert_file] "
+	    "[-k key_file] [-f ca_file] [-p ca_path] [-t timeout] "
+	    "[-i idle] [-w stall] address port program [args]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -105,21 +281,29 @@ int
 main(int argc, char *argv[])
 {
 	int ch;
-	bool debug = false;
 
 	struct addrinfo hints, *res, *res0;
 	int error;
 	int save_errno;
-	struct sock sock[MAXSOCK];
-	int nsock;
 	const char *cause = NULL;
+	const char *errstr = NULL;
+
+	/* TLS mode */
+	struct tls_config *tls_config = NULL;
+	struct tls *tls = NULL;
+	bool verify_client = false;
+	char *cert_file = NULL;
+	char *key_file = NULL;
+	char *ca_file = NULL;
+	char *ca_path = NULL;
+	int timeout = 10;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
 
-	while ((ch = getopt(argc, argv, "46dh")) != -1) {
+	while ((ch = getopt(argc, argv, "46b:Cc:df:hi:k:p:Rt:w:")) != -1) {
 		switch (ch) {
 		case '4':
 			hints.ai_family = PF_INET;
@@ -127,9 +311,52 @@ main(int argc, char *argv[])
 		case '6':
 			hints.ai_family = PF_INET6;
 			break;
+		case 'b':
+			relay.bufsize = strtonum(optarg, 512, 1024 * 1024,
+			    &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "buffer size is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'C':
+			verify_client = true;
+			break;
+		case 'c':
+			cert_file = optarg;
+			break;
 		case 'd':
 			debug = true;
 			break;
+		case 'f':
+			ca_file = optarg;
+			break;
+		case 'i':
+			relay.idle = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "idle timeout is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'k':
+			key_file = optarg;
+			break;
+		case 'p':
+			ca_path = optarg;
+			break;
+		case 'R':
+			relay.dynamic = false;
+			break;
+		case 't':
+			timeout = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "timeout is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'w':
+			relay.stall = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "stall timeout is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'h':
 		default:
 			usage();
@@ -146,6 +373,47 @@ main(int argc, char *argv[])
 	char *port = *argv; argv++; argc--;
 	char *prog = *argv;
 
+	/*
+	 * Load certificates and keys just once for all connections.  As all
+	 * handshakes share this context, session tickets of one connection
+	 * are resumable on the others.
+	 */
+	if (cert_file != NULL) {
+		if (tls_init() == -1)
+			err(EXIT_FAILURE, "tls_init");
+		if ((tls_config = tls_config_new()) == NULL)
+			err(EXIT_FAILURE, "tls_config_new");
+		if (tls_config_set_cert_file(tls_config, cert_file) == -1)
+			errx(EXIT_FAILURE, "tls_config_set_cert_file: %s",
+			    tls_config_error(tls_config));
+		if (tls_config_set_key_file(tls_config,
+		    key_file ? key_file : cert_file) == -1)
+			errx(EXIT_FAILURE, "tls_config_set_key_file: %s",
+			    tls_config_error(tls_config));
+		if (ca_file != NULL &&
+		    tls_config_set_ca_file(tls_config, ca_file) == -1)
+			errx(EXIT_FAILURE, "tls_config_set_ca_file: %s",
+			    tls_config_error(tls_config));
+		if (ca_path != NULL &&
+		    tls_config_set_ca_path(tls_config, ca_path) == -1)
+			errx(EXIT_FAILURE, "tls_config_set_ca_path: %s",
+			    tls_config_error(tls_config));
+		if (verify_client)
+			tls_config_verify_client(tls_config);
+		if (tls_config_set_session_lifetime(tls_config, 2 * 60 * 60)
+		    == -1)
+			errx(EXIT_FAILURE, "tls_config_set_session_lifetime: "
+			    "%s", tls_config_error(tls_config));
+
+		if ((tls = tls_server()) == NULL)
+			err(EXIT_FAILURE, "tls_server");
+		if (tls_configure(tls, tls_config) == -1)
+			errx(EXIT_FAILURE, "tls_configure: %s", tls_error(tls));
+	} else if (key_file != NULL || ca_file != NULL || ca_path != NULL ||
+	    verify_client) {
+		errx(EXIT_FAILURE, "TLS mode needs a certificate (-c)");
+	}
+
 	if ((error = getaddrinfo(host, port, &hints, &res0)) != 0)
 		errx(EXIT_FAILURE, "getaddrinfo: %s", gai_strerror(error));
 
@@ -197,24 +465,71 @@ main(int argc, char *argv[])
 		err(EXIT_FAILURE, "%s", cause);
 	freeaddrinfo(res0);
 
-	/* select loop */
+	/* poll loop */
 	for (;;) {
-		int max = 0;
-		fd_set fdset;
+		struct pollfd pfd[MAXSOCK + MAXHANDSHAKE];
+		int64_t now = now_ms();
+		int wait = INFTIM;
+		int n = 0;
 
-		FD_ZERO(&fdset);
+		/* reap terminated children */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
 
+		/* stop accepting, while too many handshakes are running */
 		for (int i = 0; i < nsock; i++) {
-			FD_SET(sock[i].s, &fdset);
-			max = MAX(max, sock[i].s);
+			pfd[n].fd = nhs < MAXHANDSHAKE ? sock[i].s : -1;
+			pfd[n++].events = POLLIN;
 		}
 
-		if (select(max+1, &fdset, NULL, NULL, 0) == -1)
-			err(EXIT_FAILURE, "select");
+		for (int i = 0; i < nhs; i++) {
+			pfd[n].fd = hs[i].s;
+			pfd[n++].events = hs[i].events;
+			if (wait == INFTIM || hs[i].deadline - now < wait)
+				wait = hs[i].deadline > now ?
+				    hs[i].deadline - now : 0;
+		}
+
+		if (poll(pfd, n, wait) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
 
-		for (int i = 0; i < nsock; i++)
-			if (FD_ISSET(sock[i].s, &fdset))
+		/* go on with handshakes and drop expired ones */
+		now = now_ms();
+		for (int i = nhs - 1; i >= 0; i--) {
+			bool done;
+
+			if (pfd[nsock + i].revents != 0)
+				done = tls_progress(&hs[i], prog, argv);
+			else if (hs[i].deadline <= now) {
+				if (debug)
+					fprintf(stderr, "tls handshake "
+					    "timeout\n");
+				tls_free(hs[i].cctx);
+				close(hs[i].s);
+				done = true;
+			} else
+				done = false;
+
+			if (done)
+				hs[i] = hs[--nhs];
+		}
+
+		for (int i = 0; i < nsock; i++) {
+			if ((pfd[i].revents & POLLIN) == 0)
+				continue;
+			if (tls == NULL) {
 				start_prog(&sock[i], prog, argv);
+				continue;
+			}
+			if (nhs == MAXHANDSHAKE)
+				break;
+			if (tls_accept_conn(tls, &sock[i], timeout) &&
+			    tls_progress(&hs[nhs - 1], prog, argv))
+				nhs--;
+		}
 	}
 
 	return EXIT_SUCCESS;
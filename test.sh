@@ -2,7 +2,7 @@
 
 . ./tap-functions -u
 
-plan_tests 33
+plan_tests 83
 
 # prepare
 expect_env() {
@@ -69,6 +69,49 @@ expect_env $tmpdir/env.txt "TCPLOCALHOST" "localhost"
 expect_env $tmpdir/env.txt "TCPLOCALPORT" "$CLIENT_PORT"
 expect_env $tmpdir/env.txt "PROTO" "TCP"
 
+#########################################################################
+# multiple backends with a dead one					#
+#########################################################################
+./tcps -d 127.0.0.1 0 ./read0.sh "$tmpdir/env.txt" 2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+# the first failure opens the circuit breaker of the dead backend
+./tcpc -s $tmpdir/tcpc.state -f 1 -c 60 127.0.0.1:1 $SERVER_PORT \
+    ./write.sh 2>/dev/null
+
+fails=0
+: >$tmpdir/tcpc.log
+for i in 1 2 3; do
+	./tcpc -d -s $tmpdir/tcpc.state -f 1 -c 60			\
+	    127.0.0.1:1,127.0.0.1 $SERVER_PORT ./write.sh		\
+	    2>>$tmpdir/tcpc.log || fails=$((fails + 1))
+done
+test $fails -eq 0
+
+ok $? "connection with a dead backend in the host list ($fails failed)"
+
+grep -q '^backend: 127.0.0.1 1 ewma=0 fails=1 open$' $tmpdir/tcpc.log &&
+    ! grep -q '^connect: 127.0.0.1 1$' $tmpdir/tcpc.log &&
+    grep -q "^backend: 127.0.0.1 $SERVER_PORT ewma=[1-9]" $tmpdir/tcpc.log
+
+ok $? "dead backend skipped within the cool-down, latency kept in state"
+
+printf '127.0.0.1 %s\nlocalhost %s\n' $SERVER_PORT $SERVER_PORT |
+    ./tcpc -B - -n 1 ./write.sh 2>$tmpdir/tcpc.log
+ok $? "batch connection to multiple targets"
+
+printf '127.0.0.1 1\n127.0.0.1 %s\n' $SERVER_PORT |
+    ./tcpc -B - -i 127.0.0.1 ./write.sh 2>$tmpdir/tcpc.log
+test $? -ne 0 && grep -q '^127.0.0.1 1 failed: ' $tmpdir/tcpc.log &&
+    grep -q "^127.0.0.1 $SERVER_PORT connected: " $tmpdir/tcpc.log
+ok $? "batch connection with a dead target and a local address"
+
+kill -9 %1
+rm "$tmpdir/env.txt"
+
 #########################################################################
 # cert checks								#
 #########################################################################
@@ -80,6 +123,624 @@ ok $? "Certificates and keys for running tests exist."
 #h=$(openssl x509 -outform der -in server.crt | sha256)
 #printf "SHA256:${h}\n"
 
+#########################################################################
+# SOCKS 5 client							#
+#########################################################################
+# fake proxy: takes greeting and request (21 bytes), answers and sends data
+: >$tmpdir/tcps.log
+reply='\005\000\005\000\000\001\177\000\000\002\020\222'
+./tcps -d 127.0.0.1 0 sh -c "head -c 21 >/dev/null; printf '${reply}hello\n'" \
+    2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./sockc example.com 80	\
+    sh -c 'echo $TCPLOCALIP:$TCPLOCALPORT; cat <&6' | tr '\n' ' ')
+test "$output" = "127.0.0.2:4242 hello "
+
+ok $? "socks connection reply parsed (found $output)"
+
+kill -9 $!
+
+#########################################################################
+# SOCKS 5 server							#
+#########################################################################
+: >$tmpdir/tcps.log
+: >$tmpdir/socks.log
+mkdir $tmpdir/cache
+./tcps -d 127.0.0.1 0 /usr/bin/env 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+./tcps -d 127.0.0.1 0 ./socks -c $tmpdir/cache 2>$tmpdir/socks.log &
+SOCKS_PID=$!
+
+# wait running servers
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+until grep -q '^listen: 127.0.0.1:' $tmpdir/socks.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+SOCKS_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/socks.log | head -n 1)
+
+./tcpc 127.0.0.1 $SOCKS_PORT ./sockc 127.0.0.1 $SERVER_PORT	\
+    ./read6.sh /dev/stdout | grep -q '^PROTO=TCP$'
+
+ok $? "socks connection to an address"
+
+./tcpc 127.0.0.1 $SOCKS_PORT ./sockc localhost $SERVER_PORT	\
+    ./read6.sh /dev/stdout | grep -q '^PROTO=TCP$' &&
+    test -s "$tmpdir/cache/localhost:$SERVER_PORT"
+
+ok $? "socks connection to a cached hostname"
+
+./tcpc 127.0.0.1 $SOCKS_PORT ./sockc -x 127.0.0.1:$SOCKS_PORT	\
+    -x localhost:$SOCKS_PORT 127.0.0.1 $SERVER_PORT	\
+    ./read6.sh /dev/stdout | grep -q '^PROTO=TCP$'
+
+ok $? "socks connection through a chain of three proxies"
+
+# UDP echo server
+: >$tmpdir/udp.log
+perl -MIO::Socket::INET -e '
+	$s = IO::Socket::INET->new(LocalAddr => "127.0.0.1", Proto => "udp")
+	    or die;
+	printf STDERR "listen: 127.0.0.1:%d\n", $s->sockport;
+	$s->send($b) while $s->recv($b, 65536);' 2>$tmpdir/udp.log &
+UDP_PID=$!
+
+until grep -q '^listen: 127.0.0.1:' $tmpdir/udp.log; do :; done
+UDP_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/udp.log)
+
+output=$(./tcpc 127.0.0.1 $SOCKS_PORT ./sockc -u 127.0.0.1 $UDP_PORT	\
+    sh -c 'printf ping >&7; dd bs=64k count=1 <&6 2>/dev/null')
+test "$output" = "ping"
+
+ok $? "socks udp association (found $output)"
+
+# an empty packet goes through like any other, it is not the end
+output=$(./tcpc 127.0.0.1 $SOCKS_PORT ./sockc -u localhost $UDP_PORT	\
+    perl -e 'open(R, "<&=6") or die; open(W, ">&=7") or die;
+	syswrite(W, "", 0); syswrite(W, "ping");
+	sysread(R, $b, 65536); print length($b), " ";
+	sysread(R, $b, 65536); print $b')
+test "$output" = "0 ping"
+
+ok $? "socks udp association with an empty packet to a name (found $output)"
+
+./tcpc 127.0.0.1 $SOCKS_PORT ./sockc -u -x 127.0.0.1:$SOCKS_PORT	\
+    127.0.0.1 $UDP_PORT true 2>&1 | grep -q 'not supported$'
+
+ok $? "socks udp association through a chain is refused"
+
+kill -9 $SERVER_PID $SOCKS_PID $UDP_PID
+
+#########################################################################
+# HTTP client								#
+#########################################################################
+# the parsers agree with themselves on the corpus and mutations of it
+./httpbench -t | grep -q ' ok$'
+
+ok $? "http parsers on the corpus in pieces"
+
+# fake server: answers with a chunked body behind the header
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+	printf "4;ext=1\r\nwiki\r\n5\r\npedia\r\n0\r\nX-Trailer: 1\r\n\r\n"' \
+	2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httpc /index.html)
+test "$output" = "wikipedia"
+
+ok $? "http client reads a chunked body (found $output)"
+
+kill -9 $!
+
+# fake server: answers every request of the pipeline
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c 'n=0; while read -r line; do
+	[ "$line" = "$(printf "\r")" ] || continue
+	n=$((n + 1))
+	printf "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\nbody$n\n"
+done' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+(cd $tmpdir && ../tcpc 127.0.0.1 $SERVER_PORT ../httpc -n 2 /a /b /c) &&
+    test "$(cat $tmpdir/a $tmpdir/b $tmpdir/c)" = "$(printf 'body1\nbody2\nbody3')"
+
+ok $? "http client pipelines a queue of paths on one connection"
+
+kill -9 $SERVER_PID
+
+# fake server: closes in the middle of the body, but serves ranges of the
+# same ETag, the content changed for other requests
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c 'range= cond=
+while read -r line && [ "$line" != "$(printf "\r")" ]; do
+	case "$line" in
+	Range:*) range=1;;
+	If-Range:*) cond=${line#*: }; cond=${cond%?};;
+	esac
+done
+if [ -z "$range" ]; then
+	printf "HTTP/1.1 200 OK\r\nETag: \"r1\"\r\nContent-Length: 10\r\n\r\n"
+	printf hello
+elif [ "$cond" = "\"r1\"" ]; then
+	printf "HTTP/1.1 206 Partial Content\r\nContent-Length: 5\r\n"
+	printf "Content-Range: bytes 5-9/10\r\n\r\nworld"
+else
+	printf "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nHELLOWORLD"
+fi' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT				\
+    ./httpc -c "./tcpc 127.0.0.1 $SERVER_PORT" /file)
+test "$output" = "helloworld"
+
+ok $? "http client resumes on a new connection (found $output)"
+
+kill -9 $SERVER_PID
+
+# fake server: answers every range with the whole content
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 206 Partial Content\r\nContent-Length: 10\r\n"
+	printf "Content-Range: bytes 0-9/10\r\n\r\nhelloworld"' \
+	2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+printf hello >$tmpdir/resume
+./tcpc 127.0.0.1 $SERVER_PORT						\
+    ./httpc -c "./tcpc 127.0.0.1 $SERVER_PORT" -R 5 -o $tmpdir/resume	\
+    /file 2>/dev/null &&
+    test "$(cat $tmpdir/resume)" = "helloworld"
+
+ok $? "http client starts over on a range it did not ask for"
+
+kill -9 $SERVER_PID
+
+# fake server: answers with gzip encoded content
+printf 'hello gzip' | gzip >$tmpdir/body.gz
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+	printf "Content-Length: %d\r\n\r\n" $(wc -c <$0)
+	cat $0' $tmpdir/body.gz 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httpc /file.txt)
+test "$output" = "hello gzip"
+
+ok $? "http client inflates gzip content (found $output)"
+
+kill -9 $SERVER_PID
+
+# fake server: cuts the first gzip encoded answer in the middle
+seq 1 20000 >$tmpdir/long.txt
+gzip <$tmpdir/long.txt >$tmpdir/long.gz
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	size=$(wc -c <$0)
+	printf "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+	printf "Content-Length: %d\r\n\r\n" $size
+	if [ -e $0.cut ]; then
+		cat $0
+	else
+		: >$0.cut
+		head -c $((size / 2)) $0
+	fi' $tmpdir/long.gz 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+./tcpc 127.0.0.1 $SERVER_PORT						\
+    ./httpc -c "./tcpc 127.0.0.1 $SERVER_PORT" /long.txt		\
+    >$tmpdir/long.out && cmp -s $tmpdir/long.txt $tmpdir/long.out
+
+ok $? "http client restarts encoded content without repeating it"
+
+kill -9 $SERVER_PID
+
+# fake server: refuses the first path and closes the connection behind it
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do
+		case "$line" in GET*) path=${line#GET }; path=${path%% *};;
+		esac
+	done
+	if [ "$path" = /missing ]; then
+		printf "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+		printf "Connection: close\r\n\r\n"
+	else
+		printf "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nfound"
+	fi' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+! (cd $tmpdir && ../tcpc 127.0.0.1 $SERVER_PORT				\
+    ../httpc -c "../tcpc 127.0.0.1 $SERVER_PORT" /missing /found	\
+    2>/dev/null) && test "$(cat $tmpdir/found)" = "found"
+
+ok $? "http client fails behind a reconnect on an earlier error"
+
+kill -9 $SERVER_PID
+
+# fake server: serves ranges, but cuts the first one of each segment
+dd if=/dev/urandom of=$tmpdir/seg.src bs=1000 count=100 2>/dev/null
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c 'range= head=
+while read -r line && [ "$line" != "$(printf "\r")" ]; do
+	case "$line" in
+	HEAD*) head=1;;
+	Range:*) range=${line#*=}; range=${range%?};;
+	esac
+done
+size=$(wc -c <$0)
+if [ -n "$head" ]; then
+	printf "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n"
+	printf "Content-Length: %d\r\n\r\n" $size
+	exit
+fi
+first=${range%-*} last=${range#*-}
+len=$((last - first + 1))
+if [ -e $0.cut.$last ] && [ -e $0.fail ]; then
+	printf "HTTP/1.1 503 Service Unavailable\r\n\r\n"
+	exit
+fi
+printf "HTTP/1.1 206 Partial Content\r\nContent-Length: %d\r\n" $len
+printf "Content-Range: bytes %d-%d/%d\r\n\r\n" $first $last $size
+if [ ! -e $0.cut.$last ]; then
+	: >$0.cut.$last
+	len=$((len / 2))
+fi
+tail -c +$((first + 1)) $0 | head -c $len' $tmpdir/seg.src 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+./tcpc 127.0.0.1 $SERVER_PORT ./httpc -s 4				\
+    -c "./tcpc 127.0.0.1 $SERVER_PORT" -o $tmpdir/seg /seg &&
+    cmp -s $tmpdir/seg.src $tmpdir/seg && test ! -e $tmpdir/seg.seg
+
+ok $? "http client downloads in segments and retries cut ones"
+
+# the retries of cut segments fail, the rest is fetched on the next run
+rm -f $tmpdir/seg $tmpdir/seg.src.cut.*
+: >$tmpdir/seg.src.fail
+! ./tcpc 127.0.0.1 $SERVER_PORT ./httpc -s 4 -r 0			\
+    -c "./tcpc 127.0.0.1 $SERVER_PORT" -o $tmpdir/seg /seg 2>/dev/null &&
+    test -e $tmpdir/seg.seg && rm $tmpdir/seg.src.fail &&
+    ./tcpc 127.0.0.1 $SERVER_PORT ./httpc -s 4 -r 0			\
+    -c "./tcpc 127.0.0.1 $SERVER_PORT" -o $tmpdir/seg /seg &&
+    cmp -s $tmpdir/seg.src $tmpdir/seg && test ! -e $tmpdir/seg.seg
+
+ok $? "http client resumes a segmented download"
+
+kill -9 $SERVER_PID
+
+# fake server: serves ranges only for the current ETag in If-Range
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c 'range= head= cond=
+while read -r line && [ "$line" != "$(printf "\r")" ]; do
+	case "$line" in
+	HEAD*) head=1;;
+	Range:*) range=${line#*=}; range=${range%?};;
+	If-Range:*) cond=${line#*: }; cond=${cond%?};;
+	esac
+done
+size=$(wc -c <$0)
+if [ -n "$head" ]; then
+	printf "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\nETag: \"v1\"\r\n"
+	printf "Content-Length: %d\r\n\r\n" $size
+	exit
+fi
+if [ "$cond" != "\"v1\"" ]; then
+	printf "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n" $size
+	cat $0
+	exit
+fi
+first=${range%-*} last=${range#*-}
+len=$((last - first + 1))
+printf "HTTP/1.1 206 Partial Content\r\nContent-Length: %d\r\n" $len
+printf "Content-Range: bytes %d-%d/%d\r\n\r\n" $first $last $size
+tail -c +$((first + 1)) $0 | head -c $len' $tmpdir/seg.src 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+rm -f $tmpdir/val
+./tcpc 127.0.0.1 $SERVER_PORT ./httpc -s 4 -r 0				\
+    -c "./tcpc 127.0.0.1 $SERVER_PORT" -o $tmpdir/val /seg &&
+    cmp -s $tmpdir/seg.src $tmpdir/val
+
+ok $? "http client sends the ETag in If-Range with segments"
+
+# the state of another ETag claims a complete download of zeros
+dd if=/dev/zero of=$tmpdir/val bs=1000 count=100 2>/dev/null
+printf '%20d %20d\n%20d %20d\n"v0"\n' 100000 1 100000 99999 >$tmpdir/val.seg
+./tcpc 127.0.0.1 $SERVER_PORT ./httpc -s 4 -r 0				\
+    -c "./tcpc 127.0.0.1 $SERVER_PORT" -o $tmpdir/val /seg &&
+    cmp -s $tmpdir/seg.src $tmpdir/val && test ! -e $tmpdir/val.seg
+
+ok $? "http client starts over if the ETag changed"
+
+kill -9 $SERVER_PID
+
+# fake server: answers a range with a missing or wrong Content-Range
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+while read -r line && [ "$line" != "$(printf "\r")" ]; do
+	case "$line" in GET*) path=${line#GET }; path=${path%% *};; esac
+done
+case "$path" in
+/norange)
+	printf "HTTP/1.1 206 Partial Content\r\nContent-Length: 10\r\n\r\n"
+	printf 0123456789;;
+/long)
+	printf "HTTP/1.1 206 Partial Content\r\nContent-Length: 20\r\n"
+	printf "Content-Range: bytes 0-9/20\r\n\r\n"
+	printf 0123456789abcdefghij;;
+/chunked)
+	printf "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-9/20"
+	printf "\r\nTransfer-Encoding: chunked\r\n\r\n"
+	printf "14\r\n0123456789abcdefghij\r\n0\r\n\r\n";;
+esac' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+printf '%020d' 0 >$tmpdir/range
+refused=0
+for path in /norange /long /chunked; do
+	./tcpc 127.0.0.1 $SERVER_PORT ./httpc -o $tmpdir/range -S 0-9	\
+	    $path >/dev/null 2>&1 || refused=$((refused + 1))
+done
+test $refused -eq 3 -a "$(cat $tmpdir/range)" = "$(printf '%020d' 0)"
+
+ok $? "http client refuses a segment beyond its range"
+
+kill -9 $SERVER_PID
+
+#########################################################################
+# HTTP server								#
+#########################################################################
+mkdir -p $tmpdir/htdocs/localhost
+echo index >$tmpdir/htdocs/localhost/index.html
+echo second >$tmpdir/htdocs/localhost/second.txt
+
+# both requests arrive at once and are answered on one connection
+output=$(printf 'GET / HTTP/1.1\r\nHost: localhost\r\n\r\n%b%b'	\
+    'GET /second.txt HTTP/1.1\r\nHost: localhost\r\n'		\
+    'Connection: close\r\n\r\n' | ./https -d $tmpdir/htdocs | tr -d '\r')
+test "$output" = "$(printf 'HTTP/1.1 200 OK\nContent-Length: %d\n\n%s\n' \
+    6 index 7 second)"
+
+ok $? "http server answers pipelined requests"
+
+output=$(printf 'HEAD / HTTP/1.1\r\nHost: localhost\r\n\r\n'		\
+    | ./https -d $tmpdir/htdocs | tr -d '\r')
+test "$output" = "$(printf 'HTTP/1.1 200 OK\nContent-Length: 6\n')"
+
+ok $? "http server answers HEAD without a body"
+
+output=$(printf 'POST / HTTP/1.1\r\nHost: localhost\r\n%b'		\
+    'Content-Length: 2\r\n\r\nab' | ./https -d $tmpdir/htdocs | head -n 1)
+test "$output" = "$(printf 'HTTP/1.1 501 Not Implemented\r')"
+
+ok $? "http server refuses POST (found $output)"
+
+output=$(printf 'GET / HTTP/1.1\r\nHost: %0300d\r\n\r\n' 0		\
+    | ./https -d $tmpdir/htdocs | head -n 1)
+test "$output" = "$(printf 'HTTP/1.1 400 Bad Request\r')"
+
+ok $? "http server refuses an oversized host (found $output)"
+
+output=$(printf 'GET / HTTP/1.1\r\nHost: localhost\r\n%b%020000d\r\n\r\n'	\
+    'X-Pad: ' 0 | ./https -d $tmpdir/htdocs | head -n 1)
+test "$output" = "$(printf 'HTTP/1.1 200 OK\r')"
+
+ok $? "http server reads a header of 20 KiB (found $output)"
+
+output=$(printf 'GET / HTTP/1.1\r\nHost: localhost\r\n%b%070000d\r\n\r\n'	\
+    'X-Pad: ' 0 | ./https -d $tmpdir/htdocs 2>/dev/null | head -n 1)
+test "$output" = "$(printf 'HTTP/1.1 431 Request Header Fields Too Large\r')"
+
+ok $? "http server refuses a header over 64 KiB (found $output)"
+
+#########################################################################
+# HTTP proxy client							#
+#########################################################################
+# fake proxy: accepts two CONNECT requests of a chain, then sends data
+: >$tmpdir/tcps.log
+: >$tmpdir/connect.log
+./tcps -d 127.0.0.1 0 sh -c 'for i in 1 2; do
+	read -r method authority version
+	echo "$method $authority" >>$0
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 200 Connection established\r\n\r\n"
+done; exec /usr/bin/env' $tmpdir/connect.log 2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+./tcpc 127.0.0.1 $SERVER_PORT ./httppc -x proxy.example:3128	\
+    example.com 80 ./read6.sh /dev/stdout | grep -q '^PROTO=TCP$' &&
+    test "$(cat $tmpdir/connect.log)" = \
+    "$(printf 'CONNECT proxy.example:3128\nCONNECT example.com:80')"
+
+ok $? "http proxy connection through a chain of two proxies"
+
+kill -9 $!
+
+# fake proxy: sends the answer and the first data of the tunnel at once
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 200 OK\r\nVia: 1.1 fake\r\n\r\nhello"' \
+	2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httppc example.com 80	\
+    ./read6.sh /dev/stdout)
+test "$output" = "hello"
+
+ok $? "http proxy leaves the tunnel data behind the header (found $output)"
+
+kill -9 $!
+
+# fake proxy: sends the header in pieces, the end with the tunnel data
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 2"; sleep 0.2
+	printf "00 OK\r\nVia: 1.1 fake\r"; sleep 0.2
+	printf "\n\r"; sleep 0.2
+	printf "\nhello"' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httppc example.com 80	\
+    ./read6.sh /dev/stdout)
+test "$output" = "hello"
+
+ok $? "http proxy header in several pieces (found $output)"
+
+kill -9 $SERVER_PID
+
+# fake proxy: a header of 6000 bytes, the first peek sees just a part
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 200 OK\r\nX-Pad: %03000d" 0; sleep 0.2
+	printf "%03000d\r\n\r\nhello" 0' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httppc example.com 80	\
+    ./read6.sh /dev/stdout)
+test "$output" = "hello"
+
+ok $? "http proxy header larger than one peek (found $output)"
+
+kill -9 $SERVER_PID
+
+# fake proxy: answers after the first line of the tunnel arrived
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	read -r first
+	case "$first" in
+	ping)	printf "HTTP/1.1 200 OK\r\n\r\n%s" "$first";;
+	*)	printf "HTTP/1.1 403 Forbidden\r\n\r\n";;
+	esac' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httppc -o example.com 80	\
+    sh -c 'echo ping >&7; cat <&6')
+test "$output" = "ping"
+
+ok $? "optimistic http proxy connection (found $output)"
+
+./tcpc 127.0.0.1 $SERVER_PORT ./httppc -o example.com 80		\
+    sh -c 'echo pong >&7; cat <&6' 2>&1 | grep -q ': 403 Forbidden$'
+
+ok $? "optimistic http proxy connection refused"
+
+kill -9 $SERVER_PID
+
+# fake proxy: keeps the tunnel open until the client closes it
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 sh -c '
+	while read -r line && [ "$line" != "$(printf "\r")" ]; do :; done
+	printf "HTTP/1.1 200 OK\r\n\r\n"
+	exec cat' 2>$tmpdir/tcps.log &
+SERVER_PID=$!
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+# the shim has to end with the program, not with the server
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httppc -o example.com 80	\
+    sh -c 'echo hi >&7; head -n 1 <&6' & CLIENT_PID=$!;		\
+    (sleep 5; kill $CLIENT_PID 2>/dev/null) >/dev/null & wait $CLIENT_PID)
+test $? -eq 0 -a "$output" = "hi"
+
+ok $? "optimistic http proxy ends with the program (found $output)"
+
+kill -9 $SERVER_PID
+
+# fake proxy: closes its side of the tunnel and still reads the client
+: >$tmpdir/proxy.log
+perl -MIO::Socket::INET -e '
+	$s = IO::Socket::INET->new(LocalAddr => "127.0.0.1", Listen => 1)
+	    or die;
+	printf STDERR "listen: 127.0.0.1:%d\n", $s->sockport;
+	$c = $s->accept or die;
+	while (<$c>) { last if $_ eq "\r\n" }
+	print $c "HTTP/1.1 200 OK\r\n\r\nhello";
+	shutdown($c, 1);
+	print STDERR "got: ", scalar <$c>;' 2>$tmpdir/proxy.log &
+SERVER_PID=$!
+
+until grep -q '^listen: 127.0.0.1:' $tmpdir/proxy.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/proxy.log)
+
+output=$(./tcpc 127.0.0.1 $SERVER_PORT ./httppc -o example.com 80	\
+    sh -c 'cat <&6; echo bye >&7')
+wait $SERVER_PID
+test "$output" = "hello" && grep -q '^got: bye$' $tmpdir/proxy.log
+
+ok $? "optimistic http proxy writes after the end of the server"
+
 #########################################################################
 # encrypted client to server communication				#
 #########################################################################
@@ -144,6 +805,189 @@ expect_env $tmpdir/env.txt "PROTO" "SSL"
 
 rm "$tmpdir/env.txt"
 
+#########################################################################
+# session resumption with shared ticket keys				#
+#########################################################################
+# libtls refuses session lifetimes under 4 minutes, that are two rotations
+! ./tlskey -o -l 119 $tmpdir/short.key 2>/dev/null &&
+    ./tlskey -o -l 120 $tmpdir/short.key
+
+ok $? "ticket key lifetime below two minutes refused"
+
+./tlskey -o $tmpdir/ticket.key
+: >$tmpdir/tcps.log	# don't catch the listen line of the last server
+./tcps -d 127.0.0.1 0						\
+	./tlss -K $tmpdir/ticket.key -c server.crt -k server.key	\
+	/usr/bin/env 2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+# the pipe waits for the front end programs, too
+connections=$(for i in 1 2; do
+	./tcpc 127.0.0.1 $SERVER_PORT ./tlsc -f ca.crt -S $tmpdir	\
+	    ./read6.sh /dev/stdout
+done | grep -c '^PROTO=SSL$')
+test "$connections" -eq 2
+
+ok $? "tls connections with session cache and ticket keys"
+
+kill -9 %1
+
+#########################################################################
+# compiled CA index							#
+#########################################################################
+./tlsca ca.crt $tmpdir/ca.idx
+./tlsca client.crt $tmpdir/wrong.idx
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 ./tlss -c server.crt -k server.key /usr/bin/env	\
+    2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+./tcpc 127.0.0.1 $SERVER_PORT ./tlsc -m $tmpdir/ca.idx	\
+    ./read6.sh /dev/stdout | grep -q '^PROTO=SSL$'
+
+ok $? "tls connection verified by CA index"
+
+./tcpc 127.0.0.1 $SERVER_PORT ./tlsc -m $tmpdir/wrong.idx	\
+    ./read6.sh /dev/stdout 2>/dev/null | grep -q '^PROTO=SSL$'
+
+test $? -ne 0
+ok $? "tls connection refused by CA index without issuer"
+
+./tlsc -f ca.crt -m $tmpdir/ca.idx true 2>&1 | grep -q "can't be combined"
+ok $? "tlsc refuses a CA file together with a CA index"
+
+kill -9 $!
+
+#########################################################################
+# TLS termination inside of tcps					#
+#########################################################################
+: >$tmpdir/tcps.log
+./tcps -d -c server.crt -k server.key 127.0.0.1 0 /usr/bin/env	\
+    2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+./tcpc 127.0.0.1 $SERVER_PORT ./tlsc -f ca.crt	\
+    ./read6.sh /dev/stdout | grep -q '^PROTO=SSL$'
+
+ok $? "tls connection to tcps in tls mode"
+
+kill -9 $!
+
+#########################################################################
+# idle timeout of the relay						#
+#########################################################################
+: >$tmpdir/tcps.log
+./tcps -d 127.0.0.1 0 ./tlss -i 1 -c server.crt -k server.key /bin/sleep 10 \
+    2>$tmpdir/tcps.log &
+
+# wait running server
+until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+# the client just waits for the server to close the connection
+./tcpc 127.0.0.1 $SERVER_PORT ./tlsc -f ca.crt sh -c 'cat <&6'
+grep -q '^tlss: idle timeout$' $tmpdir/tcps.log
+
+ok $? "idle tls connection closed by the server"
+
+kill -9 $!
+
+#########################################################################
+# kernel TLS handoff of sslc						#
+#########################################################################
+# OpenSSL answers one request with its status page
+: >$tmpdir/openssl.log
+openssl s_server -www -naccept 1 -cert server.crt -key server.key	\
+    -accept 127.0.0.1:0 >$tmpdir/openssl.log 2>&1 &
+
+# wait running server
+until grep -q '^ACCEPT 127.0.0.1:' $tmpdir/openssl.log; do :; done
+SERVER_PORT=$(sed -ne 's/^ACCEPT 127.0.0.1://p' $tmpdir/openssl.log)
+
+# the kernel takes over or sslc falls back to the relay, both have to work
+# and the program has to see the end of the connection as end of file
+./tcpc 127.0.0.1 $SERVER_PORT ./sslc -K -f ca.crt			\
+    /bin/sh -c 'printf "GET / HTTP/1.0\r\n\r\n" >&7; cat <&6; echo "eof $?"' \
+    >$tmpdir/ktls.txt 2>$tmpdir/sslc.log
+grep -q '^HTTP/1.0 200 ok' $tmpdir/ktls.txt &&
+    test "$(tail -n 1 $tmpdir/ktls.txt)" = "eof 0"
+
+ok $? "tls connection with kernel TLS of sslc"
+
+kill -9 $! 2>/dev/null
+
+#########################################################################
+# OCSP stapling								#
+#########################################################################
+# local stand-in responder for the server certificate
+serial=$(openssl x509 -noout -serial -in server.crt | cut -d= -f2)
+printf 'V\t351231235959Z\t\t%s\tunknown\t/CN=localhost\n' "$serial" \
+    >$tmpdir/index.txt
+: >$tmpdir/ocsp.log
+openssl ocsp -index $tmpdir/index.txt -rsigner ca.crt -rkey ca.key -CA ca.crt \
+    -port 0 -nrequest 1 >$tmpdir/ocsp.log 2>&1 &
+
+# wait running responder
+until grep -q '^ACCEPT ' $tmpdir/ocsp.log; do :; done
+OCSP_PORT=$(sed -ne 's/^ACCEPT .*:\([0-9]*\) .*/\1/p' $tmpdir/ocsp.log)
+
+./tlsstaple -u http://127.0.0.1:$OCSP_PORT server.crt ca.crt	\
+    $tmpdir/staple.der &&
+    openssl ocsp -respin $tmpdir/staple.der -resp_text -noverify |
+    grep -q 'Cert Status: good'
+
+ok $? "tlsstaple fetches a good staple from the responder"
+
+# stand-in responder which signs with a key unknown to the CA file
+openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=rogue -days 1	\
+    -keyout $tmpdir/rogue.key -out $tmpdir/rogue.crt 2>/dev/null
+: >$tmpdir/ocsp.log
+openssl ocsp -index $tmpdir/index.txt -rsigner $tmpdir/rogue.crt	\
+    -rkey $tmpdir/rogue.key -CA ca.crt -port 0 -nrequest 1		\
+    >$tmpdir/ocsp.log 2>&1 &
+
+# wait running responder
+until grep -q '^ACCEPT ' $tmpdir/ocsp.log; do :; done
+OCSP_PORT=$(sed -ne 's/^ACCEPT .*:\([0-9]*\) .*/\1/p' $tmpdir/ocsp.log)
+
+! ./tlsstaple -u http://127.0.0.1:$OCSP_PORT server.crt ca.crt	\
+    $tmpdir/rogue.der 2>/dev/null && test ! -e $tmpdir/rogue.der
+
+ok $? "tlsstaple refuses a staple of an untrusted responder"
+
+for staple in staple.der missing.der; do
+	case $staple in
+	staple.der)	expect='OCSP Response Status: successful';;
+	missing.der)	expect='OCSP response: no response sent';;
+	esac
+
+	: >$tmpdir/tcps.log
+	./tcps -d 127.0.0.1 0						\
+		./tlss -o $tmpdir/$staple -c server.crt -k server.key	\
+		/usr/bin/env 2>$tmpdir/tcps.log &
+
+	# wait running server
+	until grep -q '^listen: 127.0.0.1:' $tmpdir/tcps.log; do :; done
+	SERVER_PORT=$(sed -ne 's/^listen: 127.0.0.1://p' $tmpdir/tcps.log | head -n 1)
+
+	openssl s_client -status -connect 127.0.0.1:$SERVER_PORT	\
+	    </dev/null >$tmpdir/status.txt 2>/dev/null
+
+	grep -q "$expect" $tmpdir/status.txt
+	ok $? "tls connection with staple file $staple"
+
+	kill -9 $!
+done
+
 # clean up
 rm -rf $tmpdir
 
@@ -1,10 +1,71 @@
 # this Makefile creates files which are needed for tests
 
 KEYLEN=4096
+SYSTEM_CA ?= /etc/ssl/cert.pem
 
-test: tcps tcpc tlss tlsc server.crt client.crt ca.crt
+test: tcps tcpc sockc socks httpc httppc https httpbench sslc tlss tlsc tlskey tlsca server.crt client.crt ca.crt
 	./test.sh
 
+# benchmark of the tlsc/tlss relays ############################################
+tlsbench: tlsbench.o
+	$(CC) $(LDFLAGS) -o $@ tlsbench.o $(LDLIBS)
+
+BENCH_CERTS = bench-rsa2048.crt bench-rsa4096.crt bench-ecdsa.crt
+
+bench-tls: tlsc tlss tlskey tlsbench ca.crt $(BENCH_CERTS) bench-bundle.pem \
+    bench-bundle.idx
+	for k in rsa2048 rsa4096 ecdsa; do \
+		./tlsbench -l -C bench-$$k.crt -K bench-$$k.key \
+		    -n 200 handshake || exit 1; \
+		./tlsbench -l -C bench-$$k.crt -K bench-$$k.key \
+		    -n 400 -P 8 handshake || exit 1; \
+	done
+	for s in 4096 16384 65536; do \
+		./tlsbench -l -C bench-ecdsa.crt -K bench-ecdsa.key \
+		    -s $$s bulk || exit 1; \
+	done
+	./tlsbench -l -C bench-ecdsa.crt -K bench-ecdsa.key -R bulk
+	./tlsbench -l -C bench-ecdsa.crt -K bench-ecdsa.key -n 100 -i 100 ping
+	./tlsbench -l -f bench-bundle.pem -n 200 handshake
+	./tlsbench -l -m bench-bundle.idx -n 200 handshake
+
+# HTTP parsers on a generated corpus ###########################################
+httpbench.o: http_parser.h
+httpbench: httpbench.o http_parser.o
+	$(CC) $(LDFLAGS) -o $@ httpbench.o http_parser.o $(LDLIBS)
+
+bench-parser: httpbench httpc
+	./httpbench -t
+	./httpbench
+
+# throughput of a plain connection against one through socks ##################
+bench-socks: tcps tcpc sockc socks
+	./socksbench.sh
+
+# CA bundle of the system plus our test CA
+bench-bundle.pem: ca.crt
+	cat $(SYSTEM_CA) ca.crt > $@
+bench-bundle.idx: tlsca bench-bundle.pem
+	./tlsca -v bench-bundle.pem $@
+
+# keys and certificates for benchmarks ########################################
+bench-rsa2048.key:
+	openssl genrsa -out $@ 2048
+bench-rsa4096.key:
+	openssl genrsa -out $@ 4096
+bench-ecdsa.key:
+	openssl ecparam -name prime256v1 -genkey -noout -out $@
+
+bench-rsa2048.crt: bench-rsa2048.key server.cf ca.crt
+	openssl req -new -key bench-rsa2048.key -config server.cf | \
+	openssl x509 -req -out $@ -CAcreateserial -CAkey ca.key -CA ca.crt
+bench-rsa4096.crt: bench-rsa4096.key server.cf ca.crt
+	openssl req -new -key bench-rsa4096.key -config server.cf | \
+	openssl x509 -req -out $@ -CAcreateserial -CAkey ca.key -CA ca.crt
+bench-ecdsa.crt: bench-ecdsa.key server.cf ca.crt
+	openssl req -new -key bench-ecdsa.key -config server.cf | \
+	openssl x509 -req -out $@ -CAcreateserial -CAkey ca.key -CA ca.crt
+
 # create server key ############################################################
 client.key:
 	openssl genrsa -out $@ ${KEYLEN}
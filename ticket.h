@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TICKET_H
+#define TICKET_H
+
+#include <stdint.h>
+
+#include <tls.h>
+
+/*
+ * Session ticket key file shared by all tlss processes of one service.  It
+ * is written by tlskey and just valid on the host it was created, thus the
+ * byte order of the host is used.
+ */
+
+#define TICKET_MAGIC 0x746b6579	/* "tkey" */
+#define TICKET_KEYS 2		/* previous and current key */
+
+struct ticket_file {
+	uint32_t magic;
+	uint32_t lifetime;	/* seconds between two key rotations */
+	unsigned char session_id[TLS_MAX_SESSION_ID_LENGTH];
+	struct {
+		uint32_t keyrev;	/* 0 for an unused slot */
+		unsigned char key[TLS_TICKET_KEY_SIZE];
+	} keys[TICKET_KEYS];		/* oldest first */
+};
+
+#endif
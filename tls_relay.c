@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tls.h>
+
+#include "tls_relay.h"
+
+#ifndef INFTIM
+#define INFTIM (-1)
+#endif
+
+/*
+ * Dynamic record sizing: After the handshake and after an idle period, the
+ * program data is sent in small records, which fit into one TCP segment.
+ * Thus, the peer is able to decrypt the first bytes without waiting for
+ * further segments of a large record.  After RELAY_BOOST bytes, the TCP
+ * window should be open and full records keep the overhead low.
+ */
+#define RELAY_BOOST (64 * 1024)
+#define RELAY_IDLE 1000		/* msec */
+#define RELAY_CLOSE 1000	/* msec to send close_notify after a timeout */
+
+struct buf {
+	char *data;
+	size_t size;
+	size_t off;
+	size_t len;
+};
+
+static void
+buf_init(struct buf *buf, size_t size)
+{
+	if ((buf->data = malloc(size)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	buf->size = size;
+	buf->off = buf->len = 0;
+}
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void
+nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		err(EXIT_FAILURE, "fcntl");
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "fcntl");
+}
+
+/* Wait for the poll event libtls asked for, returns false on timeout. */
+static bool
+tls_wait(ssize_t want, int net_rfd, int net_wfd, int timeout)
+{
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = want == TLS_WANT_POLLIN ? net_rfd : net_wfd;
+	pfd.events = want == TLS_WANT_POLLIN ? POLLIN : POLLOUT;
+
+	if ((n = poll(&pfd, 1, timeout)) == -1 && errno != EINTR)
+		err(EXIT_FAILURE, "poll");
+
+	return n != 0;
+}
+
+/* send close_notify, but don't wait for a stuck peer longer than timeout */
+static void
+tls_shutdown(struct tls *tls, int net_rfd, int net_wfd, int timeout)
+{
+	long long deadline = now_ms() + timeout;
+	int ms = INFTIM;
+	ssize_t n;
+
+	while ((n = tls_close(tls)) == TLS_WANT_POLLIN ||
+	    n == TLS_WANT_POLLOUT) {
+		if (timeout != INFTIM && (ms = deadline - now_ms()) <= 0)
+			return;
+		if (!tls_wait(n, net_rfd, net_wfd, ms))
+			return;
+	}
+}
+
+/*
+ * Do the handshake non-blocking, thus a peer which does not answer is not
+ * able to hold the process longer than timeout seconds.
+ */
+void
+tls_relay_handshake(struct tls *tls, int net_rfd, int net_wfd, int timeout)
+{
+	long long deadline = now_ms() + timeout * 1000LL;
+	int ms = INFTIM;
+	int n;
+
+	nonblock(net_rfd);
+	nonblock(net_wfd);
+
+	while ((n = tls_handshake(tls)) == TLS_WANT_POLLIN ||
+	    n == TLS_WANT_POLLOUT) {
+		if (timeout > 0 && (ms = deadline - now_ms()) <= 0)
+			errx(EXIT_FAILURE, "tls_handshake: timeout");
+		if (!tls_wait(n, net_rfd, net_wfd, ms))
+			errx(EXIT_FAILURE, "tls_handshake: timeout");
+	}
+	if (n == -1)
+		errx(EXIT_FAILURE, "tls_handshake: %s", tls_error(tls));
+}
+
+/*
+ * Relay data between the TLS connection and the program until one side
+ * closes its connection.  All descriptors are used non-blocking.  Both
+ * directions have their own buffer and are served in every round, so a slow
+ * reader just stops the reading of its own direction.  The process only
+ * sleeps in poll(2), if no direction is able to make any progress.
+ *
+ * Reads of the program are coalesced into one record until the record is
+ * full or the program has nothing more to say for the moment.
+ *
+ * The clock is just read before the process goes to sleep.  If no direction
+ * moved for conf->idle seconds, or a blocked write did not move for
+ * conf->stall seconds, the connection is closed with a close_notify.
+ */
+int
+tls_relay(struct tls *tls, int net_rfd, int net_wfd, int in, int out,
+    const struct tls_relay_conf *conf)
+{
+	struct tls_relay_conf def = { RELAY_BUFSIZ, true, 0, 0 };
+	struct buf up;		/* program -> network */
+	struct buf down;	/* network -> program */
+	size_t record;		/* current record size */
+	size_t sent = 0;	/* bytes sent since the last idle period */
+	long long last = 0;	/* time of the last record */
+	struct pollfd pfd[4];
+	short rwant = 0;	/* poll event tls_read is waiting for */
+	short wwant = 0;	/* poll event tls_write is waiting for */
+	bool in_wait = false;
+	bool out_wait = false;
+	bool in_eof = false;
+	bool net_eof = false;
+	bool moved = false;	/* progress since the last sleep */
+	long long active;	/* time of the last progress */
+	int timeout;
+	ssize_t n;
+
+	if (conf == NULL)
+		conf = &def;
+
+	buf_init(&up, conf->bufsize);
+	buf_init(&down, conf->bufsize);
+	record = conf->dynamic && conf->bufsize > RELAY_SMALL ?
+	    RELAY_SMALL : conf->bufsize;
+
+	nonblock(net_rfd);
+	nonblock(net_wfd);
+	nonblock(in);
+	nonblock(out);
+
+	active = now_ms();
+
+	for (;;) {
+		bool progress = false;
+
+		/*
+		 * network -> program
+		 * Read as long as the program takes the data, this also drains
+		 * the records which are already buffered inside of libtls.
+		 */
+		if (!net_eof && down.len == 0 && rwant == 0) {
+			n = tls_read(tls, down.data, down.size);
+			if (n == TLS_WANT_POLLIN) {
+				rwant = POLLIN;
+			} else if (n == TLS_WANT_POLLOUT) {
+				rwant = POLLOUT;
+			} else if (n == -1) {
+				errx(EXIT_FAILURE, "tls_read: %s",
+				    tls_error(tls));
+			} else if (n == 0) {
+				net_eof = true;
+			} else {
+				down.off = 0;
+				down.len = n;
+				progress = true;
+			}
+		}
+
+		if (down.len > 0 && !out_wait) {
+			if ((n = write(out, down.data + down.off, down.len))
+			    == -1) {
+				if (errno != EAGAIN && errno != EINTR)
+					err(EXIT_FAILURE, "write");
+				if (errno == EAGAIN)
+					out_wait = true;
+				else
+					progress = true;
+			} else {
+				down.off += n;
+				down.len -= n;
+				progress = true;
+			}
+		}
+
+		if (net_eof && down.len == 0)
+			return EXIT_SUCCESS;
+
+		/* program -> network */
+		if (!in_eof && !in_wait && up.len < record) {
+			if (up.off > 0) {
+				memmove(up.data, up.data + up.off, up.len);
+				up.off = 0;
+			}
+			if ((n = read(in, up.data + up.len, up.size - up.len))
+			    == -1) {
+				if (errno != EAGAIN && errno != EINTR)
+					err(EXIT_FAILURE, "read");
+				if (errno == EAGAIN)
+					in_wait = true;
+				else
+					progress = true;
+			} else if (n == 0) {
+				in_eof = true;
+			} else {
+				up.len += n;
+				progress = true;
+			}
+		}
+
+		/* send full records or what we have, if the program waits */
+		if (up.len > 0 && wwant == 0 &&
+		    (up.len >= record || in_wait || in_eof)) {
+			if (conf->dynamic) {
+				long long now = now_ms();
+
+				if (now - last > RELAY_IDLE &&
+				    conf->bufsize > RELAY_SMALL) {
+					record = RELAY_SMALL;
+					sent = 0;
+				}
+				last = now;
+			}
+
+			n = tls_write(tls, up.data + up.off,
+			    up.len < record ? up.len : record);
+			if (n == TLS_WANT_POLLIN) {
+				wwant = POLLIN;
+			} else if (n == TLS_WANT_POLLOUT) {
+				wwant = POLLOUT;
+			} else if (n == -1) {
+				errx(EXIT_FAILURE, "tls_write: %s",
+				    tls_error(tls));
+			} else {
+				up.off += n;
+				up.len -= n;
+				progress = true;
+
+				sent += n;
+				if (conf->dynamic && sent >= RELAY_BOOST)
+					record = conf->bufsize < RELAY_BUFSIZ ?
+					    conf->bufsize : RELAY_BUFSIZ;
+			}
+		}
+
+		if (in_eof && up.len == 0)
+			break;
+
+		if (progress) {
+			moved = true;
+			continue;
+		}
+
+		timeout = INFTIM;
+		if (conf->idle > 0 || conf->stall > 0) {
+			long long now = now_ms();
+			bool stalled = (up.len > 0 && wwant != 0) ||
+			    (down.len > 0 && out_wait);
+			int limit = stalled && conf->stall > 0 ?
+			    conf->stall : conf->idle;
+
+			if (moved)
+				active = now;
+			moved = false;
+
+			if (limit > 0 && now - active >= limit * 1000LL) {
+				warnx("%s timeout", stalled ? "stall" : "idle");
+				tls_shutdown(tls, net_rfd, net_wfd,
+				    RELAY_CLOSE);
+				return EXIT_FAILURE;
+			}
+			if (limit > 0)
+				timeout = active + limit * 1000LL - now;
+		}
+
+		/* nothing to do, sleep until one direction is able to move */
+		pfd[0].fd = (rwant | wwant) & POLLIN ? net_rfd : -1;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = (rwant | wwant) & POLLOUT ? net_wfd : -1;
+		pfd[1].events = POLLOUT;
+		pfd[2].fd = in_wait ? in : -1;
+		pfd[2].events = POLLIN;
+		pfd[3].fd = out_wait ? out : -1;
+		pfd[3].events = POLLOUT;
+
+		if (poll(pfd, 4, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+
+		if (pfd[0].revents != 0) {
+			rwant &= ~POLLIN;
+			wwant &= ~POLLIN;
+		}
+		if (pfd[1].revents != 0) {
+			rwant &= ~POLLOUT;
+			wwant &= ~POLLOUT;
+		}
+		if (pfd[2].revents != 0)
+			in_wait = false;
+		if (pfd[3].revents != 0)
+			out_wait = false;
+	}
+
+	/* send close_notify */
+	tls_shutdown(tls, net_rfd, net_wfd,
+	    conf->stall > 0 ? conf->stall * 1000 : INFTIM);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TLS_RELAY_H
+#define TLS_RELAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RELAY_BUFSIZ (16 * 1024)	/* max. TLS record */
+#define RELAY_SMALL 1400		/* fits into one TCP segment */
+
+struct tls_relay_conf {
+	size_t bufsize;		/* buffer size of each direction */
+	bool dynamic;		/* start with small records */
+	int idle;		/* sec. without traffic, 0 for no limit */
+	int stall;		/* sec. a blocked write may wait, 0 for none */
+};
+
+void tls_relay_handshake(struct tls *tls, int net_rfd, int net_wfd,
+    int timeout);
+
+int tls_relay(struct tls *tls, int net_rfd, int net_wfd, int in, int out,
+    const struct tls_relay_conf *conf);
+
+#endif
@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark of the tlsc/tlss relay chain.  tlsc and tlss are connected
+ * through a socketpair or a loopback TCP connection and this program itself
+ * is started as their front end program to produce and consume the payload.
+ * All results are printed as key=value lines.
+ */
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
+#define READ_FD 6
+#define WRITE_FD 7
+
+static char *self = "./tlsbench";
+static char *ca_file = "ca.crt";
+static char *cert_file = "server.crt";
+static char *key_file = "server.key";
+static char *session_dir = NULL;
+static char *ticket_file = NULL;
+static char *ca_index = NULL;
+static char *bufsize = NULL;
+static bool fixed_records = false;
+static bool loopback = false;
+
+/* result of one connection */
+struct sample {
+	double wall;
+	double client_cpu;
+	double server_cpu;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "tlsbench [-lR] [-b bytes] [-C cert_file] "
+	    "[-f ca_file | -m ca_index] [-i msec] [-K key_file] [-n count] "
+	    "[-P parallel] [-s bufsize] bulk|ping|handshake\n");
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+	    ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int
+cmp_sample(const void *a, const void *b)
+{
+	return cmp_double(&((const struct sample *)a)->wall,
+	    &((const struct sample *)b)->wall);
+}
+
+/* front end programs */
+
+static int
+source(unsigned long long bytes)
+{
+	static char buf[64 * 1024];
+	double start = now();
+
+	/* timestamp for the time to first byte */
+	memcpy(buf, &start, sizeof start);
+
+	while (bytes > 0) {
+		size_t size = bytes < sizeof buf ? bytes : sizeof buf;
+		ssize_t n;
+
+		if ((n = write(WRITE_FD, buf, size)) == -1)
+			err(EXIT_FAILURE, "write");
+		bytes -= n;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int
+sink(void)
+{
+	static char buf[64 * 1024];
+	ssize_t n;
+
+	while ((n = read(STDIN_FILENO, buf, sizeof buf)) > 0)
+		;
+	if (n == -1)
+		err(EXIT_FAILURE, "read");
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Measure the time to the first byte of source and sink the rest.  The time
+ * is written into file for the result line of the parent.
+ */
+static int
+drain(const char *file)
+{
+	char buf[BUFSIZ];
+	double start;
+	ssize_t n;
+	FILE *fh;
+
+	if ((n = read(STDIN_FILENO, buf, sizeof buf)) < (ssize_t)sizeof start)
+		errx(EXIT_FAILURE, "read: short first record");
+	memcpy(&start, buf, sizeof start);
+
+	if ((fh = fopen(file, "w")) == NULL)
+		err(EXIT_FAILURE, "fopen: %s", file);
+	fprintf(fh, "%.1f\n", (now() - start) * 1e6);
+	if (fclose(fh) == EOF)
+		err(EXIT_FAILURE, "fclose: %s", file);
+
+	return sink();
+}
+
+static int
+echo(void)
+{
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	while ((n = read(STDIN_FILENO, buf, sizeof buf)) > 0)
+		if (write(STDOUT_FILENO, buf, n) != n)
+			err(EXIT_FAILURE, "write");
+	if (n == -1)
+		err(EXIT_FAILURE, "read");
+
+	return EXIT_SUCCESS;
+}
+
+/* Server side of a handshake: greet the client and wait until it leaves. */
+static int
+greeter(void)
+{
+	if (write(STDOUT_FILENO, "g", 1) != 1)
+		err(EXIT_FAILURE, "write");
+
+	return sink();
+}
+
+/*
+ * Client side of a handshake: wait for the greeting.  Thus, tlsc also reads
+ * the session tickets, which a TLS 1.3 server sends after the handshake.
+ */
+static int
+greeted(void)
+{
+	char c;
+
+	if (read(READ_FD, &c, 1) != 1)
+		errx(EXIT_FAILURE, "read: lost greeting");
+
+	return EXIT_SUCCESS;
+}
+
+/* Send one byte after every interval and wait for its echo. */
+static int
+pinger(int count, int interval)
+{
+	double *rtt;
+	char c = 'p';
+
+	if ((rtt = calloc(count, sizeof *rtt)) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (int i = 0; i < count; i++) {
+		double start;
+
+		usleep(interval * 1000);
+
+		start = now();
+		if (write(WRITE_FD, &c, 1) != 1)
+			err(EXIT_FAILURE, "write");
+		if (read(READ_FD, &c, 1) != 1)
+			errx(EXIT_FAILURE, "read: lost echo");
+		rtt[i] = now() - start;
+	}
+
+	qsort(rtt, count, sizeof *rtt, cmp_double);
+	printf("ping count=%d p50_us=%.1f p99_us=%.1f max_us=%.1f\n", count,
+	    rtt[count / 2] * 1e6, rtt[count * 99 / 100] * 1e6,
+	    rtt[count - 1] * 1e6);
+
+	return EXIT_SUCCESS;
+}
+
+/* relay chain */
+
+static pid_t
+spawn(int fd, bool server, char *prog[])
+{
+	char *argv[16];
+	int argc = 0;
+	pid_t pid;
+
+	if (server) {
+		argv[argc++] = "tlss";
+		argv[argc++] = "-c";
+		argv[argc++] = cert_file;
+		argv[argc++] = "-k";
+		argv[argc++] = key_file;
+		if (ticket_file != NULL) {
+			argv[argc++] = "-K";
+			argv[argc++] = ticket_file;
+		}
+	} else {
+		argv[argc++] = "tlsc";
+		argv[argc++] = ca_index ? "-m" : "-f";
+		argv[argc++] = ca_index ? ca_index : ca_file;
+		if (session_dir != NULL) {
+			argv[argc++] = "-S";
+			argv[argc++] = session_dir;
+		}
+	}
+	if (bufsize != NULL) {
+		argv[argc++] = "-b";
+		argv[argc++] = bufsize;
+	}
+	if (fixed_records)
+		argv[argc++] = "-R";
+	argv[argc++] = self;
+	while (*prog != NULL && argc < 15)
+		argv[argc++] = *prog++;
+	argv[argc] = NULL;
+
+	switch ((pid = fork())) {
+	case -1:
+		err(EXIT_FAILURE, "fork");
+	case 0:
+		if (dup2(fd, server ? STDIN_FILENO : READ_FD) == -1 ||
+		    dup2(fd, server ? STDOUT_FILENO : WRITE_FD) == -1)
+			err(EXIT_FAILURE, "dup2");
+		if (setenv("TCPREMOTEHOST", "localhost", 1) == -1 ||
+		    setenv("TCPREMOTEPORT", "443", 1) == -1)
+			err(EXIT_FAILURE, "setenv");
+		execv(server ? "./tlss" : "./tlsc", argv);
+		err(EXIT_FAILURE, "execv");
+	default:
+		break;
+	}
+
+	return pid;
+}
+
+/* Create a connected pair of TCP sockets over the loopback interface. */
+static void
+tcp_pair(int sv[2])
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof addr;
+	int s;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(EXIT_FAILURE, "socket");
+	if (bind(s, (struct sockaddr *)&addr, len) == -1)
+		err(EXIT_FAILURE, "bind");
+	if (listen(s, 1) == -1)
+		err(EXIT_FAILURE, "listen");
+	if (getsockname(s, (struct sockaddr *)&addr, &len) == -1)
+		err(EXIT_FAILURE, "getsockname");
+
+	if ((sv[1] = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(EXIT_FAILURE, "socket");
+	if (connect(sv[1], (struct sockaddr *)&addr, len) == -1)
+		err(EXIT_FAILURE, "connect");
+	if ((sv[0] = accept(s, NULL, NULL)) == -1)
+		err(EXIT_FAILURE, "accept");
+	if (close(s) == -1)
+		err(EXIT_FAILURE, "close");
+}
+
+/*
+ * Connect tlsc and tlss and wait until both are finished.  Returns the
+ * wall clock time and the CPU time of both relay processes.
+ */
+static double
+run(char *client[], char *server[], double *client_cpu, double *server_cpu)
+{
+	struct rusage ru;
+	double start = now();
+	pid_t cpid, spid, pid;
+	int sv[2];
+	int status;
+
+	if (loopback)
+		tcp_pair(sv);
+	else if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err(EXIT_FAILURE, "socketpair");
+	if (fcntl(sv[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(sv[1], F_SETFD, FD_CLOEXEC) == -1)
+		err(EXIT_FAILURE, "fcntl");
+
+	spid = spawn(sv[0], true, server);
+	cpid = spawn(sv[1], false, client);
+
+	if (close(sv[0]) == -1 || close(sv[1]) == -1)
+		err(EXIT_FAILURE, "close");
+
+	for (int i = 0; i < 2; i++) {
+		if ((pid = wait4(-1, &status, 0, &ru)) == -1)
+			err(EXIT_FAILURE, "wait4");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(EXIT_FAILURE, "%s failed",
+			    pid == cpid ? "tlsc" : "tlss");
+		if (pid == cpid)
+			*client_cpu = cpu(&ru);
+		else if (pid == spid)
+			*server_cpu = cpu(&ru);
+	}
+
+	return now() - start;
+}
+
+/*
+ * Connect count times with parallel workers.  The first connection primes
+ * the session cache.
+ */
+static void
+handshakes(int count, int parallel)
+{
+	char *client[] = { "greeted", NULL };
+	char *server[] = { "greeter", NULL };
+	struct sample *sample;
+	double csum = 0, ssum = 0;
+	double start, wall;
+	int fd[2];
+	int n = 0;
+
+	if ((sample = calloc(count, sizeof *sample)) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	run(client, server, &sample[0].client_cpu, &sample[0].server_cpu);
+
+	if (pipe(fd) == -1)
+		err(EXIT_FAILURE, "pipe");
+	if (fflush(stdout) == EOF)
+		err(EXIT_FAILURE, "fflush");
+
+	start = now();
+	for (int p = 0; p < parallel; p++) {
+		switch (fork()) {
+		case -1:
+			err(EXIT_FAILURE, "fork");
+		case 0:
+			close(fd[0]);
+			for (int i = p; i < count; i += parallel) {
+				struct sample s;
+
+				s.wall = run(client, server, &s.client_cpu,
+				    &s.server_cpu);
+				if (write(fd[1], &s, sizeof s) != sizeof s)
+					err(EXIT_FAILURE, "write");
+			}
+			_exit(EXIT_SUCCESS);
+		default:
+			break;
+		}
+	}
+	close(fd[1]);
+
+	while (n < count && read(fd[0], &sample[n], sizeof *sample) ==
+	    sizeof *sample) {
+		csum += sample[n].client_cpu;
+		ssum += sample[n].server_cpu;
+		n++;
+	}
+	wall = now() - start;
+	close(fd[0]);
+
+	for (int p = 0; p < parallel; p++) {
+		int status;
+
+		if (wait(&status) == -1)
+			err(EXIT_FAILURE, "wait");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(EXIT_FAILURE, "handshake worker failed");
+	}
+	if (n != count)
+		errx(EXIT_FAILURE, "lost %d results", count - n);
+
+	qsort(sample, count, sizeof *sample, cmp_sample);
+	printf("handshake cert=%s ca=%s transport=%s count=%d parallel=%d "
+	    "session_cache=%s ticket_keys=%s per_s=%.1f p50_ms=%.3f "
+	    "p99_ms=%.3f client_cpu_ms=%.3f server_cpu_ms=%.3f\n",
+	    cert_file, ca_index ? ca_index : ca_file,
+	    loopback ? "tcp" : "unix", count, parallel,
+	    session_dir ? "yes" : "no", ticket_file ? "yes" : "no",
+	    count / wall, sample[count / 2].wall * 1e3,
+	    sample[count * 99 / 100].wall * 1e3, csum / count * 1e3,
+	    ssum / count * 1e3);
+	if (fflush(stdout) == EOF)
+		err(EXIT_FAILURE, "fflush");
+	free(sample);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long long bytes = 256ULL * 1024 * 1024;
+	const char *errstr = NULL;
+	double wall, ccpu = 0, scpu = 0;
+	int count = 100;
+	int interval = 100;
+	int parallel = 1;
+	char str[32];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:C:f:i:K:lm:n:P:Rs:h")) != -1) {
+		switch (ch) {
+		case 'b':
+			bytes = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "bytes is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'i':
+			interval = strtonum(optarg, 0, 1000000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "interval is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'n':
+			count = strtonum(optarg, 1, 1000000, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "count is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'C':
+			cert_file = optarg;
+			break;
+		case 'f':
+			ca_file = optarg;
+			break;
+		case 'K':
+			key_file = optarg;
+			break;
+		case 'm':
+			ca_index = optarg;
+			break;
+		case 'l':
+			loopback = true;
+			break;
+		case 'P':
+			parallel = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "parallel is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'R':
+			fixed_records = true;
+			break;
+		case 's':
+			bufsize = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage();
+
+	/* front end programs started by tlsc and tlss */
+	if (strcmp(argv[0], "source") == 0 && argc == 2)
+		return source(strtoull(argv[1], NULL, 10));
+	if (strcmp(argv[0], "sink") == 0)
+		return sink();
+	if (strcmp(argv[0], "drain") == 0 && argc == 2)
+		return drain(argv[1]);
+	if (strcmp(argv[0], "echo") == 0)
+		return echo();
+	if (strcmp(argv[0], "pinger") == 0 && argc == 3)
+		return pinger(atoi(argv[1]), atoi(argv[2]));
+	if (strcmp(argv[0], "greeter") == 0)
+		return greeter();
+	if (strcmp(argv[0], "greeted") == 0)
+		return greeted();
+
+	if (strcmp(argv[0], "bulk") == 0) {
+		char file[] = "/tmp/tlsbench.XXXXXX";
+		char *client[] = { "source", str, NULL };
+		char *server[] = { "drain", file, NULL };
+		double ttfb = -1;
+		FILE *fh;
+		int fd;
+
+		if ((fd = mkstemp(file)) == -1)
+			err(EXIT_FAILURE, "mkstemp");
+		close(fd);
+
+		snprintf(str, sizeof str, "%llu", bytes);
+		wall = run(client, server, &ccpu, &scpu);
+
+		if ((fh = fopen(file, "r")) == NULL)
+			err(EXIT_FAILURE, "fopen: %s", file);
+		if (fscanf(fh, "%lf", &ttfb) != 1)
+			errx(EXIT_FAILURE, "%s: no time to first byte", file);
+		fclose(fh);
+		unlink(file);
+
+		printf("bulk cert=%s transport=%s bytes=%llu bufsize=%s "
+		    "records=%s wall_s=%.3f mb_per_s=%.1f ttfb_us=%.1f "
+		    "client_cpu_s_per_gb=%.3f server_cpu_s_per_gb=%.3f\n",
+		    cert_file, loopback ? "tcp" : "unix", bytes,
+		    bufsize ? bufsize : "default",
+		    fixed_records ? "fixed" : "dynamic", wall, bytes / wall / 1e6,
+		    ttfb, ccpu / (bytes / 1e9), scpu / (bytes / 1e9));
+	} else if (strcmp(argv[0], "ping") == 0) {
+		char cnt[16];
+		char *client[] = { "pinger", cnt, str, NULL };
+		char *server[] = { "echo", NULL };
+
+		snprintf(cnt, sizeof cnt, "%d", count);
+		snprintf(str, sizeof str, "%d", interval);
+		if (fflush(stdout) == EOF)
+			err(EXIT_FAILURE, "fflush");
+		wall = run(client, server, &ccpu, &scpu);
+		printf("ping wall_s=%.3f client_cpu_s=%.3f "
+		    "server_cpu_s=%.3f\n", wall, ccpu, scpu);
+	} else if (strcmp(argv[0], "handshake") == 0) {
+		char dir[] = "/tmp/tlsbench.XXXXXX";
+		char path[PATH_MAX];
+		char keys[PATH_MAX];
+		char cmd[PATH_MAX + 32];
+
+		handshakes(count, parallel);
+
+		/* again with a session cache */
+		if ((session_dir = mkdtemp(dir)) == NULL)
+			err(EXIT_FAILURE, "mkdtemp");
+		handshakes(count, parallel);
+
+		/* and with ticket keys shared by all tlss processes */
+		snprintf(keys, sizeof keys, "%s/ticket.key", dir);
+		snprintf(cmd, sizeof cmd, "./tlskey -o %s", keys);
+		if (system(cmd) != 0)
+			errx(EXIT_FAILURE, "%s failed", cmd);
+		ticket_file = keys;
+		handshakes(count, parallel);
+
+		snprintf(path, sizeof path, "%s/localhost:443", dir);
+		unlink(path);
+		unlink(keys);
+		if (rmdir(dir) == -1)
+			warn("rmdir: %s", dir);
+	} else {
+		usage();
+	}
+
+	return EXIT_SUCCESS;
+}
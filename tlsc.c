@@ -14,11 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/select.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -27,11 +29,14 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
 #include <tls.h>
 
-#ifndef MAX
-#define MAX(a, b) ((a) < (b) ? (b) : (a))
-#endif
+#include "ca_index.h"
+#include "tls_relay.h"
 
 #define READ_FD 6
 #define WRITE_FD 7
@@ -40,11 +45,96 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-	    "tlsc [-hCHVs] [-F fingerprint] [-c cert_file] [-f ca_file] "
-	    "[-p ca_path] program [args...]\n");
+	    "tlsc [-hCHRVs] [-F fingerprint] [-S session_dir] [-b bufsize] "
+	    "[-c cert_file] [-f ca_file] [-m ca_index] [-p ca_path] "
+	    "[-t timeout] [-i idle] [-w stall] program [args...]\n");
 	exit(EXIT_FAILURE);
 }
 
+/* copy the whole content of file descriptor from into to */
+static int
+copy_fd(int from, int to)
+{
+	char buf[BUFSIZ];
+	off_t off = 0;
+	ssize_t n;
+
+	while ((n = pread(from, buf, sizeof buf, off)) > 0) {
+		if (write(to, buf, n) != n)
+			return -1;
+		off += n;
+	}
+
+	return n;
+}
+
+/*
+ * The session cache holds one file per server in session_dir.  libtls
+ * reads and updates the session through a private and unlinked copy of
+ * this file.  Afterwards, the copy is renamed over the cache file.  Thus,
+ * concurrent tlsc processes never see a partial file and no locking is
+ * needed.  The last writer just wins.
+ */
+static int
+session_open(const char *dir, const char *host, const char *port,
+    char *path, size_t size)
+{
+	char tmp[PATH_MAX];
+	int fd, cache;
+
+	if (snprintf(path, size, "%s/%s:%s", dir, host,
+	    port ? port : "") >= (int)size) {
+		warnx("session path too long");
+		return -1;
+	}
+	/* don't let the hostname escape the cache directory */
+	for (char *p = path + strlen(dir) + 1; *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';
+
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= (int)sizeof tmp) {
+		warnx("session path too long");
+		return -1;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("mkstemp: %s", tmp);
+		return -1;
+	}
+	if (unlink(tmp) == -1)
+		err(EXIT_FAILURE, "unlink: %s", tmp);
+
+	if ((cache = open(path, O_RDONLY)) != -1) {
+		if (copy_fd(cache, fd) == -1 && ftruncate(fd, 0) == -1)
+			err(EXIT_FAILURE, "ftruncate");
+		close(cache);
+	}
+
+	return fd;
+}
+
+static void
+session_save(int fd, const char *path)
+{
+	char tmp[PATH_MAX];
+	struct stat st;
+	int new;
+
+	/* nothing to save, yet */
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+		return;
+
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	if ((new = mkstemp(tmp)) == -1) {
+		warn("mkstemp: %s", tmp);
+		return;
+	}
+	if (copy_fd(fd, new) == -1 || close(new) == -1 ||
+	    rename(tmp, path) == -1) {
+		warn("session_save: %s", path);
+		unlink(tmp);
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -61,10 +151,19 @@ main(int argc, char *argv[])
 	bool no_time_verification = false;
 	char *host = getenv("TCPREMOTEHOST");
 	char *fingerprint = getenv("TLSC_FINGERPRINT");
+	char *session_dir = getenv("TLSC_SESSION_DIR");
+	char *ca_index = getenv("TLSC_CA_INDEX");
+	bool ca_opt = false, index_opt = false;
+	char session_path[PATH_MAX];
+	int session_fd = -1;
+	int timeout = 0;
+	int ret;
+	struct tls_relay_conf relay = { RELAY_BUFSIZ, true, 0, 0 };
+	const char *errstr = NULL;
 	struct tls_config *tls_config;
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath proc exec", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath proc exec", NULL) == -1)
 		err(EXIT_FAILURE, "pledge");
 #endif
 
@@ -106,12 +205,25 @@ main(int argc, char *argv[])
 		if (tls_config_set_ca_path(tls_config, str) == -1)
 			err(EXIT_FAILURE, "tls_config_set_ca_path");
 
-	while ((ch = getopt(argc, argv, "c:k:f:p:n:sF:HCTVh")) != -1) {
+	while ((ch = getopt(argc, argv, "b:c:i:k:f:m:p:n:sF:S:t:w:HCRTVh")) != -1) {
 		switch (ch) {
+		case 'b':
+			relay.bufsize = strtonum(optarg, 512, 1024 * 1024,
+			    &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "buffer size is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'c':
 			if (tls_config_set_cert_file(tls_config, optarg) == -1)
 				err(EXIT_FAILURE, "tls_config_set_cert_file");
 			break;
+		case 'i':
+			relay.idle = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "idle timeout is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'k':
 			if (tls_config_set_key_file(tls_config, optarg) == -1)
 				err(EXIT_FAILURE, "tls_config_set_key_file");
@@ -119,10 +231,17 @@ main(int argc, char *argv[])
 		case 'f':
 			if (tls_config_set_ca_file(tls_config, optarg) == -1)
 				err(EXIT_FAILURE, "tls_config_set_ca_file");
+			ca_opt = true;
+			break;
+		case 'm':
+			if ((ca_index = strdup(optarg)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			index_opt = true;
 			break;
 		case 'p':
 			if (tls_config_set_ca_path(tls_config, optarg) == -1)
 				err(EXIT_FAILURE, "tls_config_set_ca_path");
+			ca_opt = true;
 			break;
 		case 'n':
 			if ((host = strdup(optarg)) == NULL)
@@ -134,16 +253,35 @@ main(int argc, char *argv[])
 			no_cert_verification = true;
 			no_time_verification = true;
 			break;
+		case 't':
+			timeout = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "timeout is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'w':
+			relay.stall = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "stall timeout is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'F':
 			if ((fingerprint = strdup(optarg)) == NULL)
 				err(EXIT_FAILURE, "strdup");
 			break;
+		case 'S':
+			if ((session_dir = strdup(optarg)) == NULL)
+				err(EXIT_FAILURE, "strdup");
+			break;
 		case 'H':
 			no_name_verification = true;
 			break;
 		case 'C':
 			no_cert_verification = true;
 			break;
+		case 'R':
+			relay.dynamic = false;
+			break;
 		case 'T':
 			no_time_verification = true;
 			break;
@@ -161,12 +299,21 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	/* the index replaces the verification of libtls, don't drop -f or -p */
+	if (ca_opt && index_opt)
+		errx(EXIT_FAILURE, "-m can't be combined with -f or -p");
+	if (ca_opt)
+		ca_index = NULL;
+
 	if (show_cert_info == false && argc < 1)
 		usage();
 
 	/* verification settings */
 	if (no_cert_verification)
 		tls_config_insecure_noverifycert(tls_config);
+	else if (ca_index != NULL)
+		/* don't parse any CA bundle, the chain is checked later */
+		tls_config_insecure_noverifycert(tls_config);
 
 	if (no_name_verification)
 		tls_config_insecure_noverifyname(tls_config);
@@ -174,6 +321,16 @@ main(int argc, char *argv[])
 	if (no_time_verification)
 		tls_config_insecure_noverifytime(tls_config);
 
+	/* session resumption */
+	if (session_dir != NULL && host != NULL && show_cert_info == false)
+		session_fd = session_open(session_dir, host,
+		    getenv("TCPREMOTEPORT"), session_path, sizeof session_path);
+
+	if (session_fd != -1 &&
+	    tls_config_set_session_fd(tls_config, session_fd) == -1)
+		errx(EXIT_FAILURE, "tls_config_set_session_fd: %s",
+		    tls_config_error(tls_config));
+
 	/* libtls setup */
 	if ((tls = tls_client()) == NULL)
 		err(EXIT_FAILURE, "tls_client");
@@ -184,8 +341,7 @@ main(int argc, char *argv[])
 	if (tls_connect_fds(tls, READ_FD, WRITE_FD, host) == -1)
 		errx(EXIT_FAILURE, "tls_connect_fds: %s", tls_error(tls));
 
-	if (tls_handshake(tls) == -1)
-		errx(EXIT_FAILURE, "tls_handshake: %s", tls_error(tls));
+	tls_relay_handshake(tls, READ_FD, WRITE_FD, timeout);
 
 	if (show_cert_info) {
 		time_t notbefore = tls_peer_cert_notbefore(tls);
@@ -211,6 +367,20 @@ main(int argc, char *argv[])
 		err(EXIT_FAILURE, "certificate hash has changed from %s to %s",
 		    fingerprint, tls_peer_cert_hash(tls));
 
+	/* verify the chain with the roots of the CA index */
+	if (ca_index != NULL && !no_cert_verification) {
+		const uint8_t *chain;
+		size_t len;
+
+		if ((chain = tls_peer_cert_chain_pem(tls, &len)) == NULL)
+			errx(EXIT_FAILURE, "tls_peer_cert_chain_pem: %s",
+			    tls_error(tls));
+		if (ca_index_verify(ca_index, (const char *)chain, len,
+		    !no_time_verification, &errstr) == -1)
+			errx(EXIT_FAILURE, "certificate verification failed: %s",
+			    errstr);
+	}
+
 	/* overide PROTO to signal the application layer that the communication
 	 * channel is save. */
 	if (setenv("PROTO", "SSL", 1) == -1)
@@ -255,7 +425,8 @@ main(int argc, char *argv[])
 	}
 
 #ifdef __OpenBSD__
-	if (pledge("stdio", NULL) == -1)
+	if (pledge(session_fd == -1 ? "stdio" : "stdio rpath wpath cpath",
+	    NULL) == -1)
 		err(EXIT_FAILURE, "pledge");
 #endif
 
@@ -266,47 +437,15 @@ main(int argc, char *argv[])
 	in = pi[PIPE_READ];
 	out = po[PIPE_WRITE];
 
-	/* communication loop */
-	for (;;) {
-		int ret;
-		char buf[BUFSIZ];
-		ssize_t sn = 0;
-		fd_set readfds;
-		FD_ZERO(&readfds);
-		FD_SET(in, &readfds);
-		FD_SET(READ_FD, &readfds);
-		int max_fd = MAX(in, READ_FD);
-
-		ret = select(max_fd+1, &readfds, NULL, NULL, NULL);
-		if (ret == -1)
-			err(EXIT_FAILURE, "select");
-
-		if (FD_ISSET(READ_FD, &readfds)) {
-			do {
- again:
-				sn = tls_read(tls, buf, sizeof buf);
-				if (sn == TLS_WANT_POLLIN ||
-				    sn == TLS_WANT_POLLOUT)
-					goto again;
-				if (sn == -1)
-					errx(EXIT_FAILURE, "tls_read: %s",
-					    tls_error(tls));
-				if (sn == 0)
-					return EXIT_SUCCESS;
-
-				if (write(out, buf, sn) == -1)
-					err(EXIT_FAILURE, "write()");
-			} while (sn == sizeof buf);
-		} else if (FD_ISSET(in, &readfds)) {
-			if ((sn = read(in, buf, sizeof buf)) == -1)
-				err(EXIT_FAILURE, "read()");
-			if (sn == 0)
-				goto out;
-			if ((sn = tls_write(tls, buf, sn)) == -1)
-				goto out;
-		}
-	}
- out:
-	tls_close(tls);
-	return EXIT_SUCCESS;
+	/* save the session early for concurrent connections */
+	if (session_fd != -1)
+		session_save(session_fd, session_path);
+
+	ret = tls_relay(tls, READ_FD, WRITE_FD, in, out, &relay);
+
+	/* TLS 1.3 tickets arrive after the handshake */
+	if (session_fd != -1)
+		session_save(session_fd, session_path);
+
+	return ret;
 }
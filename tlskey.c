@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2021 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Manager of the session ticket keys of tlss.  It rotates the keys in the
+ * key file after every lifetime.  The previous key is kept, so tickets
+ * issued just before a rotation stay valid.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
+#include "ticket.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "tlskey [-o] [-l lifetime] keyfile\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+rotate(const char *file, uint32_t lifetime)
+{
+	struct ticket_file tf;
+	char tmp[PATH_MAX];
+	int fd;
+
+	/* keep session id and current key of an existing file */
+	if ((fd = open(file, O_RDONLY)) != -1) {
+		if (read(fd, &tf, sizeof tf) != sizeof tf ||
+		    tf.magic != TICKET_MAGIC)
+			errx(EXIT_FAILURE, "%s: invalid key file", file);
+		close(fd);
+	} else {
+		memset(&tf, 0, sizeof tf);
+		tf.magic = TICKET_MAGIC;
+		arc4random_buf(tf.session_id, sizeof tf.session_id);
+	}
+
+	tf.lifetime = lifetime;
+	for (int i = 0; i < TICKET_KEYS - 1; i++)
+		tf.keys[i] = tf.keys[i + 1];
+	tf.keys[TICKET_KEYS - 1].keyrev = tf.keys[TICKET_KEYS - 2].keyrev + 1;
+	arc4random_buf(tf.keys[TICKET_KEYS - 1].key,
+	    sizeof tf.keys[TICKET_KEYS - 1].key);
+
+	/* replace the file atomically, tlss may read it at any time */
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", file) >= (int)sizeof tmp)
+		errx(EXIT_FAILURE, "path too long: %s", file);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(EXIT_FAILURE, "mkstemp: %s", tmp);
+	if (write(fd, &tf, sizeof tf) != sizeof tf)
+		err(EXIT_FAILURE, "write: %s", tmp);
+	if (fsync(fd) == -1)
+		err(EXIT_FAILURE, "fsync: %s", tmp);
+	if (close(fd) == -1)
+		err(EXIT_FAILURE, "close: %s", tmp);
+	if (rename(tmp, file) == -1)
+		err(EXIT_FAILURE, "rename: %s", file);
+
+	explicit_bzero(&tf, sizeof tf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *errstr = NULL;
+	uint32_t lifetime = 3600;
+	bool once = false;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "l:oh")) != -1) {
+		switch (ch) {
+		case 'l':
+			/*
+			 * tlss accepts tickets for two lifetimes, which libtls
+			 * allows from 4 minutes up to 24 hours.
+			 */
+			lifetime = strtonum(optarg, 2 * 60, 12 * 60 * 60,
+			    &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "lifetime is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'o':
+			once = true;
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	umask(077);
+
+#ifdef __OpenBSD__
+	if (pledge("stdio rpath wpath cpath", NULL) == -1)
+		err(EXIT_FAILURE, "pledge");
+#endif
+
+	for (;;) {
+		rotate(argv[0], lifetime);
+		if (once)
+			break;
+		sleep(lifetime);
+	}
+
+	return EXIT_SUCCESS;
+}
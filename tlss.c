@@ -14,19 +14,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/select.h>
-
 #include <err.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef USE_LIBBSD
+#	include <bsd/stdlib.h>
+#endif
+
 #include <tls.h>
 
-#ifndef MAX
-#define MAX(a, b) ((a) < (b) ? (b) : (a))
-#endif
+#include "ticket.h"
+#include "tls_relay.h"
 
 /* ucspi */
 #define READ_FD STDIN_FILENO
@@ -35,17 +37,61 @@
 void
 usage(void)
 {
-	fprintf(stderr, "tlss [-C] [-c cert_file] [-k key_file] [-p ca_path] "
-	    "[-f ca_file] prog [args]\n");
+	fprintf(stderr, "tlss [-CR] [-b bufsize] [-c cert_file] [-k key_file] "
+	    "[-p ca_path] [-f ca_file] [-K ticket_file] [-o staple_file] "
+	    "[-t timeout] [-i idle] [-w stall] prog [args]\n");
 	exit(EXIT_FAILURE);
 }
 
+/*
+ * Use the session id and ticket keys of the file maintained by tlskey.
+ * Thus, every tlss process resumes sessions of the others.
+ */
+static void
+ticket_keys(struct tls_config *tls_config, const char *file)
+{
+	struct ticket_file tf;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(EXIT_FAILURE, "open: %s", file);
+	if (read(fd, &tf, sizeof tf) != sizeof tf || tf.magic != TICKET_MAGIC)
+		errx(EXIT_FAILURE, "%s: invalid ticket key file", file);
+	close(fd);
+
+	if (tls_config_set_session_id(tls_config, tf.session_id,
+	    sizeof tf.session_id) == -1)
+		errx(EXIT_FAILURE, "tls_config_set_session_id: %s",
+		    tls_config_error(tls_config));
+
+	/* a ticket is valid until its key is rotated out */
+	if (tls_config_set_session_lifetime(tls_config,
+	    tf.lifetime * TICKET_KEYS) == -1)
+		errx(EXIT_FAILURE, "tls_config_set_session_lifetime: %s",
+		    tls_config_error(tls_config));
+
+	/* the last added key encrypts new tickets */
+	for (int i = 0; i < TICKET_KEYS; i++) {
+		if (tf.keys[i].keyrev == 0)
+			continue;
+		if (tls_config_add_ticket_key(tls_config, tf.keys[i].keyrev,
+		    tf.keys[i].key, sizeof tf.keys[i].key) == -1)
+			errx(EXIT_FAILURE, "tls_config_add_ticket_key: %s",
+			    tls_config_error(tls_config));
+	}
+
+	explicit_bzero(&tf, sizeof tf);
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct tls *tls = NULL;
 	struct tls *cctx = NULL;
 	struct tls_config *tls_config = NULL;
+	struct tls_relay_conf relay = { RELAY_BUFSIZ, true, 0, 0 };
+	const char *errstr = NULL;
+	int timeout = 0;
 	int ch;
 
 #ifdef __OpenBSD__
@@ -59,8 +105,15 @@ main(int argc, char *argv[])
 	if ((tls_config = tls_config_new()) == NULL)
 		err(EXIT_FAILURE, "tls_config_new");
 
-	while ((ch = getopt(argc, argv, "Cc:k:p:f:r:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:Cc:i:k:p:f:r:K:o:Rt:w:")) != -1) {
 		switch (ch) {
+		case 'b':
+			relay.bufsize = strtonum(optarg, 512, 1024 * 1024,
+			    &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "buffer size is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'C':
 			tls_config_verify_client(tls_config);
 			break;
@@ -68,6 +121,12 @@ main(int argc, char *argv[])
 			if (tls_config_set_cert_file(tls_config, optarg) == -1)
 				err(EXIT_FAILURE, "tls_config_set_cert_file");
 			break;
+		case 'i':
+			relay.idle = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "idle timeout is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'k':
 			if (tls_config_set_key_file(tls_config, optarg) == -1)
 				err(EXIT_FAILURE, "tls_config_set_key_file");
@@ -84,6 +143,31 @@ main(int argc, char *argv[])
 			if (tls_config_set_crl_file(tls_config, optarg) == -1)
 				err(EXIT_FAILURE, "tls_config_set_crl_file");
 			break;
+		case 'K':
+			ticket_keys(tls_config, optarg);
+			break;
+		case 'R':
+			relay.dynamic = false;
+			break;
+		case 't':
+			timeout = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "timeout is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'w':
+			relay.stall = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "stall timeout is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'o':
+			/* serve without staple, if the refresher failed */
+			if (tls_config_set_ocsp_staple_file(tls_config, optarg)
+			    == -1)
+				warnx("tls_config_set_ocsp_staple_file: %s",
+				    tls_config_error(tls_config));
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -102,8 +186,7 @@ main(int argc, char *argv[])
 	if (tls_accept_fds(tls, &cctx, STDIN_FILENO, STDOUT_FILENO) == -1)
 		errx(EXIT_FAILURE, "tls_accept_fds: %s", tls_error(tls));
 
-	if (tls_handshake(cctx) == -1)
-		errx(EXIT_FAILURE, "tls_handshake: %s", tls_error(cctx));
+	tls_relay_handshake(cctx, READ_FD, WRITE_FD, timeout);
 
 	if (setenv("PROTO", "SSL", 1) == -1)
 		err(EXIT_FAILURE, "setenv");
@@ -152,49 +235,5 @@ main(int argc, char *argv[])
 	int in = pi[PIPE_READ];
 	int out = po[PIPE_WRITE];
 
-	/* communication loop */
-	for (;;) {
-		int ret;
-		char buf[BUFSIZ];
-		ssize_t sn = 0;
-		fd_set readfds;
-		FD_ZERO(&readfds);
-		FD_SET(in, &readfds);
-		FD_SET(READ_FD, &readfds);
-		int max_fd = MAX(in, READ_FD);
-
-		ret = select(max_fd+1, &readfds, NULL, NULL, NULL);
-		if (ret == -1)
-			err(EXIT_FAILURE, "select");
-
-		if (FD_ISSET(READ_FD, &readfds)) {
-			do {
- again:
-				sn = tls_read(cctx, buf, sizeof buf);
-				if (sn == TLS_WANT_POLLIN ||
-				    sn == TLS_WANT_POLLOUT)
-					goto again;
-				if (sn == -1)
-					errx(EXIT_FAILURE, "tls_read: %s",
-					    tls_error(cctx));
-				if (sn == 0)
-					return EXIT_SUCCESS;
-				if (write(out, buf, sn) == -1)
-					err(EXIT_FAILURE, "write");
-			} while (sn == sizeof buf);
-		} else if (FD_ISSET(in, &readfds)) {
-			if ((sn = read(in, buf, sizeof buf)) == -1)
-				err(EXIT_FAILURE, "read");
-			if (sn == 0) /* EOF from inside */
-				goto out;
-			/* XXX: unable to detect disconnect here */
-			if (tls_write(cctx, buf, sn) == -1)
-				errx(EXIT_FAILURE, "tls_write: %s",
-				    tls_error(cctx));
-		}
-	}
-
- out:
-	tls_close(cctx);
-	return EXIT_SUCCESS;
+	return tls_relay(cctx, READ_FD, WRITE_FD, in, out, &relay);
 }